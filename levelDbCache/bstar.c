@@ -403,6 +403,24 @@ void
 	strncpy (base_params->addressbackup, "tcp://localhost", MAXLEN);
 	strncpy (base_params->portbackup, "5566", MAXLEN);
 	strncpy (base_params->cacheids[0] , "0", MAXLEN);
+	base_params->batchMax = 256;
+	base_params->batchDelay = 0;
+	base_params->persistRing = PERSISTER_RING_SIZE;
+	base_params->statsInterval = 10000;
+	base_params->durability = DURABILITY_ASYNC;
+	base_params->nbr_durabilities = 0;
+	base_params->syncInterval = 1000;
+	base_params->recoveryThreads = 4;
+	base_params->memoryLimit = 0;
+	base_params->nbr_memorylimits = 0;
+	base_params->pendingMax = 100000;
+	base_params->pendingAge = 60000;
+	base_params->compactWire = 0;
+	base_params->publishBatch = 0;
+	base_params->conflateInterval = 0;
+	base_params->subscribeConflated = 0;
+	base_params->topicWire = 0;
+	base_params->updateRing = 0;
 	params->bases[params->nbr_bases] = base_params;
 }
 
@@ -430,6 +448,45 @@ char *
 	return s;
 }
 
+/*
+* durability: map a durability mode name to its DURABILITY_ value,
+*       -1 if the name is unknown
+*/
+static int
+	s_durability_mode (char *name)
+{
+	if (streq (name, "none") || streq (name, "memory"))
+		return DURABILITY_NONE;
+	else if (streq (name, "async"))
+		return DURABILITY_ASYNC;
+	else if (streq (name, "periodic"))
+		return DURABILITY_PERIODIC;
+	else if (streq (name, "sync"))
+		return DURABILITY_SYNC;
+	return -1;
+}
+
+int
+	base_durability (base_parameters *base_params, char *cacheidstr)
+{
+	int index;
+	for (index = 0; index < base_params->nbr_durabilities; index++)
+		if (streq (cacheidstr, base_params->durabilityids[index]))
+			return base_params->durabilities[index];
+	return base_params->durability;
+}
+
+size_t
+	base_memory_limit (base_parameters *base_params, char *cacheidstr)
+{
+	int index;
+	int limit = base_params->memoryLimit;
+	for (index = 0; index < base_params->nbr_memorylimits; index++)
+		if (streq (cacheidstr, base_params->memorylimitids[index]))
+			limit = base_params->memorylimits[index];
+	return (size_t) limit * 1024 * 1024;
+}
+
 /*
 * parse external parameters file
 *
@@ -493,9 +550,19 @@ void
 			char *token=strtok(value, ",");
 			base_params->nbr_memcaches = 0;
 			while(token != NULL) {
+				int cacheid;
 				zclock_log ("E: parse_base_config cacheids name %s value %s token %s", name, value, token);
-				strncpy (base_params->cacheids[base_params->nbr_memcaches], token, MAXLEN);
-				base_params->nbr_memcaches++;
+				//  Caches are routed by the hash of their id, two ids with
+				//  the same hash would share one cache: refuse the second
+				for (cacheid = 0; cacheid < base_params->nbr_memcaches; cacheid++)
+					if (kvmsg_hash_cacheid (base_params->cacheids[cacheid]) == kvmsg_hash_cacheid (token))
+						break;
+				if (cacheid < base_params->nbr_memcaches)
+					zclock_log ("E: parse_base_config cache %s has the same hash as cache %s, rename it, cache ignored", token, base_params->cacheids[cacheid]);
+				else {
+					strncpy (base_params->cacheids[base_params->nbr_memcaches], token, MAXLEN);
+					base_params->nbr_memcaches++;
+				}
 				token=strtok(NULL, ",");
 				zclock_log ("E: parse_base_config cacheids2 name %s value %s token %s", name, value, token);
 			}
@@ -510,12 +577,86 @@ void
 			strncpy (base_params->addressbackup, value, MAXLEN);
 		else if (streq(name, "portbackup"))
 			strncpy (base_params->portbackup, value, MAXLEN);
+		else if (streq(name, "batchMax"))
+			base_params->batchMax = atoi(value);
+		else if (streq(name, "batchDelay"))
+			base_params->batchDelay = atoi(value);
+		else if (streq(name, "persistRing"))
+			base_params->persistRing = atoi(value);
+		else if (streq(name, "statsInterval"))
+			base_params->statsInterval = atoi(value);
+		else if (streq(name, "syncInterval"))
+			base_params->syncInterval = atoi(value);
+		else if (streq(name, "recoveryThreads"))
+			base_params->recoveryThreads = atoi(value);
+		else if (streq(name, "pendingMax"))
+			base_params->pendingMax = max (atoi (value), 0);
+		else if (streq(name, "pendingAge"))
+			base_params->pendingAge = max (atoi (value), 0);
+		else if (streq(name, "compactWire"))
+			base_params->compactWire = atoi(value);
+		else if (streq(name, "publishBatch"))
+			base_params->publishBatch = max (atoi (value), 0);
+		else if (streq(name, "conflateInterval"))
+			base_params->conflateInterval = max (atoi (value), 0);
+		else if (streq(name, "subscribeConflated"))
+			base_params->subscribeConflated = atoi(value);
+		else if (streq(name, "topicWire"))
+			base_params->topicWire = atoi(value);
+		else if (streq(name, "updateRing"))
+			base_params->updateRing = max (atoi (value), 0);
+		else if (streq(name, "memoryLimit")) {
+			//  memoryLimit=<MB> or memoryLimit=<cacheid>:<MB>,...
+			char *token=strtok(value, ",");
+			while(token != NULL) {
+				char *limit = strchr (token, ':');
+				if (limit)
+					*limit++ = 0;
+				if (!limit)
+					base_params->memoryLimit = max (atoi (token), 0);
+				else if (base_params->nbr_memorylimits < CACHE_MAX) {
+					strncpy (base_params->memorylimitids[base_params->nbr_memorylimits], token, MAXLEN);
+					base_params->memorylimits[base_params->nbr_memorylimits++] = max (atoi (limit), 0);
+				}
+				token=strtok(NULL, ",");
+			}
+		}
+		else if (streq(name, "durability")) {
+			//  durability=<mode> or durability=<cacheid>:<mode>,...
+			char *token=strtok(value, ",");
+			while(token != NULL) {
+				char *modename = strchr (token, ':');
+				int mode;
+				if (modename)
+					*modename++ = 0;
+				mode = s_durability_mode (modename? modename: token);
+				if (mode == -1)
+					zclock_log ("E: parse_base_config unknown durability %s", token);
+				else if (!modename)
+					base_params->durability = mode;
+				else if (base_params->nbr_durabilities < CACHE_MAX) {
+					strncpy (base_params->durabilityids[base_params->nbr_durabilities], token, MAXLEN);
+					base_params->durabilities[base_params->nbr_durabilities++] = mode;
+				}
+				token=strtok(NULL, ",");
+			}
+		}
 		else
 			zclock_log ("E: %s/%s: Unknown name/value pair!", name, value);
 	}
 	/* Close file */
 	fclose (fp);
-	zclock_log ("I: parse_base_config databasePath: %s, port: %d, peer: %d", base_params->databasePath, base_params->port, base_params->peer);
+	if (base_params->batchMax < 1)
+		base_params->batchMax = 1;
+	if (base_params->batchDelay < 0)
+		base_params->batchDelay = 0;
+	if (base_params->persistRing < 1)
+		base_params->persistRing = PERSISTER_RING_SIZE;
+	if (base_params->syncInterval < 1)
+		base_params->syncInterval = 1000;
+	if (base_params->recoveryThreads < 1)
+		base_params->recoveryThreads = 1;
+	zclock_log ("I: parse_base_config databasePath: %s, port: %d, peer: %d, batchMax: %d, batchDelay: %d", base_params->databasePath, base_params->port, base_params->peer, base_params->batchMax, base_params->batchDelay);
 }
 
 void
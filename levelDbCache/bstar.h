@@ -29,6 +29,10 @@ License along with this program. If not, see
 
 #include "czmq.h"
 #include "leveldb\c.h"
+#include "persister.h"
+#include "kvmap.h"
+#include "ttlwheel.h"
+#include "pending.h"
 
 //  Arguments for constructor
 #define BSTAR_PRIMARY   1
@@ -38,7 +42,14 @@ License along with this program. If not, see
 #define CACHE_MAX       16 //A adapter
 #define MAXLEN 255
 #define DUMP_EXT "kvm"
+//  Durability modes of a memcache
+#define DURABILITY_NONE      0   //  Memory only, no LevelDB at all
+#define DURABILITY_ASYNC     1   //  Written behind by the persister
+#define DURABILITY_PERIODIC  2   //  Written behind, fsync'ed every syncInterval
+#define DURABILITY_SYNC      3   //  Every commit fsync'ed before returning
 #define SET_EXT "set"
+//  Buckets of the publisher batching histograms, by powers of two
+#define PACK_HISTOGRAM      16
 
 #ifdef __cplusplus
 extern "C" {
@@ -59,6 +70,28 @@ extern "C" {
 		char portprimary[MAXLEN];
 		char addressbackup[MAXLEN];
 		char portbackup[MAXLEN];	
+		int batchMax;               //  Max updates committed per collector wakeup
+		int batchDelay;             //  Max msecs to wait for a batch to fill
+		int persistRing;            //  Write batches the persister can queue
+		int statsInterval;          //  Msecs between statistics logs, 0 = off
+		int durability;             //  Durability of caches not listed below
+		int nbr_durabilities;
+		char durabilityids[CACHE_MAX][MAXLEN];
+		int durabilities[CACHE_MAX];
+		int syncInterval;           //  Msecs between fsyncs in periodic mode
+		int recoveryThreads;        //  Threads loading caches on activation
+		int memoryLimit;            //  MB a cache may hold in memory, 0 = no limit
+		int nbr_memorylimits;
+		char memorylimitids[CACHE_MAX][MAXLEN];
+		int memorylimits[CACHE_MAX];
+		int pendingMax;             //  Updates a passive cache may hold, 0 = no limit
+		int pendingAge;             //  Msecs a passive cache holds an update, 0 = no limit
+		int compactWire;            //  1 to publish compact kvmsgs, once all clients read them
+		int publishBatch;           //  Bytes of updates published as one message, 0 = off
+		int conflateInterval;       //  Msecs between conflated publishes on port+3, 0 = off
+		int subscribeConflated;     //  Clients: 1 to subscribe to conflated updates
+		int topicWire;              //  1 to publish behind "<cacheid>/<key>" topics, on servers and clients
+		int updateRing;             //  Updates a cache keeps for clients catching up, 0 = off
 	};
 
 	typedef struct _base_parameters base_parameters;
@@ -78,12 +111,45 @@ extern "C" {
 
 	typedef struct {
 		char cacheidstr[MAXLEN+16]; //  id of cache
+		uint cachehash;             //  Hash of id, in message headers
 		void *base;		        // server
-		zhash_t *kvmap;             //  Key-value store
+		kvmap_t *kvmap;             //  Key-value store
 		int64_t sequence;           //  How many updates we're at
-		zlist_t *pending;           //  Pending updates from clients
+		pending_t *pending;         //  Pending updates from clients
 		leveldb_t *db ;             //Persistence datatbase
 		leveldb_options_t *dbOptions; //persistence Options
+		leveldb_writeoptions_t *writeOptions; //persistence write Options
+		leveldb_writeoptions_t *syncOptions; //  fsync'ing write Options
+		int durability;             //  One of the DURABILITY_ modes
+		int64_t synced;             //  Sequence covered by last fsync
+		leveldb_writebatch_t *batch; //  Updates waiting for group commit
+		uint batched;               //  Number of updates in batch
+		byte *record;               //  Scratch buffer for persisted records
+		size_t record_size;
+		volatile int64_t persisted; //  Last sequence written by the persister
+		size_t size_hint;           //  Number of keys persisted at last commit
+		int64_t reserved;           //  Sequence reserved in SEQUENCENUMBER
+		Bool warming;               //  TRUE while recovery is filling kvmap
+		uint streaming;             //  Snapshots reading its LevelDB
+		kvmap_t *tombstones;        //  Keys deleted while warming
+		size_t memory_limit;        //  Bytes the kvmap may hold, 0 = no limit
+		size_t clock_hand;          //  Position of CLOCK eviction in kvmap
+		ttlwheel_t *ttls;           //  Keys with a TTL, by expiry
+		int64_t evictions;          //  Entries evicted to LevelDB
+		int subscribers;            //  Client subscriptions that get this cache
+		int64_t unpublished;        //  Updates no client subscribed to
+		kvmsg_t **ring;             //  Last updates, oldest first from ring_head
+		uint ring_max;              //  Updates ring may hold, 0 = no ring
+		uint ring_head;
+		uint ring_count;
+		size_t ring_bytes;          //  Keys and bodies the ring holds
+		int64_t catchups;           //  GETSINCE answered from the ring
+		int64_t catchup_snapshots;  //  GETSINCE answered with a snapshot
+		int64_t takeover;           //  Sequence when we became active
+		int64_t epoch;              //  Client: epoch of server sequence is from
+		Bool resyncing;             //  Client: TRUE while a new snapshot comes
+		kvmap_t *resync;            //  Client: kvmap that snapshot fills
+		Bool delta;                 //  Client: TRUE if updates come instead
 		char *dbPath;              // path de la base de donnes
 	} memcache_t;
 	
@@ -98,9 +164,34 @@ extern "C" {
 		char cacheids [CACHE_MAX][MAXLEN];
 		int port;                   //  Main port we're working on
 		int peer;                   //  Main port of our peer
-		void *publisher;            //  Publish updates and hugz
+		void *publisher;            //  Publish updates and hugz to clients
+		void *replicator;           //  Publish every update to our peer
 		void *collector;            //  Collect updates from clients
 		void *subscriber;           //  Get updates from peer
+		uint batch_max;             //  Max updates per group commit
+		int batch_delay;            //  Max msecs to wait for a group commit
+		persister_t *persister;     //  Write-behind LevelDB thread
+		Bool stalled;               //  TRUE while its ring is full, and we don't read the collector
+		uint recovery_threads;      //  Threads loading caches on activation
+		void *recovery;             //  Caches being recovered, if any
+		uint recovering;            //  Recovery threads still running
+		Bool compact;               //  TRUE if we publish compact kvmsgs
+		Bool topics;                //  TRUE if we publish behind topic frames
+		byte *pack;                 //  Updates waiting to be published as one message
+		size_t pack_size;
+		size_t pack_max;            //  Bytes a pack may hold, 0 if we don't pack
+		uint pack_count;            //  Updates in pack
+		uint pack_cachehash;        //  Cache of updates in pack, if we publish topics
+		Bool pack_subscribed;       //  TRUE if some client gets an update in pack
+		int64_t pack_started;       //  When first update went into pack, in usecs
+		int64_t pack_updates [PACK_HISTOGRAM];  //  Packs sent, by log2 of updates
+		int64_t pack_usecs [PACK_HISTOGRAM];    //  Packs sent, by log2 of usecs waited
+		void *conflater;            //  Publish latest update of each key, if any
+		zhash_t *conflated;         //  Latest unsent update of each key
+		int64_t conflations;        //  Updates replaced before conflater sent them
+		int64_t epoch;              //  When we became active, tags our sequences
+		zlist_t *snapshots;         //  Snapshot requests, served oldest first
+		Bool snapshot_timer;        //  TRUE while a timer goes on with them
 	} base_t;
 
 		//  Our server is defined by these properties
@@ -147,6 +238,12 @@ extern "C" {
 
 	void parse_config (char * params_filePath);
 
+	//  Return durability mode configured for cache of base
+	int base_durability (base_parameters *base_params, char *cacheidstr);
+
+	//  Return memory limit in bytes configured for cache of base, 0 if none
+	size_t base_memory_limit (base_parameters *base_params, char *cacheidstr);
+
 #ifdef __cplusplus
 }
 #endif
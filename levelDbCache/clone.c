@@ -42,7 +42,9 @@ License along with this program. If not, see
 
 //  This is the thread that handles our real clone class
 static void clone_agent (void *args, zctx_t *ctx, void *pipe);
-static memcache_t *memcache_new (uint cacheid);
+static byte *agent_read (void *args, char *cacheidstr, char *key, size_t *size);
+static byte *agent_read_many (void *args, char *cacheidstr, char **keys, size_t count, byte **values, size_t *sizes);
+static memcache_t *memcache_new (char *cacheidstr);
 static void	memcache_destroy (memcache_t **memcache_p);
 
 void AddListnerForSnapshot(clone_t *clone,PRETURNUNCALLBACENDSNAPSHOT pReturnCallbcksnapshot)
@@ -57,6 +59,28 @@ void AddListnerForUpdate(clone_t *clone,PRETURNUNCALLBACKUPDATE pReturnCallbckup
 	clone->pReturnCallbckupdate= pReturnCallbckupdate ;
 }
 
+//  Binary listeners get the value with its size, and may be set next to
+//  the string listeners above
+void AddListnerForSnapshotBin(clone_t *clone,PRETURNUNCALLBACKBIN pReturnCallbcksnapshotBin)
+{
+	assert (clone);
+	clone->pReturnCallbcksnapshotBin= pReturnCallbcksnapshotBin ;
+}
+
+void AddListnerForUpdateBin(clone_t *clone,PRETURNUNCALLBACKBIN pReturnCallbckupdateBin)
+{
+	assert (clone);
+	clone->pReturnCallbckupdateBin= pReturnCallbckupdateBin ;
+}
+
+//  Published listeners learn when an update of clone_set_async was
+//  published, see there
+void AddListnerForPublished(clone_t *clone,PRETURNUNCALLBACKPUBLISHED pReturnCallbckpublished)
+{
+	assert (clone);
+	clone->pReturnCallbckpublished= pReturnCallbckpublished ;
+}
+
 //  .split constructor and destructor
 //  Constructor and destructor for the clone class:
 
@@ -113,6 +137,27 @@ void clone_subtree (clone_t *clone, char *subtree)
 	assert (streq (clonethreadstate, "ready"));
 }
 
+//  .split subscribe method
+//  Choose a cache to work with, do before connect. The client then only
+//  holds the caches it chose, instead of all caches of its configuration,
+//  and with topicWire, only gets updates for them.
+//  Sends [SUBSCRIBE][cacheid] to the agent:
+
+void
+	clone_subscribe (clone_t *clone, char *cacheidstr)
+{
+	zmsg_t *msg;
+	char *clonethreadstate;
+	assert (clone);
+	msg = zmsg_new ();
+	zmsg_addstr (msg, "SUBSCRIBE");
+	zmsg_addstr (msg, cacheidstr);
+	zmsg_send (&msg, clone->pipe);
+	clonethreadstate = zstr_recv(clone->pipe);
+	assert (streq (clonethreadstate, "ready"));
+	free (clonethreadstate);
+}
+
 //  .split connect method
 //  Connect to new server endpoint.
 //  Sends [CONNECT][endpoint][service] to the agent:
@@ -143,23 +188,18 @@ void
 }
 
 static int
-	s_print_single (const char *key, void *data, void *args)
+	s_print_single (kventry_t *entry, void *args)
 {
 	int64_t sequence;
+	char *key;
 	char *body;
 	int size;
 	char *fileName;
 	extern struct clone_parameters *params;
 	memcache_t *memcache = (memcache_t *) args;
-	kvmsg_t *kvmsg = (kvmsg_t *) data;
-	size = kvmsg_size(kvmsg) ;
-	sequence = kvmsg_sequence (kvmsg);
-	if (size) {
-		body= (char*) kvmsg_body(kvmsg) ;
-	}
-	else {
-		body = "";
-	}
+	key = kventry_key (entry);
+	sequence = kventry_sequence (entry);
+	body = (char *) kventry_value (entry);
 	fileName = (char *) malloc ( sizeof(params->logPath) + sizeof(params->ModuleName) + sizeof(memcache->cacheidstr) + sizeof(DUMP_EXT) + 4 * sizeof(char) +1 );
 	size = snprintf(NULL, 0 , "%s%s%s%s", params->logPath, params->ModuleName, memcache->cacheidstr, DUMP_EXT);
 	snprintf(fileName, size + 1, "%s%s%s%s", params->logPath, params->ModuleName, memcache->cacheidstr, DUMP_EXT);
@@ -176,73 +216,186 @@ static int
 	assert(memcache);
 	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: s_print_kvm cache=%s", memcache->cacheidstr);
 	if (memcache->kvmap)
-		zhash_foreach (memcache->kvmap, s_print_single, memcache);
+		kvmap_foreach (memcache->kvmap, s_print_single, memcache);
 	return 0;
 }
 
 //  .split set method
 //  Set new value in distributed hash table.
-//  Sends [SET][key][value][cacheid] to the agent:
+//  Sends [SET][key][cacheid][value][ttl] to the agent, and waits for it
+//  to be ready, or [SETASYNC][key][cacheid][value][ttl][hint] without
+//  waiting. The agent takes the value frame as body of the update, so
+//  the value is not copied again on its way to the servers:
 
-void
-	clone_set (clone_t *clone, char *cacheidstr, char *key, char *value, int ttl)
+static void
+	s_clone_set (clone_t *clone, char *cacheidstr, char *key, zframe_t *value, int ttl, Bool async, void *hint)
 {
 	zmsg_t *msg;
 	char *clonethreadstate;
 	char ttlstr [10];
 	char *fileName;
 	int size;
-	FILE *fp;
 	extern struct clone_parameters *params;
 	assert (clone);
 
 	sprintf (ttlstr, "%d", ttl);
-	if (DEBUG) {
+	if (DEBUG && zframe_size (value) && zframe_data (value) [zframe_size (value) - 1] == 0) {
 		fileName = (char *) malloc ( sizeof(params->logPath) + sizeof(params->ModuleName) + sizeof(cacheidstr) + sizeof(SET_EXT) + 4 * sizeof(char) +1 );
 		size = snprintf(NULL, 0 , "%s%s%s", params->logPath, params->ModuleName, cacheidstr, SET_EXT);
 		snprintf(fileName, size + 1, "%s%s%s", params->logPath, params->ModuleName, cacheidstr, SET_EXT);
-		clone_printString (fileName, key, value);
+		clone_printString (fileName, key, (char *) zframe_data (value));
 		free(fileName);
 	}
 	msg = zmsg_new ();
-	zmsg_addstr (msg, "SET");
+	zmsg_addstr (msg, async? "SETASYNC": "SET");
 	zmsg_addstr (msg, key);	
 	zmsg_addstr (msg, cacheidstr);
-	zmsg_addstr (msg, value);
+	zmsg_add    (msg, value);
 	zmsg_addstr (msg, ttlstr);
+	if (async) {
+		zmsg_addmem (msg, &hint, sizeof (hint));
+		zmsg_send (&msg, clone->pipe);
+		return;
+	}
 	zmsg_send (&msg, clone->pipe);
 	clonethreadstate = zstr_recv(clone->pipe);
 	//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "UC clone_set assert ready get : %s", clonethreadstate);
 	assert (streq (clonethreadstate, "ready"));
+	free (clonethreadstate);
 }
 
-//  .split get method
-//  Lookup value in distributed hash table.
-//  Sends [GET][key] to the agent and waits for a value response.
-//  If there is no clone available, will eventually return NULL:
+//  The value is copied once, into the frame for the agent, with its
+//  terminating null
+void
+	clone_set (clone_t *clone, char *cacheidstr, char *key, char *value, int ttl)
+{
+	s_clone_set (clone, cacheidstr, key, zframe_new (value, strlen (value) + 1), ttl, FALSE, NULL);
+}
 
-char *
-	clone_get (clone_t *clone, char *cacheidstr, char *key)
+//  Value is any size bytes, and may hold nulls; it is stored and read
+//  back with exactly that size. A size of zero deletes the key.
+void
+	clone_set_bin (clone_t *clone, char *cacheidstr, char *key, byte *value, size_t size, int ttl)
+{
+	assert (value || !size);
+	s_clone_set (clone, cacheidstr, key, zframe_new (value, size), ttl, FALSE, NULL);
+}
+
+//  The value is not copied at all: the frame for the agent wraps the
+//  caller's buffer, and free_fn (value, hint) is called once the update
+//  has gone to all servers. Like clone_set_bin, value is size bytes.
+void
+	clone_set_owned (clone_t *clone, char *cacheidstr, char *key, byte *value, size_t size, int ttl, zmq_free_fn *free_fn, void *hint)
+{
+	assert (value);
+	s_clone_set (clone, cacheidstr, key, zframe_new_zero_copy (value, size, free_fn, hint), ttl, FALSE, NULL);
+}
+
+//  Like clone_set_bin, but returns as soon as the update is queued to
+//  the agent, without waiting for it. Sets from one thread still go to
+//  the servers in order. With a listener set by AddListnerForPublished,
+//  the agent calls it with hint once the update comes back published by
+//  the server, with its sequence. It calls it with sequence 0 when it
+//  gives up on the update: when we fail over, or when the update is not
+//  back after PUBLISHED_TTL msecs, as for keys we don't get from the
+//  server. Conflated updates skip most of ours, so with a listener and
+//  subscribeConflated the set is refused. Returns 0, or -1 if refused.
+int
+	clone_set_async (clone_t *clone, char *cacheidstr, char *key, byte *value, size_t size, int ttl, void *hint)
+{
+	extern struct clone_parameters *params;
+	assert (clone);
+	assert (value || !size);
+	if (clone->pReturnCallbckpublished && params->bases [0]->subscribeConflated) {
+		clone_log(LOG_LEVEL_ERROR, LOG_TYPE_CLONE, "E: clone_set_async key %s refused, published listener with subscribeConflated", key);
+		return -1;
+	}
+	s_clone_set (clone, cacheidstr, key, zframe_new (value, size), ttl, TRUE, hint);
+	return 0;
+}
+
+//  .split mset method
+//  Set many values in distributed hash table, in one round trip to the
+//  agent and one message to the servers, which apply them as count
+//  updates in a row. Sends [MSET][cacheid][ttl] and then [key][value]
+//  for each value. An empty value deletes its key. The servers would
+//  drop a batch from a key too long on, so such a call sets nothing:
+
+void
+	clone_mset (clone_t *clone, char *cacheidstr, char **keys, byte **values, size_t *sizes, size_t count, int ttl)
 {
 	zmsg_t *msg;
-	zmsg_t *reply;
+	size_t index;
 	char *clonethreadstate;
-
+	char ttlstr [10];
 	assert (clone);
-	assert (key);
+	assert (keys || !count);
+
+	for (index = 0; index < count; index++)
+		if (strlen (keys [index]) > KVMSG_KEY_MAX) {
+			clone_log(LOG_LEVEL_ERROR, LOG_TYPE_CLONE, "E: clone_mset key %.32s... longer than %d, nothing set", keys [index], KVMSG_KEY_MAX);
+			return;
+		}
+	sprintf (ttlstr, "%d", ttl);
 	msg = zmsg_new ();
-	zmsg_addstr (msg, "GET");
-	zmsg_addstr (msg, key);
+	zmsg_addstr (msg, "MSET");
 	zmsg_addstr (msg, cacheidstr);
+	zmsg_addstr (msg, ttlstr);
+	for (index = 0; index < count; index++) {
+		zmsg_addstr (msg, keys [index]);
+		zmsg_addmem (msg, values [index], sizes [index]);
+	}
 	zmsg_send (&msg, clone->pipe);
+	clonethreadstate = zstr_recv(clone->pipe);
+	assert (streq (clonethreadstate, "ready"));
+	free (clonethreadstate);
+}
 
-	reply = zmsg_recv (clone->pipe);
-	if (reply) {
-		char *value = zmsg_popstr (reply);
-		zmsg_destroy (&reply);
-		return value;
-	}
-	return NULL;
+//  .split get method
+//  Lookup value in distributed hash table. We read the kvmap of the
+//  agent from the application thread, without asking the agent, see
+//  agent_read. Any number of application threads may do so at once.
+//  Returns a fresh copy of the value that the caller must free, or ""
+//  if the key is not there:
+
+char *
+	clone_get (clone_t *clone, char *cacheidstr, char *key)
+{
+	size_t size;
+	char *value;
+
+	assert (clone);
+	assert (key);
+	value = (char *) agent_read (clone->agent, cacheidstr, key, &size);
+	return value? value: strdup ("");
+}
+
+//  Lookup value in distributed hash table, with its size. Returns a
+//  fresh copy of the value that the caller must free, or NULL if the key
+//  is not there:
+
+byte *
+	clone_get_bin (clone_t *clone, char *cacheidstr, char *key, size_t *size)
+{
+	assert (clone);
+	assert (key);
+	assert (size);
+	return agent_read (clone->agent, cacheidstr, key, size);
+}
+
+//  Lookup count keys in one pass, for applications that want many at
+//  once. Sets values [n] and sizes [n] for each key, or NULL and 0 if the
+//  key is not there. The values are null-terminated, and all held in
+//  one buffer that is returned, and that the caller must free once:
+
+byte *
+	clone_mget (clone_t *clone, char *cacheidstr, char **keys, size_t count, byte **values, size_t *sizes)
+{
+	assert (clone);
+	assert (keys || !count);
+	assert (values || !count);
+	assert (sizes || !count);
+	return agent_read_many (clone->agent, cacheidstr, keys, count, values, sizes);
 }
 
 //  .split working with servers
@@ -275,9 +428,11 @@ static server_t *
 	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: server_new adding subscriber new");
 	server->subscriber = zsocket_new (ctx, ZMQ_SUB);
 	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: server_new adding subscriber connect");
-	subscriber_result = zsocket_connect (server->subscriber, "%s:%d", address, port + 1);
+	//  Conflated updates, if we asked for them, are published on port+3
+	subscriber_result = zsocket_connect (server->subscriber, "%s:%d", address, port + (params->bases [0]->subscribeConflated? 3: 1));
 	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: server_new adding server %s:%d... snapshot_result=%d subscriber_result=%d subtree=%s", address, port, snapshot_result, subscriber_result, subtree);
-	zsockopt_set_subscribe (server->subscriber, subtree);
+	if (subtree)
+		zsockopt_set_subscribe (server->subscriber, subtree);
 	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: server_new RETURN");
 	return server;
 }
@@ -308,6 +463,19 @@ static void
 #define STATE_SYNCING       1   //  Getting state from server
 #define STATE_ACTIVE        2   //  Getting new updates from server
 
+//  Async sets we wait for, see clone_set_async
+#define PUBLISHED_TTL   30000   //  msecs
+#define PUBLISHED_MAX   100000
+
+//  An async set, till the server publishes it
+typedef struct {
+	char uuidstr [33];          //  Its uuid, key in agent->published
+	char *key;                  //  Its key, for the listener
+	void *hint;                 //  Hint of the application
+	int64_t expiry;             //  When we give up on it
+	Bool done;                  //  TRUE once published
+} published_t;
+
 typedef struct {
 	zctx_t *ctx;                //  Context wrapper
 	void *pipe;                 //  Pipe back to application
@@ -319,18 +487,35 @@ typedef struct {
 	uint nbr_servers;           //  0 to SERVER_MAX
 	uint state;                 //  Current state
 	uint cur_server;            //  If active, server 0 or 1
-	int64_t sequence;           //  Last kvmsg processed
+	Bool gapless;               //  TRUE if we get every update of our caches
+	zlist_t *resyncs;           //  Caches waiting for a snapshot, in order asked
 	void *publisher;            //  Outgoing updates
+	Bool compact;               //  TRUE if our server reads compact kvmsgs
+	Bool topics;                //  TRUE if updates come behind topic frames
+	Bool subscribed;            //  TRUE if application chose its caches
+	rcu_t *rcu;                 //  Application threads reading our kvmaps
 	PRETURNUNCALLBACENDSNAPSHOT pReturnCallbcksnapshot;
 	PRETURNUNCALLBACKUPDATE pReturnCallbckupdate;
+	PRETURNUNCALLBACKBIN pReturnCallbcksnapshotBin;
+	PRETURNUNCALLBACKBIN pReturnCallbckupdateBin;
+	PRETURNUNCALLBACKPUBLISHED pReturnCallbckpublished;
+	zhash_t *published;         //  Async sets till published, by uuid
+	zlist_t *publishing;        //  The same, oldest first, done or not
 } agent_t;
 
 static void
 	agent_addcache (agent_t *agent, char *cacheidstr)
 {
+	int cacheid;
+	uint cachehash = kvmsg_hash_cacheid (cacheidstr);
 	assert (agent);
+	for (cacheid = 0; cacheid < agent->nbr_memcaches; cacheid++)
+		if (agent->memcaches [cacheid]->cachehash == cachehash) {
+			clone_log(LOG_LEVEL_ERROR, LOG_TYPE_CLONE, "E: agent_addcache cache %s has the same hash as cache %s, rename it, cache not added", cacheidstr, agent->memcaches [cacheid]->cacheidstr);
+			return;
+		}
 	strcpy(agent->cacheids[agent->nbr_memcaches], cacheidstr);
-	agent->memcaches [agent->nbr_memcaches] = memcache_new (agent->nbr_memcaches);
+	agent->memcaches [agent->nbr_memcaches] = memcache_new (cacheidstr);
 	agent->nbr_memcaches++;
 }
 
@@ -349,8 +534,13 @@ static agent_t *
 		agent_addcache (agent, base_params->cacheids[cacheid]);
 	}
 	agent->subtree = strdup ("");
+	agent->topics = base_params->topicWire != 0;
 	agent->state = STATE_INITIAL;
 	agent->publisher = zsocket_new (agent->ctx, ZMQ_PUB);
+	agent->rcu = rcu_new ();
+	agent->published = zhash_new ();
+	agent->publishing = zlist_new ();
+	agent->resyncs = zlist_new ();
 	return agent;
 }
 
@@ -366,6 +556,15 @@ static void
 			server_destroy (&agent->server [server_nbr]);
 		for (cacheid = 0; cacheid < agent->nbr_memcaches; cacheid++)
 			memcache_destroy (&agent->memcaches [cacheid]);
+		rcu_destroy (&agent->rcu);
+		zhash_destroy (&agent->published);
+		while (zlist_size (agent->publishing)) {
+			published_t *published = (published_t *) zlist_pop (agent->publishing);
+			free (published->key);
+			free (published);
+		}
+		zlist_destroy (&agent->publishing);
+		zlist_destroy (&agent->resyncs);
 		free (agent->subtree);
 		free (agent);
 		*agent_p = NULL;
@@ -383,20 +582,123 @@ static memcache_t *
 	return NULL;
 }
 
+//  Updates name their cache by hash, see kvmsg_hash_cacheid
 static int
-	agent_getcacheid (agent_t *agent, char *cacheidstr)
+	agent_findcacheid (agent_t *agent, uint cachehash)
 {
 	int cacheid;
 	assert (agent);
 	for (cacheid = 0; cacheid < agent->nbr_memcaches; cacheid++)
-		if (streq (cacheidstr, agent->cacheids[cacheid]))
+		if (agent->memcaches [cacheid]->cachehash == cachehash)
 			return cacheid;
 	return -1;
 }
 
+//  .split lock-free reads
+//  Application threads read our kvmaps while we change them. They do so
+//  in a read section of our rcu, and each kvmap checks that what they
+//  read was all there at one time, see kvmap_read. We never free what
+//  they may hold: a kvmap or memcache we drop is retired to the rcu, and
+//  freed when the readers that could see it are gone:
+
+static void
+	s_kvmap_free (void *item)
+{
+	kvmap_t *kvmap = (kvmap_t *) item;
+	kvmap_destroy (&kvmap);
+}
+
+static void
+	s_memcache_free (void *item)
+{
+	memcache_t *memcache = (memcache_t *) item;
+	memcache_destroy (&memcache);
+}
+
+//  Replace kvmap of memcache, with a new one or with NULL
+static void
+	agent_set_kvmap (agent_t *agent, memcache_t *memcache, kvmap_t *kvmap)
+{
+	kvmap_t *old = memcache->kvmap;
+	if (kvmap)
+		kvmap_set_rcu (kvmap, agent->rcu);
+	memcache->kvmap = kvmap;
+	if (old)
+		rcu_retire (agent->rcu, old, s_kvmap_free);
+}
+
+//  Return kvmap of cache, if we have one; called in a read section
+static kvmap_t *
+	agent_read_kvmap (agent_t *agent, char *cacheidstr)
+{
+	uint cacheid;
+	for (cacheid = 0; cacheid < agent->nbr_memcaches; cacheid++) {
+		memcache_t *memcache = agent->memcaches [cacheid];
+		if (memcache && streq (memcache->cacheidstr, cacheidstr))
+			return memcache->kvmap;
+	}
+	return NULL;
+}
+
+//  Called from application threads, see clone_get
+static byte *
+	agent_read (void *args, char *cacheidstr, char *key, size_t *size)
+{
+	agent_t *agent = (agent_t *) args;
+	byte *value = NULL;
+	kvmap_t *kvmap;
+	uint token = rcu_read_lock (agent->rcu);
+	*size = 0;
+	kvmap = agent_read_kvmap (agent, cacheidstr);
+	if (kvmap)
+		value = kvmap_read (kvmap, key, size);
+	rcu_read_unlock (agent->rcu, token);
+	return value;
+}
+
+//  Called from application threads, see clone_mget
+static byte *
+	agent_read_many (void *args, char *cacheidstr, char **keys, size_t count, byte **values, size_t *sizes)
+{
+	agent_t *agent = (agent_t *) args;
+	byte *buffer = NULL;
+	kvmap_t *kvmap;
+	size_t index;
+	uint token = rcu_read_lock (agent->rcu);
+	kvmap = agent_read_kvmap (agent, cacheidstr);
+	if (kvmap)
+		buffer = kvmap_read_many (kvmap, keys, count, values, sizes);
+	else
+		for (index = 0; index < count; index++) {
+			values [index] = NULL;
+			sizes [index] = 0;
+		}
+	rcu_read_unlock (agent->rcu, token);
+	return buffer;
+}
+
+//  Print uuid as hex into dest, of 33 bytes, and return dest
+static char *
+	s_uuid_str (byte *uuid, char *dest)
+{
+	int index;
+	for (index = 0; index < 16; index++)
+		sprintf (dest + index * 2, "%02X", uuid [index]);
+	return dest;
+}
+
+//  Releases the value frame of a SET once the update is done with it.
+//  0MQ may call this from one of its I/O threads.
+static void
+	s_free_frame (void *data, void *hint)
+{
+	zframe_t *frame = (zframe_t *) hint;
+	zframe_destroy (&frame);
+}
+
 //  .split handling a control message
 //  Here we handle the different control messages from the front-end;
-//  SUBTREE, CONNECT, SET, and GET:
+//  SUBTREE, SUBSCRIBE, CONNECT, SET, SETASYNC and MSET:
 
 static int
 	agent_control_message (agent_t *agent)
@@ -411,11 +713,43 @@ static int
 		free (agent->subtree);
 		agent->subtree = zmsg_popstr (msg);
 	}
+	else if (streq (command, "SUBSCRIBE")) {
+		//  The first cache the application asks for replaces those
+		//  of the configuration
+		char *cacheidstr = zmsg_popstr (msg);
+		if (!agent->subscribed) {
+			while (agent->nbr_memcaches) {
+				memcache_t *memcache = agent->memcaches [--agent->nbr_memcaches];
+				agent->memcaches [agent->nbr_memcaches] = NULL;
+				rcu_retire (agent->rcu, memcache, s_memcache_free);
+			}
+			agent->subscribed = TRUE;
+		}
+		if (agent_getcache (agent, cacheidstr) == NULL && agent->nbr_memcaches < CACHE_MAX)
+			agent_addcache (agent, cacheidstr);
+		free (cacheidstr);
+	}
 	else if (streq (command, "CONNECT")) {
 		char *address = zmsg_popstr (msg);
 		char *port = zmsg_popstr (msg);
 		if (agent->nbr_servers < SERVER_MAX) {
-			agent->server [agent->nbr_servers] = server_new (agent->ctx, address, atoi (port), agent->subtree);
+			//  With topics, the server only sends us updates of our
+			//  caches. Without, we take all: a compact update or a pack
+			//  does not start with its key, so a subtree prefix would
+			//  filter out everything. We pick our subtree ourselves.
+			server_t *server = server_new (agent->ctx, address, atoi (port), agent->topics? NULL: "");
+			if (agent->topics) {
+				int cacheid;
+				char topic [MAXLEN + 2];
+				for (cacheid = 0; cacheid < agent->nbr_memcaches; cacheid++) {
+					snprintf (topic, sizeof (topic), "%s/", agent->cacheids [cacheid]);
+					zsockopt_set_subscribe (server->subscriber, topic);
+				}
+			}
+			agent->server [agent->nbr_servers] = server;
+			//  Then each update of a cache follows the one before, and
+			//  a gap means we lost some
+			agent->gapless = !params->bases [0]->subscribeConflated;
 			//  We broadcast updates to all known servers PUB UPDATES
 			result = zsocket_connect (agent->publisher, "%s:%d", address, atoi (port) + 2);
 			clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: agent_control_message CONNECT to %s:%s RESULT=%d server %u",address, port, result, agent->nbr_servers);
@@ -427,85 +761,381 @@ static int
 		free (address);
 		free (port);
 	}
-	else if (streq (command, "SET")) {
+	else if (streq (command, "SET") || streq (command, "SETASYNC")) {
 		//  .split set and get commands
 		//  When we set a property, we push the new key-value pair onto
 		//  all our connected servers:
 		kvmsg_t *kvmsg;
-		FILE *fp;
 		char *key = zmsg_popstr (msg);
 		char *cacheidstr = zmsg_popstr (msg);
-		char *value = zmsg_popstr (msg);
+		zframe_t *value = zmsg_pop (msg);
 		char *ttlStr = zmsg_popstr (msg);
 		//  Send key-value pair on to server
 		kvmsg = kvmsg_new (0);
-		kvmsg_set_prop (kvmsg, "cacheidstr", cacheidstr);
+		kvmsg_set_cachehash (kvmsg, kvmsg_hash_cacheid (cacheidstr));
 		kvmsg_set_key  (kvmsg, key);
 		kvmsg_set_uuid (kvmsg);
-		kvmsg_fmt_body (kvmsg, "%s", value);
-		kvmsg_set_prop (kvmsg, "ttl", ttlStr);
-		kvmsg_send     (kvmsg, agent->publisher);
+		//  Remember async sets until the server publishes them
+		if (streq (command, "SETASYNC") && agent->pReturnCallbckpublished) {
+			zframe_t *hint = zmsg_pop (msg);
+			published_t *published = (published_t *) zmalloc (sizeof (published_t));
+			memcpy (&published->hint, zframe_data (hint), sizeof (void *));
+			s_uuid_str (kvmsg_uuid (kvmsg), published->uuidstr);
+			published->key = strdup (key);
+			published->expiry = zclock_time () + PUBLISHED_TTL;
+			zhash_insert (agent->published, published->uuidstr, published);
+			zlist_append (agent->publishing, published);
+			zframe_destroy (&hint);
+		}
+		kvmsg_set_body_owned (kvmsg, zframe_data (value), zframe_size (value), s_free_frame, value);
+		//  TTL is given in seconds, and sent in msecs
+		kvmsg_set_ttl  (kvmsg, (int64_t) atoi (ttlStr) * 1000);
+		//  Until a server answers compact, it may predate the header
+		if (agent->compact)
+			kvmsg_send_compact (kvmsg, agent->publisher);
+		else
+			kvmsg_send_legacy (kvmsg, agent->publisher, cacheidstr);
 		kvmsg_destroy (&kvmsg);
 		free (cacheidstr);
 		free (ttlStr);
-		free (key);             //  Value is owned by hash table
+		free (key);             //  Value frame was owned by the kvmsg
 	}
-	else if (streq (command, "GET")) {
-		char *value = NULL;
-		memcache_t *memcache = NULL;
-		char *key = zmsg_popstr (msg);
+	else if (streq (command, "MSET")) {
+		//  The batch goes to the servers as one kvmsg; its body is
+		//  built straight from the frames we got
+		kvmsg_t *kvmsg;
+		size_t index;
 		char *cacheidstr = zmsg_popstr (msg);
-		//LECTURE en local
-		if (strneq (cacheidstr, "")) {
-			memcache = agent_getcache (agent, cacheidstr);
-			value = (char* ) zhash_lookup (memcache->kvmap, key);
+		char *ttlStr = zmsg_popstr (msg);
+		size_t count = zmsg_size (msg) / 2;
+		char **keys = (char **) zmalloc ((count + 1) * sizeof (char *));
+		byte **values = (byte **) zmalloc ((count + 1) * sizeof (byte *));
+		size_t *sizes = (size_t *) zmalloc ((count + 1) * sizeof (size_t));
+		zframe_t *frame = zmsg_first (msg);
+		for (index = 0; index < count; index++) {
+			keys [index] = zframe_strdup (frame);
+			frame = zmsg_next (msg);
+			values [index] = zframe_data (frame);
+			sizes [index] = zframe_size (frame);
+			frame = zmsg_next (msg);
 		}
-		if (value)
-			zstr_send (agent->pipe, value);
+		kvmsg = kvmsg_new (0);
+		kvmsg_set_cachehash (kvmsg, kvmsg_hash_cacheid (cacheidstr));
+		kvmsg_set_key  (kvmsg, "MSET");
+		kvmsg_set_ttl  (kvmsg, (int64_t) atoi (ttlStr) * 1000);
+		kvmsg_set_batch (kvmsg, keys, values, sizes, count);
+		if (agent->compact)
+			kvmsg_send_compact (kvmsg, agent->publisher);
 		else
-			zstr_send (agent->pipe, "");
-		free (key);
-		free (value);
+			kvmsg_send (kvmsg, agent->publisher);
+		kvmsg_destroy (&kvmsg);
+		for (index = 0; index < count; index++)
+			free (keys [index]);
+		free (keys);
+		free (values);
+		free (sizes);
+		free (cacheidstr);
+		free (ttlStr);
 	}
 	else {
 		clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "E: agent_control_message unknown command : %s ", command);
 	}
 	zmsg_destroy (&msg);
-	if (strneq (command, "GET"))
+	//  Async sets don't wait for us
+	if (strneq (command, "SETASYNC"))
 		zstr_send (agent->pipe, "ready");
 	free (command);
 	return 1;
 }
 
-//  .split back-end agent
+//  .split updates from server
+//  Apply an update from the server to our kvmap, and tell the
+//  application. Discards out-of-sequence updates, incl. hugz. An update
+//  of ours that we set async, the server has now published:
+
+static void
+	agent_published (agent_t *agent, kvmsg_t *kvmsg)
+{
+	char uuidstr [33];
+	published_t *published;
+	if (!kvmsg_uuid (kvmsg))
+		return;
+	published = (published_t *) zhash_lookup (agent->published, s_uuid_str (kvmsg_uuid (kvmsg), uuidstr));
+	if (published) {
+		if (agent->pReturnCallbckpublished)
+			(agent->pReturnCallbckpublished)(kvmsg_key(kvmsg), kvmsg_sequence(kvmsg), published->hint);
+		zhash_delete (agent->published, uuidstr);
+		published->done = TRUE;
+	}
+}
+
+//  Give up on async sets that are not published yet: all of them, or
+//  those past their expiry and past PUBLISHED_MAX. Their listener gets
+//  sequence 0. Sets are freed once first in line, done or not:
+static void
+	agent_purge_published (agent_t *agent, Bool all)
+{
+	published_t *published;
+	int64_t now = zclock_time ();
+	while ((published = (published_t *) zlist_first (agent->publishing)) != NULL) {
+		if (!published->done) {
+			if (!all && published->expiry > now
+			&&  zlist_size (agent->publishing) <= PUBLISHED_MAX)
+				break;
+			if (agent->pReturnCallbckpublished)
+				(agent->pReturnCallbckpublished)(published->key, 0, published->hint);
+			zhash_delete (agent->published, published->uuidstr);
+		}
+		zlist_pop (agent->publishing);
+		free (published->key);
+		free (published);
+	}
+}
+
+//  String listeners take the body as a C string. A body set with its
+//  length, as by clone_set_bin, need not end with a null; then they get
+//  a terminated copy, which the caller frees:
+static char *
+	s_body_string (kvmsg_t *kvmsg, char **copy)
+{
+	size_t size = kvmsg_size (kvmsg);
+	byte *body = kvmsg_body (kvmsg);
+	*copy = NULL;
+	if (size == 0)
+		return "";
+	if (body [size - 1] == 0)
+		return (char *) body;
+	*copy = (char *) malloc (size + 1);
+	memcpy (*copy, body, size);
+	(*copy) [size] = 0;
+	return *copy;
+}
+
+//  Tell the application about an item of a snapshot
+static void
+	agent_snapshot_item (agent_t *agent, kvmsg_t *kvmsg)
+{
+	char *copy;
+	if(agent->pReturnCallbcksnapshot) {
+		char *value = s_body_string (kvmsg, &copy);
+		(agent->pReturnCallbcksnapshot)(kvmsg_key(kvmsg), value);
+		free (copy);
+	}
+	if(agent->pReturnCallbcksnapshotBin)
+		(agent->pReturnCallbcksnapshotBin)(kvmsg_key(kvmsg), kvmsg_body(kvmsg), kvmsg_size(kvmsg));
+}
+
+//  Return TRUE if we hold any cache, from a server we failed over from
+static Bool
+	agent_has_state (agent_t *agent)
+{
+	int cacheid;
+	for (cacheid = 0; cacheid < agent->nbr_memcaches; cacheid++)
+		if (agent->memcaches [cacheid]->kvmap)
+			return TRUE;
+	return FALSE;
+}
+
+//  The server tells us its epoch when a cache starts, and our sequence
+//  of that cache is one of this epoch from then on
+static void
+	s_set_epoch (memcache_t *memcache, kvmsg_t *kvmsg)
+{
+	memcache->epoch = 0;
+	sscanf (kvmsg_get_prop (kvmsg, "epoch"), "%I64d", &memcache->epoch);
+}
+
+//  Ask our server for what we miss of this cache only: the updates past
+//  our sequence if we know it, else a new snapshot. Its kvmap goes on
+//  serving reads meanwhile, and its updates wait in pending:
+static void
+	agent_resync (agent_t *agent, memcache_t *memcache)
+{
+	server_t *server = agent->server [agent->cur_server];
+	zmsg_t *request = zmsg_new ();
+	if (memcache->kvmap && memcache->sequence >= 0) {
+		zmsg_addstr (request, KVMSG_GETSINCE);
+		zmsg_addstr (request, memcache->cacheidstr);
+		zmsg_addstr (request, "%I64d", memcache->sequence);
+		zmsg_addstr (request, "%I64d", memcache->epoch);
+	}
+	else {
+		zmsg_addstr (request, KVMSG_GETSNAPSHOT_COMPACT);
+		zmsg_addstr (request, memcache->cacheidstr);
+	}
+	zmsg_send (&request, server->snapshot);
+	memcache->resyncing = TRUE;
+	zlist_append (agent->resyncs, memcache);
+}
+
+//  Apply an update of memcache that is in sequence
+static void
+	agent_apply (agent_t *agent, memcache_t *memcache, kvmsg_t *kvmsg)
+{
+	char *copy;
+	memcache->sequence = kvmsg_sequence (kvmsg);
+	if (zhash_size (agent->published))
+		agent_published (agent, kvmsg);
+	//  The SUB filter does not see updates of a delta, so we skip keys
+	//  outside our subtree here, whatever the server sent
+	if (*agent->subtree && strncmp (kvmsg_key (kvmsg), agent->subtree, strlen (agent->subtree))) {
+		kvmsg_destroy (&kvmsg);
+		return;
+	}
+	if(agent->pReturnCallbckupdate) {
+		char *body = s_body_string (kvmsg, &copy);
+		//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: execute pReturnCallbckupdate msg %s", body);
+		(agent->pReturnCallbckupdate)(kvmsg_key(kvmsg), body);
+		free (copy);
+	}
+	if(agent->pReturnCallbckupdateBin)
+		(agent->pReturnCallbckupdateBin)(kvmsg_key(kvmsg), kvmsg_body(kvmsg), kvmsg_size(kvmsg));
+	if (memcache->kvmap == NULL)
+		agent_set_kvmap (agent, memcache, kvmap_new (0));
+	kvmap_store (memcache->kvmap, &kvmsg);
+	//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: SNAPSHOT memcache cacheid=%s size=%u", memcache->cacheidstr, kvmap_size (memcache->kvmap));
+}
+
+static void
+	agent_update (agent_t *agent, kvmsg_t *kvmsg)
+{
+	int cacheid;
+	memcache_t *memcache;
+	int64_t sequence = kvmsg_sequence (kvmsg);
+	Bool hugz = streq (kvmsg_key (kvmsg), "HUGZ");
+	cacheid = agent_findcacheid (agent, kvmsg_cachehash (kvmsg));
+	memcache = cacheid < 0? NULL: agent->memcaches [cacheid];
+	if (!memcache) {
+		//  Ours are published all the same
+		if (zhash_size (agent->published))
+			agent_published (agent, kvmsg);
+		kvmsg_destroy (&kvmsg);
+		return;
+	}
+	//  Updates wait while the cache gets a new snapshot
+	if (memcache->resyncing) {
+		if (hugz)
+			kvmsg_destroy (&kvmsg);
+		else
+			pending_add (memcache->pending, &kvmsg);
+		return;
+	}
+	//  An update has the next sequence of its cache, hugz the last one.
+	//  Past a gap, only this cache gets a new snapshot.
+	if (agent->gapless && memcache->sequence >= 0
+	&&  sequence > memcache->sequence + (hugz? 0: 1)) {
+		clone_log(LOG_LEVEL_WARNING, LOG_TYPE_CLONE, "W: agent_update cache %s lost updates last=%I64d got=%I64d, resyncing", memcache->cacheidstr, memcache->sequence, sequence);
+		agent_resync (agent, memcache);
+		if (hugz)
+			kvmsg_destroy (&kvmsg);
+		else
+			pending_add (memcache->pending, &kvmsg);
+		return;
+	}
+	if (sequence <= memcache->sequence) {
+		if (!hugz)
+			clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: update out of sequence cache=%s last=%I64d got=%I64d", memcache->cacheidstr, memcache->sequence, sequence);
+		kvmsg_destroy (&kvmsg);
+		return;
+	}
+	if (hugz) {
+		memcache->sequence = sequence;
+		kvmsg_destroy (&kvmsg);
+	}
+	else
+		agent_apply (agent, memcache, kvmsg);
+}
+
+//  An answer to agent_resync. Answers come in the order we asked, so it
+//  is for the first cache waiting; what is for other caches is left
+//  from a server we failed over from. A snapshot fills a new kvmap, and
+//  updates since our sequence go to our kvmap. Once that is done, we
+//  apply the updates that waited, past the new sequence:
+static void
+	agent_resync_message (agent_t *agent, kvmsg_t *kvmsg)
+{
+	kvmsg_t *update;
+	memcache_t *memcache = (memcache_t *) zlist_first (agent->resyncs);
+	if (!memcache
+	|| (kvmsg_cachehash (kvmsg) && kvmsg_cachehash (kvmsg) != memcache->cachehash))
+		kvmsg_destroy (&kvmsg);
+	else if (streq (kvmsg_key (kvmsg), "BEGINSINCE")) {
+		memcache->delta = TRUE;
+		s_set_epoch (memcache, kvmsg);
+		kvmsg_destroy (&kvmsg);
+	}
+	else if (streq (kvmsg_key (kvmsg), "BEGINMEMCACHE")) {
+		kvmap_destroy (&memcache->resync);
+		memcache->resync = kvmap_new (0);
+		memcache->sequence = kvmsg_sequence (kvmsg);
+		s_set_epoch (memcache, kvmsg);
+		kvmsg_destroy (&kvmsg);
+	}
+	else if (streq (kvmsg_key (kvmsg), "ENDSNAPSHOT")) {
+		kvmsg_destroy (&kvmsg);
+		zlist_pop (agent->resyncs);
+		if (memcache->delta)
+			memcache->delta = FALSE;
+		else if (memcache->resync) {
+			agent_set_kvmap (agent, memcache, memcache->resync);
+			memcache->resync = NULL;
+		}
+		else {
+			//  Server has no such cache, take updates as they come
+			clone_log(LOG_LEVEL_WARNING, LOG_TYPE_CLONE, "W: agent_resync_message server has no cache %s", memcache->cacheidstr);
+			memcache->sequence = -1;
+		}
+		memcache->resyncing = FALSE;
+		clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: agent_resync_message cache %s resynced at %I64d, %u updates waited", memcache->cacheidstr, memcache->sequence, (uint) pending_size (memcache->pending));
+		while ((update = pending_pop (memcache->pending)) != NULL)
+			agent_update (agent, update);
+	}
+	else if (memcache->delta && kvmsg_sequence (kvmsg) > memcache->sequence)
+		agent_apply (agent, memcache, kvmsg);
+	else if (memcache->resync) {
+		agent_snapshot_item (agent, kvmsg);
+		kvmap_store (memcache->resync, &kvmsg);
+	}
+	else
+		kvmsg_destroy (&kvmsg);
+}
+
 //  The asynchronous agent manages a server pool and handles the
 //  request/reply dialog when the application asks for it:
 
 static void
 	clone_agent (void *args, zctx_t *ctx, void *pipe)
 {
-	char *body;
 	memcache_t *memcache;
-	int cacheid;
+	int cacheid = -1;
 	char* errptr;
-	char *key;
-	char *value;
 	int poll_size = 1;
 	char SNumber[14];	
 	Bool initial = TRUE;
 	agent_t *agent = agent_new (ctx, pipe);
 	clone_t *clnt = (clone_t *) args;
+	//  Application threads read our kvmaps from now on
+	clnt->agent = agent;
 	while (TRUE) {
 		int rc;
 		int size;
 		int poll_timer = -1;
+		int poll_count = poll_size;
 		zmq_pollitem_t poll_set [] = {
 			{ pipe, 0, ZMQ_POLLIN, 0 },
+			{ 0,    0, ZMQ_POLLIN, 0 },
 			{ 0,    0, ZMQ_POLLIN, 0 }
 		};
 		server_t *server = agent->server [agent->cur_server];
+		//  Free what readers are done with
+		rcu_reclaim (agent->rcu);
+		if (zlist_size (agent->publishing))
+			agent_purge_published (agent, FALSE);
 		agent->pReturnCallbcksnapshot= clnt->pReturnCallbcksnapshot;
 		agent->pReturnCallbckupdate= clnt->pReturnCallbckupdate;
+		agent->pReturnCallbcksnapshotBin= clnt->pReturnCallbcksnapshotBin;
+		agent->pReturnCallbckupdateBin= clnt->pReturnCallbckupdateBin;
+		agent->pReturnCallbckpublished= clnt->pReturnCallbckpublished;
 
 		if (server) {
 			switch (agent->state) {
@@ -525,6 +1155,11 @@ static void
 				//  In this state we read from subscriber and we expect
 				//  the server to give hugz, else we fail over.
 				poll_set [1].socket = server->subscriber;
+				//  and snapshots of caches that lost updates, if any
+				if (zlist_size (agent->resyncs)) {
+					poll_set [2].socket = server->snapshot;
+					poll_count = 3;
+				}
 				break;
 			}
 			server->expiry = zclock_time () + SERVER_TTL;
@@ -541,7 +1176,7 @@ static void
 			initial=FALSE;
 		}
 		//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: clone_agent zmq_poll poll_timer=%d", poll_timer);
-		rc = zmq_poll (poll_set, poll_size, poll_timer);
+		rc = zmq_poll (poll_set, poll_count, poll_timer);
 		if (rc == -1)
 			break;              //  Context has been shut down
 		//Do not manage commands during sync of snapshot
@@ -558,8 +1193,8 @@ static void
 				break;          //  Interrupted
 		}
 		else if (poll_set [1].revents & ZMQ_POLLIN) {
-			char * cacheidstr;
-			kvmsg_t *kvmsg = kvmsg_recv (poll_set [1].socket);
+			kvmsg_t *kvmsg = agent->topics && poll_set [1].socket == server->subscriber?
+				kvmsg_recv_topic (poll_set [1].socket): kvmsg_recv (poll_set [1].socket);
 			//memcache_t *memcache = NULL;	
 			//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: clone recv POLLIN");
 			if (!kvmsg)
@@ -572,11 +1207,26 @@ static void
 			case STATE_INITIAL:
 				//  In this state we ask the server for a snapshot,
 				//  if we have a server to talk to...
-				if (agent->nbr_servers > 0) {
+				kvmsg_destroy (&kvmsg);
+				if (agent->nbr_servers > 0 && agent_has_state (agent)) {
+					//  Back from a failover, each cache we hold asks
+					//  for the updates it missed, and serves reads meanwhile
+					clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: catching up with server at '%s':'%d'", server->address, server->port);
+					for (cacheid = 0; cacheid < agent->nbr_memcaches; cacheid++)
+						agent_resync (agent, agent->memcaches [cacheid]);
+					agent->state = STATE_ACTIVE;
+				}
+				else if (agent->nbr_servers > 0) {
 					clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: waiting for server at '%s':'%d'requests %u...", server->address, server->port, server->requests);
 					if (agent->memcaches [0]->kvmap == NULL && server->requests < 2) {
+						zmsg_t *request = zmsg_new ();
 						clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber asking for snapshot GETSNAPSHOT");
-						zstr_send (server->snapshot, "GETSNAPSHOT");
+						zmsg_addstr (request, KVMSG_GETSNAPSHOT_COMPACT);
+						//  Then the caches we want, if we chose them
+						if (agent->subscribed)
+							for (cacheid = 0; cacheid < agent->nbr_memcaches; cacheid++)
+								zmsg_addstr (request, agent->cacheids [cacheid]);
+						zmsg_send (&request, server->snapshot);
 						server->requests++;
 					}
 					agent->state = STATE_SYNCING;
@@ -589,37 +1239,36 @@ static void
 				//  Store in snapshot until we're finished
 				server->requests = 0;
 				clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: waiting for server at '%s':'%d'requests %u...", server->address, server->port, server->requests);
-				cacheidstr = kvmsg_get_prop (kvmsg, "cacheidstr");
-				if (strneq (cacheidstr, ""))
-					cacheid = agent_getcacheid (agent, cacheidstr); //FIXME manage error
+				if (kvmsg_cachehash (kvmsg))
+					cacheid = agent_findcacheid (agent, kvmsg_cachehash (kvmsg));
+				//  Skip caches we have not asked for
+				if (cacheid < 0 && strneq (kvmsg_key (kvmsg), "ENDSNAPSHOT")) {
+					kvmsg_destroy (&kvmsg);
+					break;
+				}
 				if (streq (kvmsg_key (kvmsg), "BEGINMEMCACHE")) {	
 					if (agent->memcaches [cacheid]->kvmap == NULL) {
-						agent->memcaches [cacheid]->kvmap = zhash_new ();
+						agent_set_kvmap (agent, agent->memcaches [cacheid], kvmap_new (0));
 					}
+					//  Updates of the cache go on from its snapshot
+					agent->memcaches [cacheid]->sequence = kvmsg_sequence (kvmsg);
+					s_set_epoch (agent->memcaches [cacheid], kvmsg);
 					clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber Received BEGINMEMCACHE");
 					kvmsg_destroy (&kvmsg);
 				}  else if (streq (kvmsg_key (kvmsg), "ENDSNAPSHOT")) {
-					agent->sequence =  kvmsg_sequence (kvmsg);
 					agent->state = STATE_ACTIVE;
+					//  A server that answers compact reads compact updates
+					agent->compact = kvmsg_compact (kvmsg);
 					kvmsg_destroy (&kvmsg);
-					s_print_kvm (agent->memcaches [cacheid]);
+					if (cacheid >= 0)
+						s_print_kvm (agent->memcaches [cacheid]);
 					clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber Received ENDSNAPSHOT BREAK !!!!!!!!!!!!");
 					break;          //  Done
 				} else {
-					key= kvmsg_key(kvmsg) ;
 					size = kvmsg_size(kvmsg) ;
-					if (size) {
-						value= (char*) kvmsg_body(kvmsg) ;
-					}
-					else {
-						value = "";
-					}
-					clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber Received DATA cacheid=%d value=%s", cacheid, value);
-					if(agent->pReturnCallbcksnapshot) {
-						//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: received from %s:%d cacheid %s SEND pReturnCallbcksnapshot", server->address, server->port, memcache->cacheidstr);
-						(agent->pReturnCallbcksnapshot)(kvmsg_key(kvmsg), value);
-					}
-					kvmsg_store (&kvmsg, agent->memcaches [cacheid]->kvmap);
+					clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber Received DATA cacheid=%d size=%d", cacheid, size);
+					agent_snapshot_item (agent, kvmsg);
+					kvmap_store (agent->memcaches [cacheid]->kvmap, &kvmsg);
 				}
 				//} // if poll
 				//} //while
@@ -628,49 +1277,50 @@ static void
 				//  In this state we read from subscriber and we expect
 				//  the server to give hugz, else we fail over.
 				//poll_set [1].socket = server->subscriber;
-				//  Discard out-of-sequence updates, incl. hugz
-				if (strneq (kvmsg_key (kvmsg), "HUGZ")) {
-					cacheidstr = kvmsg_get_prop (kvmsg, "cacheidstr");
-					if (strneq (cacheidstr, ""))
-						memcache = agent_getcache (agent, cacheidstr);
-					if (!memcache)
-						break;          //  Interrupted
-					if (kvmsg_sequence (kvmsg) > agent->sequence) {
-						agent->sequence = kvmsg_sequence (kvmsg);
-						size = kvmsg_size(kvmsg) ;
-						if (size) {
-							body= (char*) kvmsg_body(kvmsg) ;
-						}
-						else {
-							body = "";
-						}
-						if(agent->pReturnCallbckupdate) {
-							//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: execute pReturnCallbckupdate msg %s", body);
-							(agent->pReturnCallbckupdate)(kvmsg_key(kvmsg), body);
-						}
-						kvmsg_store (&kvmsg, memcache->kvmap);
-						//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: SNAPSHOT memcache cacheid=%s size=%u", memcache->cacheidstr, zhash_size (memcache->kvmap));
-					}
-					else {
-						clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: HUGZ out of sequence last=%I64d got=%I64d", agent->sequence, kvmsg_sequence (kvmsg));
-						kvmsg_destroy (&kvmsg);
-					}
+				//  A pack holds many updates, applied in order
+				if (kvmsg_flags (kvmsg) & KVMSG_FLAG_BATCH) {
+					kvmsg_t *update;
+					while ((update = kvmsg_batch_next (kvmsg)) != NULL)
+						agent_update (agent, update);
+					kvmsg_destroy (&kvmsg);
 				}
 				else
-					kvmsg_destroy (&kvmsg);
+					agent_update (agent, kvmsg);
 				break;
 			}
 		}
+		else if (poll_count == 3 && poll_set [2].revents & ZMQ_POLLIN) {
+			kvmsg_t *kvmsg = kvmsg_recv (server->snapshot);
+			if (!kvmsg)
+				break;          //  Interrupted
+			server->expiry = zclock_time () + SERVER_TTL;
+			agent_resync_message (agent, kvmsg);
+		}
 		else {
+			kvmsg_t *kvmsg;
 			//  Server has died, failover to next
 			server->expiry = zclock_time () + SERVER_TTL;
 			//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: server at %s:%d didn't give hugz CUR_SERVER=%d", server->address, server->port, agent->cur_server);
 			agent->cur_server = (agent->cur_server + 1) % agent->nbr_servers;
-			// Reinit kvmap before resynchro
+			//  We keep our kvmaps and their sequences, to catch up from
+			//  there, unless the first snapshot was not done yet; what we
+			//  asked the dead server for is lost
 			for (cacheid = 0; cacheid < agent->nbr_memcaches; cacheid++) {
 				memcache = agent->memcaches [cacheid];
-				memcache->kvmap=NULL;
+				if (agent->state == STATE_SYNCING) {
+					agent_set_kvmap (agent, memcache, NULL);
+					memcache->sequence = -1;
+				}
+				kvmap_destroy (&memcache->resync);
+				memcache->resyncing = FALSE;
+				memcache->delta = FALSE;
+				while ((kvmsg = pending_pop (memcache->pending)) != NULL)
+					kvmsg_destroy (&kvmsg);
 			}
+			zlist_destroy (&agent->resyncs);
+			agent->resyncs = zlist_new ();
+			//  The new server may never publish async sets in flight
+			agent_purge_published (agent, TRUE);
 			agent->state = STATE_INITIAL;
 		}
 	}
@@ -678,16 +1328,16 @@ static void
 }
 
 static memcache_t *
-	memcache_new (uint cacheid)
+	memcache_new (char *cacheidstr)
 {
-	extern struct clone_parameters *params;
-	//Client is connected to only one base
-	base_parameters *base_params = params->bases[0];
 	memcache_t *memcache = (memcache_t *) zmalloc (sizeof (memcache_t));
-	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: clone memcache_new MEMCACHE_NEW %d", cacheid);
-	strncpy (memcache->cacheidstr, base_params->cacheids[cacheid], MAXLEN);
-	//memcache->kvmap = zhash_new ();
-	memcache->pending = zlist_new ();
+	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: clone memcache_new MEMCACHE_NEW %s", cacheidstr);
+	strncpy (memcache->cacheidstr, cacheidstr, MAXLEN);
+	memcache->cachehash = kvmsg_hash_cacheid (memcache->cacheidstr);
+	//memcache->kvmap = kvmap_new (0);
+	memcache->pending = pending_new (0, 0);
+	//  Unknown until a snapshot or an update tells us
+	memcache->sequence = -1;
 	return memcache;
 }
 
@@ -697,12 +1347,9 @@ static void
 	assert (memcache_p);
 	if (*memcache_p) {
 		memcache_t *memcache = *memcache_p;
-		while (zlist_size (memcache->pending)) {
-			kvmsg_t *kvmsg = (kvmsg_t *) zlist_pop (memcache->pending);
-			kvmsg_destroy (&kvmsg);
-		}
-		zlist_destroy (&memcache->pending);
-		zhash_destroy (&memcache->kvmap);
+		pending_destroy (&memcache->pending);
+		kvmap_destroy (&memcache->kvmap);
+		kvmap_destroy (&memcache->resync);
 		free (memcache);
 		*memcache_p = NULL;
 	}
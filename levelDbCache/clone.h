@@ -35,6 +35,8 @@ extern "C" {
 
 typedef void (__cdecl *PRETURNUNCALLBACENDSNAPSHOT)( char *key, char* value);
 typedef void (__cdecl *PRETURNUNCALLBACKUPDATE)( char *key, char* value);
+typedef void (__cdecl *PRETURNUNCALLBACKBIN)( char *key, byte *value, size_t size);
+typedef void (__cdecl *PRETURNUNCALLBACKPUBLISHED)( char *key, int64_t sequence, void *hint);
 
 //  Structure of our class
 
@@ -42,8 +44,12 @@ struct _clone_t {
 	zctx_t *ctx;                //  Our context wrapper
 	void *pipe;                 //  Pipe through to clone agent
 	void *logpipe;                 //  Pipe through to clone log agent
+	void *agent;                //  State of clone agent, that we read
 	PRETURNUNCALLBACENDSNAPSHOT pReturnCallbcksnapshot;
 	PRETURNUNCALLBACKUPDATE pReturnCallbckupdate;
+	PRETURNUNCALLBACKBIN pReturnCallbcksnapshotBin;
+	PRETURNUNCALLBACKBIN pReturnCallbckupdateBin;
+	PRETURNUNCALLBACKPUBLISHED pReturnCallbckpublished;
 };
 
 //  Opaque class structure
@@ -53,13 +59,23 @@ _EXPORTS_API void launchServer (int argc, char* confPath);
 _EXPORTS_API clone_t *clone_new (char *confPath);
 _EXPORTS_API void clone_destroy (clone_t **clone_p);
 _EXPORTS_API void clone_subtree (clone_t *clone, char *subtree);
+_EXPORTS_API void clone_subscribe (clone_t *clone, char *cacheidstr);
 _EXPORTS_API void clone_connect_server (clone_t *clone, char *address, char *service);
 _EXPORTS_API void clone_connect (clone_t *clone);
 _EXPORTS_API void clone_set (clone_t *clone, char *cacheidstr, char *key, char *value, int ttl);
+_EXPORTS_API void clone_set_bin (clone_t *clone, char *cacheidstr, char *key, byte *value, size_t size, int ttl);
+_EXPORTS_API void clone_set_owned (clone_t *clone, char *cacheidstr, char *key, byte *value, size_t size, int ttl, zmq_free_fn *free_fn, void *hint);
+_EXPORTS_API int clone_set_async (clone_t *clone, char *cacheidstr, char *key, byte *value, size_t size, int ttl, void *hint);
+_EXPORTS_API void clone_mset (clone_t *clone, char *cacheidstr, char **keys, byte **values, size_t *sizes, size_t count, int ttl);
 _EXPORTS_API char *clone_get (clone_t *clone, char *cacheidstr, char *key);
+_EXPORTS_API byte *clone_get_bin (clone_t *clone, char *cacheidstr, char *key, size_t *size);
+_EXPORTS_API byte *clone_mget (clone_t *clone, char *cacheidstr, char **keys, size_t count, byte **values, size_t *sizes);
 _EXPORTS_API void clone_logString (int level, int type, char *body);
 _EXPORTS_API void __cdecl AddListnerForSnapshot(clone_t *clone,PRETURNUNCALLBACKUPDATE pReturnSnapshotCallback);
 _EXPORTS_API void __cdecl AddListnerForUpdate(clone_t *clone,PRETURNUNCALLBACKUPDATE pReturnUpdateCallback);
+_EXPORTS_API void __cdecl AddListnerForSnapshotBin(clone_t *clone,PRETURNUNCALLBACKBIN pReturnSnapshotCallback);
+_EXPORTS_API void __cdecl AddListnerForUpdateBin(clone_t *clone,PRETURNUNCALLBACKBIN pReturnUpdateCallback);
+_EXPORTS_API void __cdecl AddListnerForPublished(clone_t *clone,PRETURNUNCALLBACKPUBLISHED pReturnPublishedCallback);
 
 #ifdef __cplusplus
 }
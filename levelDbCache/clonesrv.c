@@ -28,6 +28,7 @@ License along with this program. If not, see
 //  Lets us build this source without creating a library
 #include "stdafx.h"
 #include "bstar.h"
+#include "persister.h"
 #include "kvmsg.h"
 #include "clone.h"
 #include "clone_log.h"
@@ -40,67 +41,850 @@ static int send_snapshot  (zloop_t *loop, zmq_pollitem_t *poller, void *args);
 static int s_collector  (zloop_t *loop, zmq_pollitem_t *poller, void *args);
 static int s_flush_ttl  (zloop_t *loop, zmq_pollitem_t *poller, void *args);
 static int s_send_hugz  (zloop_t *loop, zmq_pollitem_t *poller, void *args);
+static int s_log_stats  (zloop_t *loop, zmq_pollitem_t *poller, void *args);
+static int s_sync_cache (zloop_t *loop, zmq_pollitem_t *poller, void *args);
 static int s_new_active (zloop_t *loop, zmq_pollitem_t *poller, void *args);
 static int s_new_passive  (zloop_t *loop, zmq_pollitem_t *poller, void *args);
 static int s_subscriber (zloop_t *loop, zmq_pollitem_t *poller, void *args);
+static int s_send_single (kventry_t *entry, void *args);
+static int s_evict_cache (zloop_t *loop, zmq_pollitem_t *poller, void *args);
+static int s_flush_conflated (zloop_t *loop, zmq_pollitem_t *poller, void *args);
+static int s_subscription (zloop_t *loop, zmq_pollitem_t *poller, void *args);
+static int s_persist_timer (zloop_t *loop, zmq_pollitem_t *poller, void *args);
+
+//  Updates covered by each SEQUENCENUMBER write
+#define SEQUENCE_RESERVE    65536
+//  Our own records live beside the user keys, behind a leading null
+//  byte that no user key can start with
+#define INTERNAL_SEQUENCE   "\0SEQUENCENUMBER"
+#define INTERNAL_KEYCOUNT   "\0KEYCOUNT"
+//  Recovered kvmsgs handed to the reactor at once
+#define RECOVERY_CHUNK      1024
+//  Entries the CLOCK hand may look at per update, and per eviction timer
+#define EVICT_STEPS         8
+#define EVICT_INTERVAL      100     //  msecs
+//  Resolution of TTL expiry, and most keys expired per cache and tick
+#define TTL_TICK            10      //  msecs
+#define TTL_BATCH           1000
+//  LevelDB records a snapshot reads at once, and msecs between reads
+#define SNAPSHOT_CHUNK      1024
+#define SNAPSHOT_INTERVAL   1
+//  Msecs between looks at a full persister ring, while we wait for it
+#define PERSIST_INTERVAL    1
 
 //  Routing information for a key-value snapshot
 typedef struct {
 	void *socket;           //  ROUTER socket to send to
 	zframe_t *identity;     //  Identity of peer who requested state
 	char *subtree;          //  Client subtree specification
+	uint cachehash;         //  Cache the entries belong to
+	Bool compact;           //  TRUE if peer asked for compact kvmsgs
+	base_t *base;           //  Base the cache is in
 } kvroute_t;
 
+static void s_send_kvmsg (kvmsg_t **kvmsg_p, kvroute_t *routing);
+static int base_findcacheid (base_t *base, uint cachehash);
+static void base_snapshots_cancel (base_t *base);
+
+//  Each memcache has its own LevelDB, unless it is memory only. The first
+//  cache of a base keeps the base databasePath, the others use
+//  databasePath_<cacheid>:
+
 static memcache_t *
 	memcache_new (base_t *base, int cacheid, char *dbPath)
 {
 	extern struct clone_parameters *params;
-	char* errptr ;
+	char* errptr = NULL;
 	clonesrv_t *clonesrv = (clonesrv_t *) base->clonesrv ;
 	memcache_t *memcache = (memcache_t *) zmalloc (sizeof (memcache_t));
 	base_parameters *base_params = params->bases[base->baseid];
 	memcache->base = base;
-	memcache->dbPath= dbPath;
-	memcache->dbOptions = leveldb_options_create();
-	leveldb_options_set_create_if_missing(memcache->dbOptions, 'true' );
-	leveldb_options_set_compression(memcache->dbOptions, 0) ;
 	strncpy (memcache->cacheidstr, base_params->cacheids[cacheid], MAXLEN);
+	memcache->cachehash = kvmsg_hash_cacheid (memcache->cacheidstr);
+	memcache->durability = base_durability (base_params, memcache->cacheidstr);
 	//Pour backup les kvmap sont cree lors de la reception des snapshots
 	if (clonesrv->primary)
-		memcache->kvmap = zhash_new ();
-	memcache->pending = zlist_new ();
-	memcache->db = leveldb_open( memcache->dbOptions, memcache->dbPath , &errptr) ;
-	memcache->dbPath = dbPath;
+		memcache->kvmap = kvmap_new (0);
+	memcache->pending = pending_new (base_params->pendingMax, base_params->pendingAge);
+	memcache->writeOptions = leveldb_writeoptions_create ();
+	memcache->syncOptions = leveldb_writeoptions_create ();
+	leveldb_writeoptions_set_sync (memcache->syncOptions, 1);
+	if (memcache->durability == DURABILITY_SYNC)
+		leveldb_writeoptions_set_sync (memcache->writeOptions, 1);
+	memcache->batch = leveldb_writebatch_create ();
+	memcache->dbOptions = leveldb_options_create();
+	leveldb_options_set_create_if_missing(memcache->dbOptions, 'true' );
+	leveldb_options_set_compression(memcache->dbOptions, 0) ;
+	if (memcache->durability != DURABILITY_NONE) {
+		memcache->dbPath = (char *) malloc (strlen (dbPath) + strlen (memcache->cacheidstr) + 2);
+		if (cacheid == 0)
+			strcpy (memcache->dbPath, dbPath);
+		else
+			sprintf (memcache->dbPath, "%s_%s", dbPath, memcache->cacheidstr);
+		memcache->db = leveldb_open( memcache->dbOptions, memcache->dbPath , &errptr) ;
+		if (errptr) {
+			clone_log(LOG_LEVEL_ERROR, LOG_TYPE_PERSIST, "E: memcache_new cache=%s cannot open %s, running memory only: %s", memcache->cacheidstr, memcache->dbPath, errptr);
+			leveldb_free (errptr);
+			memcache->durability = DURABILITY_NONE;
+		}
+	}
+	//  Only entries that are safe in LevelDB can be evicted
+	memcache->memory_limit = base_memory_limit (base_params, memcache->cacheidstr);
+	if (memcache->memory_limit && !memcache->db) {
+		clone_log(LOG_LEVEL_WARNING, LOG_TYPE_PERSIST, "W: memcache_new cache=%s is memory only, memoryLimit ignored", memcache->cacheidstr);
+		memcache->memory_limit = 0;
+	}
+	if (memcache->memory_limit)
+		memcache->tombstones = kvmap_new (0);
+	memcache->ttls = ttlwheel_new (TTL_TICK, zclock_time ());
+	memcache->ring_max = base_params->updateRing;
+	if (memcache->ring_max)
+		memcache->ring = (kvmsg_t **) zmalloc (memcache->ring_max * sizeof (kvmsg_t *));
+	clone_log(LOG_LEVEL_INFO, LOG_TYPE_PERSIST, "I: memcache_new cache=%s durability=%d memory_limit=%Iu path=%s", memcache->cacheidstr, memcache->durability, memcache->memory_limit, memcache->db? memcache->dbPath: "");
 	return memcache;
 }
 
+static void
+	memcache_forget (memcache_t *memcache);
+
 static void
 	memcache_destroy (memcache_t **memcache_p)
 {
 	assert (memcache_p);
 	if (*memcache_p) {
 		memcache_t *memcache = *memcache_p;
-		while (zlist_size (memcache->pending)) {
-			kvmsg_t *kvmsg = (kvmsg_t *) zlist_pop (memcache->pending);
-			kvmsg_destroy (&kvmsg);
-		}
-		zlist_destroy (&memcache->pending);
-		zhash_destroy (&memcache->kvmap);
+		pending_destroy (&memcache->pending);
+		kvmap_destroy (&memcache->kvmap);
+		leveldb_writebatch_destroy (memcache->batch);
+		leveldb_writeoptions_destroy (memcache->writeOptions);
+		leveldb_writeoptions_destroy (memcache->syncOptions);
+		if (memcache->db)
+			leveldb_close (memcache->db);
+		leveldb_options_destroy (memcache->dbOptions);
+		free (memcache->dbPath);
+		free (memcache->record);
+		kvmap_destroy (&memcache->tombstones);
+		ttlwheel_destroy (&memcache->ttls);
+		memcache_forget (memcache);
+		free (memcache->ring);
 		free (memcache);
 		*memcache_p = NULL;
 	}
 }
 
+//  .split group commit
+//  Updates are not written to LevelDB one by one. Each one is added to
+//  the batch of its memcache, and the batch is handed to the persister
+//  thread of the base when the caller commits. The reactor never waits
+//  for LevelDB, except for caches in sync durability, which are written
+//  and fsync'ed right away. Memory only caches persist nothing.
+//  Each value is stored behind a record header holding its sequence,
+//  expiry and flags; a delete is stored as a tombstone header:
+
+static void
+	memcache_persist (memcache_t *memcache, kvmsg_t *kvmsg)
+{
+	char *key;
+	size_t size;
+	int64_t expiry;
+	if (!memcache->db)
+		return;
+	key = kvmsg_key (kvmsg);
+	size = kvmsg_size (kvmsg);
+	expiry = kvmsg_expiry (kvmsg);
+	if (memcache->record_size < PERSIST_RECORD_HEADER + size) {
+		memcache->record_size = PERSIST_RECORD_HEADER + size;
+		memcache->record = (byte *) realloc (memcache->record, memcache->record_size);
+	}
+	persister_record_encode (memcache->record, kvmsg_sequence (kvmsg), expiry, size? 0: PERSIST_FLAG_DELETED);
+	if (size)
+		memcpy (memcache->record + PERSIST_RECORD_HEADER, kvmsg_body (kvmsg), size);
+	leveldb_writebatch_put (memcache->batch, key, strlen (key) + 1, (char *) memcache->record, PERSIST_RECORD_HEADER + size);
+	memcache->batched++;
+}
+
+//  Records carry their own sequence, but recovery must know where to
+//  continue before it has read them all, and a snapshot carries no
+//  tombstones for the deletes that moved the sequence. So SEQUENCENUMBER
+//  holds a sequence reserved ahead of us, rewritten once every
+//  SEQUENCE_RESERVE updates. A restart skips what was left of the reserve:
+
+static void
+	memcache_reserve (memcache_t *memcache)
+{
+	char SNumber [21];
+	if (!memcache->db || memcache->sequence < memcache->reserved)
+		return;
+	memcache->reserved = memcache->sequence + SEQUENCE_RESERVE;
+	sprintf_s (SNumber, sizeof (SNumber), "%I64d", memcache->reserved);
+	leveldb_writebatch_put (memcache->batch, INTERNAL_SEQUENCE, sizeof (INTERNAL_SEQUENCE), SNumber, strlen (SNumber) + 1);
+	memcache->batched++;
+}
+
+//  .split update ring
+//  Each cache keeps its last updateRing updates, so that a client back
+//  from a failover or a reconnect gets only the updates it missed, with
+//  GETSINCE, and not the snapshot of the cache. The ring has no gap: an
+//  update that does not follow the last one empties it first. The
+//  passive fills it from the active, so it can answer once it takes over.
+//  The ring holds copies of whole updates, which count toward the
+//  memoryLimit of the cache, so it is off by default.
+
+static size_t
+	s_ring_bytes (kvmsg_t *kvmsg)
+{
+	return strlen (kvmsg_key (kvmsg)) + kvmsg_size (kvmsg);
+}
+
+//  Return bytes the cache takes in memory, kvmap and ring
+static size_t
+	memcache_memory (memcache_t *memcache)
+{
+	return (memcache->kvmap? kvmap_memory (memcache->kvmap): 0) + memcache->ring_bytes;
+}
+
+static void
+	memcache_forget (memcache_t *memcache)
+{
+	while (memcache->ring_count) {
+		memcache->ring_bytes -= s_ring_bytes (memcache->ring [memcache->ring_head]);
+		kvmsg_destroy (&memcache->ring [memcache->ring_head]);
+		memcache->ring_head = (memcache->ring_head + 1) % memcache->ring_max;
+		memcache->ring_count--;
+	}
+}
+
+//  Return the update of the ring at index, 0 being the oldest
+static kvmsg_t *
+	memcache_ring_item (memcache_t *memcache, uint index)
+{
+	return memcache->ring [(memcache->ring_head + index) % memcache->ring_max];
+}
+
+static void
+	memcache_remember (memcache_t *memcache, kvmsg_t *kvmsg)
+{
+	uint slot;
+	if (!memcache->ring_max)
+		return;
+	if (memcache->ring_count
+	&&  kvmsg_sequence (kvmsg) != kvmsg_sequence (memcache_ring_item (memcache, memcache->ring_count - 1)) + 1)
+		memcache_forget (memcache);
+	slot = (memcache->ring_head + memcache->ring_count) % memcache->ring_max;
+	if (memcache->ring_count == memcache->ring_max) {
+		memcache->ring_bytes -= s_ring_bytes (memcache->ring [slot]);
+		kvmsg_destroy (&memcache->ring [slot]);
+		memcache->ring_head = (memcache->ring_head + 1) % memcache->ring_max;
+	}
+	else
+		memcache->ring_count++;
+	memcache->ring [slot] = kvmsg_dup (kvmsg);
+	memcache->ring_bytes += s_ring_bytes (kvmsg);
+}
+
+//  Return the index in the ring of the update after sequence, or -1 if
+//  the ring does not hold all updates past sequence. Returns ring_count
+//  if there are none, the client is up to date.
+static int
+	memcache_ring_since (memcache_t *memcache, int64_t sequence)
+{
+	int64_t oldest;
+	if (sequence < 0 || sequence > memcache->sequence)
+		return -1;              //  Client saw updates we never got
+	if (sequence == memcache->sequence)
+		return memcache->ring_count;
+	if (!memcache->ring_count
+	||  kvmsg_sequence (memcache_ring_item (memcache, memcache->ring_count - 1)) != memcache->sequence)
+		return -1;
+	oldest = kvmsg_sequence (memcache_ring_item (memcache, 0));
+	if (sequence + 1 < oldest)
+		return -1;              //  Ring has wrapped
+	return (int) (sequence + 1 - oldest);
+}
+
+//  .split eviction
+//  A cache with a memoryLimit keeps only part of its keys in the kvmap;
+//  the rest are only in its LevelDB. The kvmap tells us how many bytes
+//  its entries take, the ring adds its own, and we evict with CLOCK:
+//  the hand walks the kvmap, giving a second chance to entries used
+//  since it last passed. Entries that are not yet written by the
+//  persister, or that have a TTL, stay. Nothing is evicted while a
+//  snapshot reads the LevelDB, as it would miss keys leaving the kvmap.
+
+static void
+	memcache_evict (memcache_t *memcache, size_t steps)
+{
+	if (memcache->streaming)
+		return;
+	while (memcache_memory (memcache) > memcache->memory_limit && steps--) {
+		kventry_t *entry = kvmap_next (memcache->kvmap, &memcache->clock_hand);
+		if (!entry)
+			continue;           //  Hand went back to the start
+		if (kventry_flags (entry) & KVENTRY_USED) {
+			kventry_set_flags (entry, kventry_flags (entry) & ~KVENTRY_USED);
+			continue;
+		}
+		if (kventry_sequence (entry) > memcache->persisted
+		||  kventry_expiry (entry))
+			continue;
+		kvmap_delete (memcache->kvmap, kventry_key (entry));
+		memcache->evictions++;
+	}
+}
+
+//  Store an update in the kvmap. While recovery is still filling the
+//  kvmap, or when entries may be evicted, we keep deletes as tombstones
+//  until they are written, so that neither recovery nor a snapshot
+//  reading LevelDB brings the old value back. Keys with a TTL go on the
+//  wheel, once each; a key that loses its TTL, or is deleted, leaves it:
+
+static void
+	memcache_store (memcache_t *memcache, kvmsg_t **kvmsg_p)
+{
+	kvmsg_t *kvmsg = *kvmsg_p;
+	kventry_t *entry;
+	if (memcache->tombstones) {
+		if (kvmsg_size (kvmsg) == 0)
+			kvmap_set (memcache->tombstones, kvmsg_key (kvmsg), NULL, 0, kvmsg_sequence (kvmsg), 0);
+		else
+			kvmap_delete (memcache->tombstones, kvmsg_key (kvmsg));
+	}
+	if ((!kvmsg_expiry (kvmsg) || !kvmsg_size (kvmsg)) && ttlwheel_size (memcache->ttls))
+		ttlwheel_remove (memcache->ttls, kvmsg_key (kvmsg));
+	entry = kvmap_store (memcache->kvmap, kvmsg_p);
+	if (entry && kventry_expiry (entry))
+		ttlwheel_add (memcache->ttls, kventry_key (entry), kventry_expiry (entry));
+	if (memcache->memory_limit)
+		memcache_evict (memcache, EVICT_STEPS);
+}
+
+//  Forget tombstones once they are written, and once recovery and the
+//  snapshots reading LevelDB are done. Without eviction, nothing reads
+//  LevelDB from then on, so the cache needs no tombstones at all.
+static int
+	s_purge_tombstone (kventry_t *entry, void *args)
+{
+	memcache_t *memcache = (memcache_t *) args;
+	if (kventry_sequence (entry) <= memcache->persisted)
+		kvmap_delete (memcache->tombstones, kventry_key (entry));
+	return 0;
+}
+
+static void
+	memcache_purge (memcache_t *memcache)
+{
+	if (!memcache->tombstones || memcache->warming || memcache->streaming)
+		return;
+	if (!memcache->memory_limit)
+		kvmap_destroy (&memcache->tombstones);
+	else if (kvmap_size (memcache->tombstones))
+		kvmap_foreach (memcache->tombstones, s_purge_tombstone, memcache);
+}
+
+//  Every EVICT_INTERVAL, each persisted cache drops its written
+//  tombstones, and evicts down to its memory limit if it has one
+static int
+	s_evict_cache (zloop_t *loop, zmq_pollitem_t *poller, void *args)
+{
+	memcache_t *memcache = (memcache_t *) args;
+	if (!memcache->kvmap)
+		return 0;
+	memcache_purge (memcache);
+	if (memcache->memory_limit)
+		memcache_evict (memcache, kvmap_size (memcache->kvmap));
+	return 0;
+}
+
+//  Empty the kvmap, when we go passive and wait for a new snapshot
+static void
+	memcache_clear (memcache_t *memcache)
+{
+	kvmap_destroy (&memcache->kvmap);
+	kvmap_destroy (&memcache->tombstones);
+	if (memcache->memory_limit)
+		memcache->tombstones = kvmap_new (0);
+	ttlwheel_destroy (&memcache->ttls);
+	memcache->ttls = ttlwheel_new (TTL_TICK, zclock_time ());
+	memcache->clock_hand = 0;
+	memcache->evictions = 0;
+	//  A batch the persister had no room for goes with the rest
+	leveldb_writebatch_clear (memcache->batch);
+	memcache->batched = 0;
+}
+
+//  When the persister ring is full, we stop reading the collector, so
+//  that clients wait for LevelDB rather than the reactor. Batches that
+//  did not fit stay with their memcache, and go once the ring has room:
+
+static void
+	s_persist_stall (base_t *base)
+{
+	zloop_t *loop;
+	zmq_pollitem_t poller = { base->collector, 0, ZMQ_POLLIN, 0 };
+	if (base->stalled)
+		return;
+	loop = bstar_zloop (((clonesrv_t *) base->clonesrv)->bstar);
+	base->stalled = TRUE;
+	zloop_poller_end (loop, &poller);
+	zloop_timer (loop, PERSIST_INTERVAL, 1, s_persist_timer, base);
+}
+
+static void
+	memcache_commit (memcache_t *memcache)
+{
+	base_t *base = (base_t *) memcache->base;
+	memcache_reserve (memcache);
+	if (memcache->batched == 0)
+		return;
+	//  Keep the number of keys aside, so recovery knows what to expect
+	if (memcache->kvmap && kvmap_size (memcache->kvmap) != memcache->size_hint) {
+		char KCount [21];
+		memcache->size_hint = kvmap_size (memcache->kvmap);
+		sprintf_s (KCount, sizeof (KCount), "%Iu", memcache->size_hint);
+		leveldb_writebatch_put (memcache->batch, INTERNAL_KEYCOUNT, sizeof (INTERNAL_KEYCOUNT), KCount, strlen (KCount) + 1);
+	}
+	if (memcache->durability == DURABILITY_SYNC) {
+		char *errptr = NULL;
+		leveldb_write (memcache->db, memcache->writeOptions, memcache->batch, &errptr);
+		if (errptr) {
+			clone_log(LOG_LEVEL_ERROR, LOG_TYPE_PERSIST, "E: memcache_commit cache=%s write up to sequence %I64d failed: %s", memcache->cacheidstr, memcache->sequence, errptr);
+			leveldb_free (errptr);
+		}
+		leveldb_writebatch_clear (memcache->batch);
+		memcache->persisted = memcache->synced = memcache->sequence;
+	}
+	else if (persister_push (base->persister, memcache->db, memcache->writeOptions, memcache->batch, memcache->sequence, &memcache->persisted) == 0)
+		memcache->batch = leveldb_writebatch_create ();
+	else {
+		s_persist_stall (base);
+		return;
+	}
+	memcache->batched = 0;
+}
+
+//  Once the ring is down to half, we push the batches that waited, and
+//  read the collector again:
+
+static int
+	s_persist_timer (zloop_t *loop, zmq_pollitem_t *unused, void *args)
+{
+	uint cacheid;
+	base_t *base = (base_t *) args;
+	zmq_pollitem_t poller = { base->collector, 0, ZMQ_POLLIN, 0 };
+	if (persister_depth (base->persister) > persister_size (base->persister) / 2) {
+		zloop_timer (loop, PERSIST_INTERVAL, 1, s_persist_timer, base);
+		return 0;
+	}
+	base->stalled = FALSE;
+	for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++)
+		memcache_commit (base->memcaches [cacheid]);
+	if (!base->stalled)
+		zloop_poller (loop, &poller, s_collector, base);
+	return 0;
+}
+
+//  In periodic durability, an empty batch written with sync set behind
+//  every batch queued so far makes the persister fsync them all:
+
+static int
+	s_sync_cache (zloop_t *loop, zmq_pollitem_t *poller, void *args)
+{
+	memcache_t *memcache = (memcache_t *) args;
+	base_t *base = (base_t *) memcache->base;
+	if (memcache->db && memcache->synced != memcache->sequence) {
+		//  A full ring is tried again on the next tick
+		leveldb_writebatch_t *batch = leveldb_writebatch_create ();
+		if (persister_push (base->persister, memcache->db, memcache->syncOptions, batch, memcache->sequence, &memcache->persisted) == 0)
+			memcache->synced = memcache->sequence;
+		else
+			leveldb_writebatch_destroy (batch);
+	}
+	return 0;
+}
+
+//  .split recovery
+//  On first activation we reload the kvmap from LevelDB. The node does
+//  not wait for this: the sequence to continue from is reserved in
+//  SEQUENCENUMBER, so recovery threads load the caches in the background
+//  while the reactor takes updates, and snapshots read what is not yet
+//  loaded straight from LevelDB. Only databases without SEQUENCENUMBER
+//  must be read fully, to find the highest sequence, before we go on.
+
+//  Build a kvmsg from a persisted record; returns NULL for tombstones and
+//  expired records, and sets *expired for the latter:
+
+static kvmsg_t *
+	s_record_kvmsg (char *key, byte *record, size_t size, int64_t now, int64_t *sequence, Bool *expired)
+{
+	kvmsg_t *kvmsg;
+	int64_t expiry;
+	byte flags;
+	size_t header = persister_record_decode (record, size, sequence, &expiry, &flags);
+	*expired = FALSE;
+	if ((flags & PERSIST_FLAG_DELETED) || size <= header)
+		return NULL;
+	if (expiry && expiry <= now) {
+		*expired = TRUE;
+		return NULL;
+	}
+	kvmsg = kvmsg_new (*sequence);
+	kvmsg_set_key  (kvmsg, key);
+	kvmsg_set_body (kvmsg, record + header, size - header);
+	kvmsg_set_expiry (kvmsg, expiry);
+	return kvmsg;
+}
+
+//  Return TRUE for our own records, see INTERNAL_SEQUENCE
+static Bool
+	s_record_internal (char *key, size_t size)
+{
+	return size > 1 && key [0] == 0;
+}
+
+//  Databases written before internal keys had their leading null byte
+//  hold SEQUENCENUMBER and KEYCOUNT as plain keys. We move them once,
+//  so that from then on those names are free for user keys:
+static void
+	s_upgrade_internal (memcache_t *memcache, leveldb_readoptions_t *read_options)
+{
+	char *value;
+	size_t size;
+	char *errptr = NULL;
+	leveldb_writebatch_t *batch;
+	value = leveldb_get (memcache->db, read_options, INTERNAL_SEQUENCE, sizeof (INTERNAL_SEQUENCE), &size, &errptr);
+	if (errptr) {
+		leveldb_free (errptr);
+		errptr = NULL;
+	}
+	if (value) {
+		leveldb_free (value);
+		return;
+	}
+	batch = leveldb_writebatch_create ();
+	value = leveldb_get (memcache->db, read_options, "SEQUENCENUMBER", 15, &size, &errptr);
+	if (value) {
+		leveldb_writebatch_put (batch, INTERNAL_SEQUENCE, sizeof (INTERNAL_SEQUENCE), value, size);
+		leveldb_writebatch_delete (batch, "SEQUENCENUMBER", 15);
+		leveldb_free (value);
+	}
+	value = leveldb_get (memcache->db, read_options, "KEYCOUNT", 9, &size, &errptr);
+	if (value) {
+		leveldb_writebatch_put (batch, INTERNAL_KEYCOUNT, sizeof (INTERNAL_KEYCOUNT), value, size);
+		leveldb_writebatch_delete (batch, "KEYCOUNT", 9);
+		leveldb_free (value);
+	}
+	if (errptr) {
+		leveldb_free (errptr);
+		errptr = NULL;
+	}
+	leveldb_write (memcache->db, memcache->syncOptions, batch, &errptr);
+	if (errptr) {
+		clone_log(LOG_LEVEL_ERROR, LOG_TYPE_PERSIST, "E: s_upgrade_internal cache=%s failed: %s", memcache->cacheidstr, errptr);
+		leveldb_free (errptr);
+	}
+	leveldb_writebatch_destroy (batch);
+}
+
+//  Caches waiting to be recovered, shared by the recovery threads. Each
+//  thread takes the next cache until there are none left:
+typedef struct {
+	memcache_t *memcaches [CACHE_MAX];
+	long nbr_memcaches;
+	volatile long next;
+	volatile long cancel;       //  Set to stop recovery threads early
+	void *pipes [CACHE_MAX];    //  Pipes to threads still running
+	long nbr_threads;
+	int64_t loaded;
+	int64_t started;
+} recovery_t;
+
+//  A recovery thread reads one cache at a time, as a bulk load: we bypass
+//  the LevelDB block cache, and build each kvmsg straight from the record,
+//  without uuid or printf. It hands kvmsgs to the reactor in chunks of
+//  RECOVERY_CHUNK, and must never touch the memcache itself:
+
+static void
+	s_recover_cache (recovery_t *recovery, memcache_t *memcache, void *pipe)
+{
+	zmsg_t *msg;
+	zlist_t *chunk = zlist_new ();
+	int64_t sequence = 0;
+	int64_t loaded = 0;
+	int64_t expired = 0;
+	int64_t now = zclock_time ();
+	int64_t started = zclock_time ();
+	leveldb_iterator_t *iterator;
+	leveldb_readoptions_t *read_options = leveldb_readoptions_create ();
+
+	leveldb_readoptions_set_fill_cache (read_options, 0);
+	iterator = leveldb_create_iterator (memcache->db, read_options);
+	for (leveldb_iter_seek_to_first (iterator); leveldb_iter_valid (iterator) && !recovery->cancel; leveldb_iter_next (iterator)) {
+		kvmsg_t *kvmsg;
+		size_t sizekey, sizevalue;
+		int64_t record_sequence;
+		Bool record_expired;
+		char *key = (char *) leveldb_iter_key (iterator, &sizekey);
+		byte *record = (byte *) leveldb_iter_value (iterator, &sizevalue);
+		if (s_record_internal (key, sizekey))
+			continue;
+		kvmsg = s_record_kvmsg (key, record, sizevalue, now, &record_sequence, &record_expired);
+		if (record_sequence > sequence)
+			sequence = record_sequence;
+		if (record_expired)
+			expired++;
+		if (!kvmsg)
+			continue;
+		zlist_append (chunk, kvmsg);
+		loaded++;
+		if (zlist_size (chunk) == RECOVERY_CHUNK) {
+			msg = zmsg_new ();
+			zmsg_addstr (msg, "CHUNK");
+			zmsg_addmem (msg, &memcache, sizeof (memcache));
+			zmsg_addmem (msg, &chunk, sizeof (chunk));
+			zmsg_send (&msg, pipe);
+			chunk = zlist_new ();
+		}
+	}
+	leveldb_iter_destroy (iterator);
+	leveldb_readoptions_destroy (read_options);
+
+	msg = zmsg_new ();
+	zmsg_addstr (msg, "LOADED");
+	zmsg_addmem (msg, &memcache, sizeof (memcache));
+	zmsg_addmem (msg, &chunk, sizeof (chunk));
+	zmsg_addstr (msg, "%I64d %I64d %I64d %I64d", sequence, loaded, expired, zclock_time () - started);
+	zmsg_send (&msg, pipe);
+}
+
+static void
+	s_recovery_worker (void *args, zctx_t *ctx, void *pipe)
+{
+	recovery_t *recovery = (recovery_t *) args;
+	long index;
+	while ((index = InterlockedIncrement (&recovery->next) - 1) < recovery->nbr_memcaches
+	&& !recovery->cancel)
+		s_recover_cache (recovery, recovery->memcaches [index], pipe);
+	zstr_send (pipe, "DONE");
+}
+
+static void
+	memcache_warmed (memcache_t *memcache)
+{
+	memcache->warming = FALSE;
+	memcache_purge (memcache);
+}
+
+//  The reactor merges each chunk into the kvmap. A key already in the
+//  kvmap, or deleted since we started, was updated after it was persisted,
+//  so the recovered value is dropped. Returns 1 when the thread is done:
+
+static int
+	s_recovery_message (base_t *base, void *pipe)
+{
+	recovery_t *recovery = (recovery_t *) base->recovery;
+	zmsg_t *msg = zmsg_recv (pipe);
+	char *command;
+	memcache_t *memcache;
+	zlist_t *chunk;
+
+	if (!msg)
+		return 1;               //  Interrupted
+	command = zmsg_popstr (msg);
+	if (streq (command, "DONE")) {
+		zmsg_destroy (&msg);
+		free (command);
+		return 1;
+	}
+	memcpy (&memcache, zframe_data (zmsg_first (msg)), sizeof (memcache));
+	memcpy (&chunk, zframe_data (zmsg_next (msg)), sizeof (chunk));
+	while (zlist_size (chunk)) {
+		kvmsg_t *kvmsg = (kvmsg_t *) zlist_pop (chunk);
+		if (kvmap_lookup (memcache->kvmap, kvmsg_key (kvmsg))
+		||  kvmap_lookup (memcache->tombstones, kvmsg_key (kvmsg)))
+			kvmsg_destroy (&kvmsg);
+		else if (memcache->memory_limit && memcache_memory (memcache) >= memcache->memory_limit) {
+			//  No room left, leave the rest in LevelDB
+			kvmsg_destroy (&kvmsg);
+			memcache->evictions++;
+		}
+		else
+			memcache_store (memcache, &kvmsg);
+	}
+	zlist_destroy (&chunk);
+	if (streq (command, "LOADED")) {
+		int64_t sequence, loaded, expired, elapsed;
+		char *counts = (char *) zframe_data (zmsg_next (msg));
+		sscanf (counts, "%I64d %I64d %I64d %I64d", &sequence, &loaded, &expired, &elapsed);
+		if (sequence > memcache->sequence)
+			memcache->sequence = memcache->persisted = memcache->synced = sequence;
+		memcache_warmed (memcache);
+		memcache->size_hint = kvmap_size (memcache->kvmap);
+		recovery->loaded += loaded;
+		clone_log(LOG_LEVEL_INFO, LOG_TYPE_PERSIST, "I: memcache_recover cache=%s loaded=%I64d expired=%I64d keys=%Iu sequence=%I64d msecs=%I64d keys/sec=%I64d",
+			memcache->cacheidstr, loaded, expired, memcache->size_hint, memcache->sequence, elapsed, loaded * 1000 / (elapsed? elapsed: 1));
+	}
+	zmsg_destroy (&msg);
+	free (command);
+	return 0;
+}
+
+static void
+	s_recovery_end (base_t *base)
+{
+	recovery_t *recovery = (recovery_t *) base->recovery;
+	int64_t elapsed = zclock_time () - recovery->started;
+	long cacheid;
+	//  Caches whose thread was cancelled stay partly loaded
+	for (cacheid = 0; cacheid < recovery->nbr_memcaches; cacheid++)
+		memcache_warmed (recovery->memcaches [cacheid]);
+	clone_log(LOG_LEVEL_INFO, LOG_TYPE_PERSIST, "I: base_recover base=%s caches=%ld loaded=%I64d msecs=%I64d keys/sec=%I64d",
+		base->baseidstr, recovery->nbr_memcaches, recovery->loaded, elapsed, recovery->loaded * 1000 / (elapsed? elapsed: 1));
+	free (recovery);
+	base->recovery = NULL;
+}
+
+static int
+	s_recovery_reader (zloop_t *loop, zmq_pollitem_t *poller, void *args)
+{
+	base_t *base = (base_t *) args;
+	recovery_t *recovery = (recovery_t *) base->recovery;
+	void *pipe = poller->socket;
+	long thread_nbr;
+	if (s_recovery_message (base, pipe)) {
+		zloop_poller_end (loop, poller);
+		zsocket_destroy (base->ctx, pipe);
+		for (thread_nbr = 0; thread_nbr < recovery->nbr_threads; thread_nbr++)
+			if (recovery->pipes [thread_nbr] == pipe)
+				recovery->pipes [thread_nbr] = NULL;
+		if (--base->recovering == 0)
+			s_recovery_end (base);
+	}
+	return 0;
+}
+
+//  Wait for the recovery threads of the base, merging what they send.
+//  If cancel is set, threads stop at the next record, and we take their
+//  pipes off the reactor, if any:
+
+static void
+	s_recovery_wait (base_t *base, zloop_t *loop, Bool cancel)
+{
+	recovery_t *recovery = (recovery_t *) base->recovery;
+	long thread_nbr;
+	if (!recovery)
+		return;
+	if (cancel)
+		recovery->cancel = 1;
+	for (thread_nbr = 0; thread_nbr < recovery->nbr_threads; thread_nbr++) {
+		void *pipe = recovery->pipes [thread_nbr];
+		if (!pipe)
+			continue;
+		if (loop) {
+			zmq_pollitem_t poller = { pipe, 0, ZMQ_POLLIN };
+			zloop_poller_end (loop, &poller);
+		}
+		while (!s_recovery_message (base, pipe));
+		zsocket_destroy (base->ctx, pipe);
+		recovery->pipes [thread_nbr] = NULL;
+	}
+	base->recovering = 0;
+	s_recovery_end (base);
+}
+
+//  Start recovery of every cache of the base that has never been active,
+//  on up to recovery_threads threads:
+
+static void
+	base_recover (base_t *base, zloop_t *loop)
+{
+	recovery_t *recovery;
+	Bool blocking = FALSE;
+	uint cacheid;
+	long thread_nbr;
+
+	if (base->recovery)
+		return;                 //  Already recovering
+	recovery = (recovery_t *) zmalloc (sizeof (recovery_t));
+	for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++) {
+		memcache_t *memcache = base->memcaches [cacheid];
+		char *value;
+		char *errptr = NULL;
+		size_t vallenth = 0;
+		leveldb_readoptions_t *read_options;
+		if (memcache->sequence || !memcache->db)
+			continue;
+		read_options = leveldb_readoptions_create ();
+		s_upgrade_internal (memcache, read_options);
+		value = leveldb_get (memcache->db, read_options, INTERNAL_SEQUENCE, sizeof (INTERNAL_SEQUENCE), &vallenth, &errptr);
+		if (value) {
+			sscanf (value, "%I64d", &memcache->sequence);
+			memcache->persisted = memcache->synced = memcache->reserved = memcache->sequence;
+			leveldb_free (value);
+		}
+		else
+			blocking = TRUE;
+		if (errptr) {
+			leveldb_free (errptr);
+			errptr = NULL;
+		}
+		//  Size the index for the keys we expect, unless they may not all fit
+		value = leveldb_get (memcache->db, read_options, INTERNAL_KEYCOUNT, sizeof (INTERNAL_KEYCOUNT), &vallenth, &errptr);
+		if (value) {
+			sscanf (value, "%Iu", &memcache->size_hint);
+			leveldb_free (value);
+		}
+		if (errptr)
+			leveldb_free (errptr);
+		leveldb_readoptions_destroy (read_options);
+		if (memcache->kvmap && kvmap_size (memcache->kvmap) == 0)
+			kvmap_destroy (&memcache->kvmap);
+		if (memcache->kvmap == NULL)
+			memcache->kvmap = kvmap_new (memcache->memory_limit? 0: memcache->size_hint);
+		if (memcache->tombstones == NULL)
+			memcache->tombstones = kvmap_new (0);
+		memcache->warming = TRUE;
+		recovery->memcaches [recovery->nbr_memcaches++] = memcache;
+	}
+	if (recovery->nbr_memcaches == 0) {
+		free (recovery);
+		return;
+	}
+	base->recovery = recovery;
+	recovery->started = zclock_time ();
+	recovery->nbr_threads = min ((long) base->recovery_threads, recovery->nbr_memcaches);
+	base->recovering = (uint) recovery->nbr_threads;
+	for (thread_nbr = 0; thread_nbr < recovery->nbr_threads; thread_nbr++)
+		recovery->pipes [thread_nbr] = zthread_fork (base->ctx, s_recovery_worker, recovery);
+	clone_log(LOG_LEVEL_INFO, LOG_TYPE_PERSIST, "I: base_recover base=%s caches=%ld threads=%u %s",
+		base->baseidstr, recovery->nbr_memcaches, base->recovering, blocking? "waiting, no sequence reserved": "warming up");
+
+	if (blocking)
+		s_recovery_wait (base, NULL, FALSE);
+	else
+		for (thread_nbr = 0; thread_nbr < recovery->nbr_threads; thread_nbr++) {
+			zmq_pollitem_t poller = { recovery->pipes [thread_nbr], 0, ZMQ_POLLIN };
+			zloop_poller (loop, &poller, s_recovery_reader, base);
+		}
+}
+
 static void
 	base_addcache (base_t *base, char *cacheidstr, char *dbPath)
 {
 	clonesrv_t *clonesrv;
 	assert (base);
 	clonesrv = (clonesrv_t *)base->clonesrv;
+	if (base_findcacheid (base, kvmsg_hash_cacheid (cacheidstr)) >= 0) {
+		clone_log(LOG_LEVEL_ERROR, LOG_TYPE_CLONE, "E: base_addcache cache %s has the same hash as another cache of base %s, rename it, cache not added", cacheidstr, base->baseidstr);
+		return;
+	}
 	strcpy(base->cacheids[base->nbr_memcaches], cacheidstr);
 	base->memcaches [base->nbr_memcaches] = memcache_new (base, base->nbr_memcaches, dbPath);
 	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: base_addcache cacheid=%d", base->nbr_memcaches);
 	zloop_timer  (bstar_zloop (clonesrv->bstar), 1000, 0, s_send_hugz, base->memcaches [base->nbr_memcaches]);
+	if (base->memcaches [base->nbr_memcaches]->durability == DURABILITY_PERIODIC)
+		zloop_timer (bstar_zloop (clonesrv->bstar), params->bases[base->baseid]->syncInterval, 0, s_sync_cache, base->memcaches [base->nbr_memcaches]);
+	if (base->memcaches [base->nbr_memcaches]->db)
+		zloop_timer (bstar_zloop (clonesrv->bstar), EVICT_INTERVAL, 0, s_evict_cache, base->memcaches [base->nbr_memcaches]);
 	base->nbr_memcaches++;
 }
 
@@ -117,19 +901,31 @@ static base_t *
 	//  Initialize the Binary Star
 	base->ctx = zctx_new ();
 	base->clonesrv = clonesrv;
+	base->baseid = baseid;
 	base->port = base_params->port;
 	base->peer = base_params->peer;
+	base->snapshots = zlist_new ();
 	bstar_snapshot_req_receptor (clonesrv->bstar, base_params->bstarReceptor, ZMQ_ROUTER, send_snapshot, base);
-	//  Set up our clone server sockets
-	base->publisher = zsocket_new (base->ctx, ZMQ_PUB);
+	//  Set up our clone server sockets; the publisher tells us what
+	//  clients subscribe to, and our peer gets updates on its own socket
+	base->publisher = zsocket_new (base->ctx, ZMQ_XPUB);
 	base->collector = zsocket_new (base->ctx, ZMQ_SUB);
+	base->replicator = zsocket_new (base->ctx, ZMQ_PUB);
 	zsockopt_set_subscribe (base->collector, "");
 	zsocket_bind (base->publisher, "tcp://*:%d", base->port + 1);
 	zsocket_bind (base->collector, "tcp://*:%d", base->port + 2);
+	zsocket_bind (base->replicator, "tcp://*:%d", base->port + 4);
+	//  Slow clients may get conflated updates instead
+	if (base_params->conflateInterval) {
+		base->conflater = zsocket_new (base->ctx, ZMQ_PUB);
+		zsocket_bind (base->conflater, "tcp://*:%d", base->port + 3);
+		base->conflated = zhash_new ();
+		zloop_timer (bstar_zloop (clonesrv->bstar), base_params->conflateInterval, 0, s_flush_conflated, base);
+	}
 	//  Set up our own clone client interface to peer
 	base->subscriber = zsocket_new (base->ctx, ZMQ_SUB);
 	zsockopt_set_subscribe (base->subscriber, "");
-	zsocket_connect (base->subscriber, "tcp://localhost:%d", base->peer + 1);
+	zsocket_connect (base->subscriber, "tcp://localhost:%d", base->peer + 4);
 	//  .split main task body
 	//  After we've set-up our sockets we register our binary star
 	//  event handlers, and then start the bstar reactor. This finishes
@@ -142,8 +938,26 @@ static base_t *
 	poller.events = ZMQ_POLLIN ;
 
 	zloop_poller (bstar_zloop (clonesrv->bstar), &poller, s_collector, base);
+	poller.socket = base->publisher;
+	zloop_poller (bstar_zloop (clonesrv->bstar), &poller, s_subscription, base);
 	//TODO FOR EACH BASE OR EACH CACHE ?? zloop_timer  (bstar_zloop (clonesrv->bstar), 1000, 0, s_send_hugz, clonesrv->bases[baseid]);
 	strncpy (base->baseidstr, baseidstr, MAXLEN);
+	base->batch_max = base_params->batchMax;
+	base->batch_delay = base_params->batchDelay;
+	base->recovery_threads = base_params->recoveryThreads;
+	base->compact = base_params->compactWire != 0;
+	base->topics = base_params->topicWire != 0;
+	//  Only clients that read compact kvmsgs read packs
+	if (base_params->publishBatch && base->compact) {
+		base->pack_max = base_params->publishBatch;
+		base->pack = (byte *) malloc (base->pack_max);
+	}
+	else if (base_params->publishBatch)
+		clone_log(LOG_LEVEL_WARNING, LOG_TYPE_CLONE, "W: base_new base=%s publishBatch needs compactWire, not batching", base->baseidstr);
+	base->persister = persister_new (base->ctx, base->baseidstr, base_params->persistRing);
+	if (base_params->statsInterval > 0)
+		zloop_timer (bstar_zloop (clonesrv->bstar), base_params->statsInterval, 0, s_log_stats, base);
+	zloop_timer (bstar_zloop (clonesrv->bstar), TTL_TICK, 0, s_flush_ttl, base);
 	base->nbr_memcaches = 0;
 	for (cacheid = 0; cacheid < base_params->nbr_memcaches ; cacheid++) {
 		base_addcache (base, base_params->cacheids[cacheid]  , base_params->databasePath);
@@ -158,11 +972,18 @@ static void
 	assert (base_p);
 	if (*base_p) {
 		base_t *base = *base_p;
-		for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid) {
-			memcache_t *memcache = base->memcaches[cacheid];
-			memcache_destroy (&memcache);
-		}
+		//  Stop recovery threads and snapshots before their databases go away
+		s_recovery_wait (base, NULL, TRUE);
+		base_snapshots_cancel (base);
+		zlist_destroy (&base->snapshots);
+		//  Let the persister write what it holds before closing databases
+		persister_destroy (&base->persister);
+		for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++)
+			memcache_destroy (&base->memcaches [cacheid]);
 		zctx_destroy (&base->ctx);
+		if (base->conflated)
+			zhash_destroy (&base->conflated);
+		free (base->pack);
 		free (base);
 		*base_p = NULL;
 	}
@@ -213,17 +1034,25 @@ static memcache_t *
 	return NULL;
 }
 
+//  Updates name their cache by hash, see kvmsg_hash_cacheid
 static int
-	base_getcacheid (base_t *base, char *cacheidstr)
+	base_findcacheid (base_t *base, uint cachehash)
 {
 	int cacheid;
 	assert (base);
 	for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++)
-		if (streq (cacheidstr, base->cacheids[cacheid]))
+		if (base->memcaches [cacheid]->cachehash == cachehash)
 			return cacheid;
 	return -1;
 }
 
+static memcache_t *
+	base_findcache (base_t *base, uint cachehash)
+{
+	int cacheid = base_findcacheid (base, cachehash);
+	return cacheid < 0? NULL: base->memcaches [cacheid];
+}
+
 //  .split main task setup
 //  The main task parses the command line to decide whether to start
 //  as primary or backup server. We're using the Binary Star pattern
@@ -233,7 +1062,8 @@ static int
 //  and backup. Ports 5003/5004 are used to interconnect the servers.
 //  Ports 5556/5566 are used to receive voting events (snapshot requests
 //  in the clone pattern). Ports 5557/5567 are used by the publisher,
-//  and ports 5558/5568 by the collector:
+//  ports 5558/5568 by the collector, ports 5559/5569 by the conflater
+//  and ports 5560/5570 by the replicator, that feeds the passive peer:
 
 
 void launchServer (int argc, char* confPath)
@@ -295,86 +1125,584 @@ void launchServer (int argc, char* confPath)
 //  .skip
 
 
-//  Send one state snapshot key-value pair to a socket
-//  Hash item data is our kvmsg object, ready to send
-static int
-	s_send_single (const char *key, void *data, void *args)
+//  Send kvmsg in the encoding the peer reads. Peers that don't ask for
+//  compact kvmsgs may predate the kvmsg header, so they get the legacy
+//  frames, which name the cache
+static void
+	s_send_encoded (base_t *base, kvmsg_t *kvmsg, void *socket, Bool compact)
 {
-	kvroute_t *kvroute = (kvroute_t *) args;
-	kvmsg_t *kvmsg = (kvmsg_t *) data;
+	memcache_t *memcache;
+	if (compact) {
+		kvmsg_send_compact (kvmsg, socket);
+		return;
+	}
+	memcache = base_findcache (base, kvmsg_cachehash (kvmsg));
+	kvmsg_send_legacy (kvmsg, socket, memcache? memcache->cacheidstr: "");
+}
+
+//  Send one state snapshot key-value pair to a socket, and destroy it
+static void
+	s_send_kvmsg (kvmsg_t **kvmsg_p, kvroute_t *kvroute)
+{
+	kvmsg_t *kvmsg = *kvmsg_p;
 	//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: s_send_single [seq:%I64d] [key:%s]", kvmsg_sequence (kvmsg), kvmsg_key (kvmsg));
 	if (strlen (kvroute->subtree) <= strlen (kvmsg_key (kvmsg)) &&  memcmp (kvroute->subtree, kvmsg_key (kvmsg), strlen (kvroute->subtree)) == 0) {
 		zframe_send (&kvroute->identity,    //  Choose recipient
 			kvroute->socket, ZFRAME_MORE + ZFRAME_REUSE);
-		kvmsg_send (kvmsg, kvroute->socket);
+		kvmsg_set_cachehash (kvmsg, kvroute->cachehash);
+		s_send_encoded (kvroute->base, kvmsg, kvroute->socket, kvroute->compact);
+	}
+	kvmsg_destroy (kvmsg_p);
+}
+
+//  The kvmap holds entries, not kvmsgs, so we build one for each entry
+static int
+	s_send_single (kventry_t *entry, void *args)
+{
+	kvmsg_t *kvmsg = kventry_kvmsg (entry);
+	s_send_kvmsg (&kvmsg, (kvroute_t *) args);
+	return 0;
+}
+
+//  Now send END message with sequence number, and the cache it was
+//  for, if it was for one cache only
+static void
+	s_send_end (base_t *base, void *socket, zframe_t *identity, int64_t sequence, uint cachehash, Bool compact)
+{
+	kvmsg_t *kvmsg;
+	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: sending end snapshots ENDSNAPSHOT");
+	zframe_send (&identity, socket, ZFRAME_MORE + ZFRAME_REUSE);
+	kvmsg = kvmsg_new (sequence);
+	kvmsg_set_key  (kvmsg, "ENDSNAPSHOT");
+	kvmsg_set_cachehash (kvmsg, cachehash);
+	kvmsg_set_body (kvmsg, (byte *) "", 0);
+	s_send_encoded (base, kvmsg, socket, compact);
+	kvmsg_destroy (&kvmsg);
+}
+
+//  .split snapshot requests
+//  While a cache is warming up, or once it has evicted entries, its
+//  snapshot also holds the persisted records that are not in its kvmap.
+//  Reading all of LevelDB at once would hold up hugz and the bstar
+//  heartbeat, so a snapshot reads SNAPSHOT_CHUNK records at a time, from
+//  a timer, and sends the kvmap once LevelDB is done. Requests are
+//  served one at a time, in the order they came, so that each client
+//  gets its answers in the order it asked.
+
+typedef struct {
+	void *socket;               //  ROUTER socket to answer on
+	zframe_t *identity;         //  Identity of peer who requested state
+	Bool compact;               //  TRUE if peer asked for compact kvmsgs
+	memcache_t *memcaches [CACHE_MAX];  //  Caches to send, in order
+	uint nbr_memcaches;
+	uint next;                  //  Next of them to send
+	int64_t sequence;           //  Sequence of ENDSNAPSHOT
+	uint cachehash;             //  Cache of ENDSNAPSHOT, if for one cache
+	Bool since;                 //  TRUE for a GETSINCE not answered yet
+	int64_t since_sequence;     //  Its sequence
+	int64_t since_epoch;        //  Its epoch, 0 if not given
+	leveldb_readoptions_t *read_options;
+	leveldb_iterator_t *iterator;   //  On LevelDB of next cache, if reading
+} snapshot_t;
+
+static snapshot_t *
+	snapshot_new (void *socket, zframe_t *identity, Bool compact)
+{
+	snapshot_t *self = (snapshot_t *) zmalloc (sizeof (snapshot_t));
+	self->socket = socket;
+	self->identity = identity;
+	self->compact = compact;
+	return self;
+}
+
+static void
+	snapshot_destroy (snapshot_t **self_p)
+{
+	assert (self_p);
+	if (*self_p) {
+		snapshot_t *self = *self_p;
+		if (self->iterator) {
+			leveldb_iter_destroy (self->iterator);
+			leveldb_readoptions_destroy (self->read_options);
+			self->memcaches [self->next]->streaming--;
+		}
+		zframe_destroy (&self->identity);
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+//  Send the next SNAPSHOT_CHUNK persisted records that are not in the
+//  kvmap. A key deleted since it was written has a tombstone, which the
+//  cache keeps while we read. Returns TRUE once LevelDB is done:
+static Bool
+	s_send_persisted (memcache_t *memcache, snapshot_t *snapshot, kvroute_t *routing)
+{
+	int64_t now = zclock_time ();
+	leveldb_iterator_t *iterator = snapshot->iterator;
+	uint records = 0;
+
+	for (; leveldb_iter_valid (iterator) && records < SNAPSHOT_CHUNK; leveldb_iter_next (iterator), records++) {
+		kvmsg_t *kvmsg;
+		size_t sizekey, sizevalue;
+		int64_t record_sequence;
+		Bool record_expired;
+		char *key = (char *) leveldb_iter_key (iterator, &sizekey);
+		if (s_record_internal (key, sizekey)
+		||  kvmap_lookup (memcache->kvmap, key)
+		||  (memcache->tombstones && kvmap_lookup (memcache->tombstones, key)))
+			continue;
+		kvmsg = s_record_kvmsg (key, (byte *) leveldb_iter_value (iterator, &sizevalue), sizevalue, now, &record_sequence, &record_expired);
+		if (kvmsg)
+			s_send_kvmsg (&kvmsg, routing);
+	}
+	return !leveldb_iter_valid (iterator);
+}
+
+//  A GETSINCE, see kvmsg.h. Updates go out as they were published, so
+//  a delete has an empty body. A sequence is ours if it has our epoch.
+//  Else it is from an active we took over from, and it is the same
+//  update as ours up to our takeover only: past it, that active may
+//  have published updates that never reached us, and we gave their
+//  sequences to others. Returns FALSE if the client needs a snapshot:
+static Bool
+	s_send_since (base_t *base, snapshot_t *snapshot)
+{
+	kvmsg_t *kvmsg;
+	int index = -1;
+	memcache_t *memcache = snapshot->memcaches [0];
+	int64_t sequence = snapshot->since_sequence;
+	if (memcache->kvmap
+	&& ((snapshot->since_epoch && snapshot->since_epoch == base->epoch) || sequence <= memcache->takeover))
+		index = memcache_ring_since (memcache, sequence);
+	if (index < 0) {
+		clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: send_since cache=%s since=%I64d sequence=%I64d not in ring, sending snapshot", memcache->cacheidstr, sequence, memcache->sequence);
+		memcache->catchup_snapshots++;
+		return FALSE;
+	}
+	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: send_since cache=%s since=%I64d sending %u updates", memcache->cacheidstr, sequence, memcache->ring_count - index);
+	zframe_send (&snapshot->identity, snapshot->socket, ZFRAME_MORE + ZFRAME_REUSE);
+	kvmsg = kvmsg_new (sequence);
+	kvmsg_set_key  (kvmsg, "BEGINSINCE");
+	kvmsg_set_cachehash (kvmsg, memcache->cachehash);
+	kvmsg_set_prop (kvmsg, "epoch", "%I64d", base->epoch);
+	kvmsg_set_body (kvmsg, (byte *) "", 0);
+	kvmsg_send_compact (kvmsg, snapshot->socket);
+	kvmsg_destroy (&kvmsg);
+	for (; (uint) index < memcache->ring_count; index++) {
+		zframe_send (&snapshot->identity, snapshot->socket, ZFRAME_MORE + ZFRAME_REUSE);
+		kvmsg_send_compact (memcache_ring_item (memcache, index), snapshot->socket);
+	}
+	memcache->catchups++;
+	snapshot->sequence = memcache->sequence;
+	return TRUE;
+}
+
+//  Send what we can of a snapshot without waiting: for each cache we
+//  have a kvmap of, BEGINMEMCACHE with its sequence, then the records of
+//  its LevelDB if it has records out of the kvmap, then its entries.
+//  Returns TRUE once the snapshot is all sent, ENDSNAPSHOT included:
+static Bool
+	s_snapshot_send (base_t *base, snapshot_t *snapshot)
+{
+	kvmsg_t *kvmsg;
+	if (snapshot->since) {
+		snapshot->since = FALSE;
+		if (s_send_since (base, snapshot))
+			snapshot->next = snapshot->nbr_memcaches;
 	}
+	while (snapshot->next < snapshot->nbr_memcaches) {
+		memcache_t *memcache = snapshot->memcaches [snapshot->next];
+		kvroute_t routing = { snapshot->socket, snapshot->identity, "", memcache->cachehash, snapshot->compact, base };
+		if (snapshot->iterator) {
+			if (!s_send_persisted (memcache, snapshot, &routing))
+				return FALSE;
+			leveldb_iter_destroy (snapshot->iterator);
+			leveldb_readoptions_destroy (snapshot->read_options);
+			snapshot->iterator = NULL;
+			memcache->streaming--;
+		}
+		else if (!memcache->kvmap) {
+			clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: send_snapshot cache=%s NO KVMAP", memcache->cacheidstr);
+			snapshot->next++;
+			continue;
+		}
+		else {
+			//  Send snapshot enreg to client
+			clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: sending SNAPSHOT");
+			zframe_send (&snapshot->identity, snapshot->socket, ZFRAME_MORE + ZFRAME_REUSE);
+			kvmsg = kvmsg_new (memcache->sequence);
+			kvmsg_set_key  (kvmsg, "BEGINMEMCACHE");
+			kvmsg_set_cachehash (kvmsg, memcache->cachehash);
+			kvmsg_set_prop (kvmsg, "epoch", "%I64d", base->epoch);
+			kvmsg_set_body (kvmsg, (byte *) "", 0);
+			s_send_encoded (base, kvmsg, snapshot->socket, snapshot->compact);
+			kvmsg_destroy (&kvmsg);
+			snapshot->sequence = memcache->sequence;
+			//  Until we are done reading LevelDB, the cache keeps its
+			//  entries and its tombstones
+			if ((memcache->warming || memcache->evictions) && memcache->db) {
+				snapshot->read_options = leveldb_readoptions_create ();
+				leveldb_readoptions_set_fill_cache (snapshot->read_options, 0);
+				snapshot->iterator = leveldb_create_iterator (memcache->db, snapshot->read_options);
+				leveldb_iter_seek_to_first (snapshot->iterator);
+				memcache->streaming++;
+				continue;
+			}
+		}
+		//Envoie des elements du hashmap
+		kvmap_foreach (memcache->kvmap, s_send_single, &routing);
+		clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: sent end snapshots MEMCACHE");
+		snapshot->next++;
+	}
+	s_send_end (base, snapshot->socket, snapshot->identity, snapshot->sequence, snapshot->cachehash, snapshot->compact);
+	return TRUE;
+}
+
+static int
+	s_snapshot_timer (zloop_t *loop, zmq_pollitem_t *poller, void *args);
+
+//  Send the snapshots waiting, oldest first, till one has to wait for
+//  the timer to read more of its LevelDB
+static void
+	base_snapshots (base_t *base)
+{
+	snapshot_t *snapshot;
+	while ((snapshot = (snapshot_t *) zlist_first (base->snapshots)) != NULL) {
+		if (!s_snapshot_send (base, snapshot)) {
+			if (!base->snapshot_timer) {
+				clonesrv_t *clonesrv = (clonesrv_t *) base->clonesrv;
+				zloop_timer (bstar_zloop (clonesrv->bstar), SNAPSHOT_INTERVAL, 1, s_snapshot_timer, base);
+				base->snapshot_timer = TRUE;
+			}
+			return;
+		}
+		zlist_pop (base->snapshots);
+		snapshot_destroy (&snapshot);
+	}
+}
+
+static int
+	s_snapshot_timer (zloop_t *loop, zmq_pollitem_t *poller, void *args)
+{
+	base_t *base = (base_t *) args;
+	base->snapshot_timer = FALSE;
+	base_snapshots (base);
 	return 0;
 }
 
+//  Drop the snapshots waiting, when we go passive or shut down; their
+//  clients fail over
+static void
+	base_snapshots_cancel (base_t *base)
+{
+	while (zlist_size (base->snapshots)) {
+		snapshot_t *snapshot = (snapshot_t *) zlist_pop (base->snapshots);
+		snapshot_destroy (&snapshot);
+	}
+}
+
 static int
 	send_snapshot (zloop_t *loop, zmq_pollitem_t *poller, void *args)
 {
 	int cacheid;
-	kvmsg_t *kvmsg;
-	memcache_t *memcache = NULL;
 	base_t *base = (base_t *) args;
-	int64_t  sequence;
+	snapshot_t *snapshot;
+	uint cachehashes [CACHE_MAX];
+	uint nbr_cachehashes = 0;
 
 	zframe_t *identity = zframe_recv (poller->socket);
 	if (identity) {
 		//  Request is in second frame of message
-		char *cacheidstr;
-		char *subtree;
 		char *request = zstr_recv (poller->socket);
-		subtree="";
-		if (streq (request, "GETSNAPSHOT")) {
-			clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: send_snapshot receiving request GETSNAPSHOT base=%d", base->baseid );
+		if (request && streq (request, KVMSG_GETSINCE)) {
+			//  [GETSINCE][cacheid][sequence][epoch], see kvmsg.h
+			char *cacheidstr = zstr_recv (poller->socket);
+			char *since = zstr_recv (poller->socket);
+			char *epoch = zsockopt_rcvmore (poller->socket)? zstr_recv (poller->socket): NULL;
+			memcache_t *memcache = cacheidstr? base_getcache (base, cacheidstr): NULL;
+			snapshot = snapshot_new (poller->socket, identity, TRUE);
+			if (memcache) {
+				snapshot->memcaches [snapshot->nbr_memcaches++] = memcache;
+				snapshot->cachehash = memcache->cachehash;
+				snapshot->since = TRUE;
+				snapshot->since_sequence = -1;
+				if (since)
+					sscanf (since, "%I64d", &snapshot->since_sequence);
+				if (epoch)
+					sscanf (epoch, "%I64d", &snapshot->since_epoch);
+			}
+			else
+				clone_log(LOG_LEVEL_WARNING, LOG_TYPE_CLONE, "W: send_since base=%s unknown cache %s", base->baseidstr, cacheidstr? cacheidstr: "");
 			free (request);
+			free (cacheidstr);
+			free (since);
+			free (epoch);
 		}
-		else
-			clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "E: send_snapshot bad request, aborting\n");
-
-		for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++) {
-			memcache_t *memcache = base->memcaches[cacheid];
-
-			if (memcache->kvmap) {
-				kvmsg_t *kvmsg;
-				//  Send state socket to client
-				kvroute_t routing = { poller->socket, identity, subtree };
-				sequence = memcache->sequence;
-
-				//  Send snapshot enreg to client
-				clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: sending SNAPSHOT");
-				zframe_send (&identity, poller->socket, ZFRAME_MORE + ZFRAME_REUSE);
-				kvmsg = kvmsg_new (memcache->sequence);
-				kvmsg_set_key  (kvmsg, "BEGINMEMCACHE");
-				kvmsg_set_prop (kvmsg, "cacheidstr", "%s", memcache->cacheidstr);
-				kvmsg_set_body (kvmsg, (byte *) subtree, 0);
-				kvmsg_send     (kvmsg, poller->socket);
-				kvmsg_destroy (&kvmsg);
-				//zframe_send (&identity, poller->socket, ZFRAME_MORE + ZFRAME_REUSE);
-				//Envoie des elements du hashmap
-				zhash_foreach (memcache->kvmap, s_send_single, &routing);
-				//  Now send END message with sequence number
-				clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: sent end snapshots MEMCACHE");
-				sequence = memcache->sequence;
-			} else {
-				clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: send_snapshot receiving GETSNAPSHOT base=%s cacheid=%s NO KVMAP", base->baseidstr, cacheidstr, memcache->dbPath );
+		else {
+			//  Peers asking with KVMSG_GETSNAPSHOT_COMPACT read compact kvmsgs
+			Bool compact = FALSE;
+			if (request && (streq (request, "GETSNAPSHOT") || streq (request, KVMSG_GETSNAPSHOT_COMPACT))) {
+				compact = streq (request, KVMSG_GETSNAPSHOT_COMPACT);
+				clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: send_snapshot receiving request %s base=%d", request, base->baseid );
+				//  Clients that subscribed to some caches only name them
+				while (zsockopt_rcvmore (poller->socket)) {
+					char *name = zstr_recv (poller->socket);
+					if (name && nbr_cachehashes < CACHE_MAX)
+						cachehashes [nbr_cachehashes++] = kvmsg_hash_cacheid (name);
+					free (name);
+				}
 			}
+			else
+				clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "E: send_snapshot bad request, aborting\n");
+			free (request);
+
+			snapshot = snapshot_new (poller->socket, identity, compact);
+			for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++) {
+				memcache_t *memcache = base->memcaches[cacheid];
+				uint hash_nbr;
+				for (hash_nbr = 0; hash_nbr < nbr_cachehashes; hash_nbr++)
+					if (cachehashes [hash_nbr] == memcache->cachehash)
+						break;
+				if (nbr_cachehashes && hash_nbr == nbr_cachehashes)
+					continue;
+				snapshot->memcaches [snapshot->nbr_memcaches++] = memcache;
+			}
+			//  A request for one cache, as a client resyncing it sends, gets
+			//  an end that names it, so the client can tell it from a stale one
+			if (nbr_cachehashes == 1)
+				snapshot->cachehash = cachehashes [0];
 		}
-		clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: sending end snapshots ENDSNAPSHOT");
-		zframe_send (&identity, poller->socket, ZFRAME_MORE);
-		kvmsg = kvmsg_new (sequence);
-		kvmsg_set_key  (kvmsg, "ENDSNAPSHOT");
-		kvmsg_set_body (kvmsg, (byte *) subtree, 0);
-		kvmsg_send     (kvmsg, poller->socket);
-		kvmsg_destroy (&kvmsg);
-		zframe_destroy(&identity);
+		//  Snapshots before this one wait for the timer
+		zlist_append (base->snapshots, snapshot);
+		if (zlist_size (base->snapshots) == 1)
+			base_snapshots (base);
 	}
 	return 0;
 }
 //  .until
 
+//  .split publishing
+//  Updates and hugz go to every client and to our peer. They are only
+//  published compact when compactWire says all of them read it.
+//  With publishBatch set as well, consecutive updates are packed into
+//  one message of up to publishBatch bytes, so that the publisher pays
+//  its per-message cost once for many updates and many subscribers.
+//  A pack is sent when it is full, and whenever a reactor handler that
+//  published is done, so an update never waits for the next one to come:
+
+static int64_t
+	s_clock_usecs (void)
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER ticks;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency (&frequency);
+	QueryPerformanceCounter (&ticks);
+	return (ticks.QuadPart / frequency.QuadPart) * 1000000
+		+ (ticks.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+//  Return histogram bucket of value, by powers of two
+static uint
+	s_histogram_bucket (int64_t value)
+{
+	uint bucket = 0;
+	while (value > 1 && bucket < PACK_HISTOGRAM - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+//  With topicWire set, every message we publish comes behind a topic
+//  frame "<cacheid>/<key>", so the PUB socket only sends it to clients
+//  that subscribed to its cache. A pack then only holds updates of one
+//  cache, and its topic is "<cacheid>/":
+static void
+	s_send_topic (base_t *base, void *socket, uint cachehash, char *key)
+{
+	memcache_t *memcache;
+	if (!base->topics)
+		return;
+	memcache = base_findcache (base, cachehash);
+	kvmsg_send_topic (socket, memcache? memcache->cacheidstr: "", key);
+}
+
+//  .split subscriptions
+//  The publisher is an XPUB socket, which hands us every topic a client
+//  subscribes to, as a byte 1 then the topic, and every topic no client
+//  subscribes to anymore, as a byte 0 then the topic. We count for each
+//  cache the topics that get its updates, and don't encode or send the
+//  updates of caches no client gets. Our peer gets every update anyway
+//  from the replicator, so that it persists them and can take over.
+//  Without topicWire, a client's topics are key prefixes of any cache,
+//  so each topic counts for all caches:
+
+//  Return TRUE if clients subscribed to topic get updates of memcache
+static Bool
+	s_topic_gets (base_t *base, char *topic, memcache_t *memcache)
+{
+	size_t size;
+	char prefix [MAXLEN + 18];
+	if (!base->topics)
+		return TRUE;
+	sprintf (prefix, "%s/", memcache->cacheidstr);
+	size = strlen (topic);
+	if (size > strlen (prefix))
+		size = strlen (prefix);
+	return memcmp (topic, prefix, size) == 0;
+}
+
+static int
+	s_subscription (zloop_t *loop, zmq_pollitem_t *poller, void *args)
+{
+	uint cacheid;
+	char *topic;
+	base_t *base = (base_t *) args;
+	zframe_t *frame = zframe_recv (base->publisher);
+	if (!frame)
+		return 0;
+	if (zframe_size (frame) == 0) {
+		zframe_destroy (&frame);
+		return 0;
+	}
+	topic = (char *) malloc (zframe_size (frame));
+	memcpy (topic, zframe_data (frame) + 1, zframe_size (frame) - 1);
+	topic [zframe_size (frame) - 1] = 0;
+	for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++) {
+		memcache_t *memcache = base->memcaches [cacheid];
+		if (s_topic_gets (base, topic, memcache))
+			memcache->subscribers += zframe_data (frame) [0]? 1: -1;
+	}
+	clone_log(LOG_LEVEL_INFO, LOG_TYPE_NETWORK, "I: s_subscription base=%s %s topic=%s",
+		base->baseidstr, zframe_data (frame) [0]? "subscribe": "unsubscribe", topic);
+	free (topic);
+	zframe_destroy (&frame);
+	return 0;
+}
+
+static void
+	s_publish_flush (base_t *base)
+{
+	if (!base->pack_count)
+		return;
+	if (base->pack_subscribed) {
+		s_send_topic (base, base->publisher, base->pack_cachehash, NULL);
+		zmq_send (base->publisher, base->pack, base->pack_size, 0);
+	}
+	s_send_topic (base, base->replicator, base->pack_cachehash, NULL);
+	zmq_send (base->replicator, base->pack, base->pack_size, 0);
+	base->pack_updates [s_histogram_bucket (base->pack_count)]++;
+	base->pack_usecs [s_histogram_bucket (s_clock_usecs () - base->pack_started)]++;
+	base->pack_size = 0;
+	base->pack_count = 0;
+	base->pack_subscribed = FALSE;
+}
+
+//  .split conflation
+//  With conflateInterval set, we also publish on port+3, for clients
+//  that can't keep up with every update, such as those on slow links.
+//  Every conflateInterval msecs they get the latest update of each key
+//  that changed, hugz included, and nothing of the updates in between;
+//  so what they cost us is bounded by the keys, not by the update rate.
+//  Updates go out in sequence order, so clients apply them all:
+
+static void
+	s_conflated_free (void *ptr)
+{
+	kvmsg_t *kvmsg = (kvmsg_t *) ptr;
+	kvmsg_destroy (&kvmsg);
+}
+
+static void
+	s_conflate (base_t *base, kvmsg_t *kvmsg)
+{
+	char key [MAXLEN + 10];
+	sprintf (key, "%08X/%s", kvmsg_cachehash (kvmsg), kvmsg_key (kvmsg));
+	if (zhash_lookup (base->conflated, key))
+		base->conflations++;
+	zhash_update (base->conflated, key, kvmsg_dup (kvmsg));
+	zhash_freefn (base->conflated, key, s_conflated_free);
+}
+
+static int
+	s_collect_conflated (const char *key, void *item, void *argument)
+{
+	kvmsg_t ***cursor = (kvmsg_t ***) argument;
+	*(*cursor)++ = (kvmsg_t *) item;
+	return 0;
+}
+
+static int
+	s_compare_sequence (const void *left, const void *right)
+{
+	int64_t left_sequence = kvmsg_sequence (*(kvmsg_t **) left);
+	int64_t right_sequence = kvmsg_sequence (*(kvmsg_t **) right);
+	return left_sequence < right_sequence? -1: left_sequence > right_sequence;
+}
+
+static int
+	s_flush_conflated (zloop_t *loop, zmq_pollitem_t *poller, void *args)
+{
+	size_t index;
+	size_t count;
+	kvmsg_t **kvmsgs;
+	kvmsg_t **cursor;
+	base_t *base = (base_t *) args;
+
+	count = zhash_size (base->conflated);
+	if (count == 0)
+		return 0;
+	kvmsgs = (kvmsg_t **) malloc (count * sizeof (kvmsg_t *));
+	cursor = kvmsgs;
+	zhash_foreach (base->conflated, s_collect_conflated, &cursor);
+	qsort (kvmsgs, count, sizeof (kvmsg_t *), s_compare_sequence);
+	for (index = 0; index < count; index++) {
+		s_send_topic (base, base->conflater, kvmsg_cachehash (kvmsgs [index]), kvmsg_key (kvmsgs [index]));
+		s_send_encoded (base, kvmsgs [index], base->conflater, base->compact);
+	}
+	free (kvmsgs);
+	//  Destroys the updates we sent
+	zhash_destroy (&base->conflated);
+	base->conflated = zhash_new ();
+	return 0;
+}
+
+static void
+	s_publish (base_t *base, kvmsg_t *kvmsg)
+{
+	size_t size = base->pack_max? kvmsg_pack_size (kvmsg): 0;
+	memcache_t *memcache = base_findcache (base, kvmsg_cachehash (kvmsg));
+	Bool subscribed = !memcache || memcache->subscribers > 0;
+	if (!subscribed)
+		memcache->unpublished++;
+	if (base->conflater)
+		s_conflate (base, kvmsg);
+	if (size == 0 || size > base->pack_max) {
+		//  Not packing, or too big for a pack; in order either way
+		s_publish_flush (base);
+		if (subscribed) {
+			s_send_topic (base, base->publisher, kvmsg_cachehash (kvmsg), kvmsg_key (kvmsg));
+			s_send_encoded (base, kvmsg, base->publisher, base->compact);
+		}
+		s_send_topic (base, base->replicator, kvmsg_cachehash (kvmsg), kvmsg_key (kvmsg));
+		s_send_encoded (base, kvmsg, base->replicator, base->compact);
+		return;
+	}
+	if (base->pack_size + size > base->pack_max
+	|| (base->topics && base->pack_count && base->pack_cachehash != kvmsg_cachehash (kvmsg)))
+		s_publish_flush (base);
+	if (!base->pack_count) {
+		base->pack_started = s_clock_usecs ();
+		base->pack_cachehash = kvmsg_cachehash (kvmsg);
+	}
+	if (subscribed)
+		base->pack_subscribed = TRUE;
+	base->pack_size = kvmsg_pack (kvmsg, base->pack, base->pack_size);
+	base->pack_count++;
+}
+
 //  .split collect updates
 //  The collector is more complex than in the clonesrv5 example since how
 //  process updates depends on whether we're active or passive. The active
@@ -386,122 +1714,160 @@ static int
 static int
 	s_was_pending (memcache_t *memcache, kvmsg_t *kvmsg)
 {
-	int64_t ttld;
-	kvmsg_t *held;
-	sscanf (kvmsg_get_prop (kvmsg, "ttld"), "%I64d", &ttld);
-	//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "UC s_was_pending deleted by ttl don't set in pending list");
-	if (ttld)
+	byte *uuid;
+	//  Deletes made by TTL expiry never were pending
+	if (kvmsg_flags (kvmsg) & KVMSG_FLAG_EXPIRED)
 		return TRUE;
-	held = (kvmsg_t *) zlist_first (memcache->pending);
-	while (held) {
-		if (memcmp (kvmsg_uuid (held), kvmsg_uuid (kvmsg), 16) == 0){
-			zlist_remove (memcache->pending, held);
-			return TRUE;
-		}
-		held = (kvmsg_t *) zlist_next (memcache->pending);
+	uuid = kvmsg_uuid (kvmsg);
+	return uuid && pending_remove (memcache->pending, uuid);
+}
+
+//  Clients send a time to live, which the active turns into an absolute
+//  expiry, so that the passive and LevelDB all see the same one:
+static void
+	s_stamp_expiry (kvmsg_t *kvmsg)
+{
+	if (kvmsg_flags (kvmsg) & KVMSG_FLAG_TTL)
+		kvmsg_set_expiry (kvmsg, zclock_time () + kvmsg_expiry (kvmsg));
+}
+
+//  Apply one update from a client. The active publishes it and adds it to
+//  the group commit of its memcache, the passive holds it as pending:
+static void
+	s_collect_single (base_t *base, kvmsg_t *kvmsg)
+{
+	clonesrv_t *clonesrv = (clonesrv_t *)base->clonesrv;
+	memcache_t *memcache = base_findcache (base, kvmsg_cachehash (kvmsg));
+	if (!memcache) {
+		clone_log(LOG_LEVEL_WARNING, LOG_TYPE_CLONE, "W: s_collector base=%s unknown cache %08X, update dropped", base->baseidstr, kvmsg_cachehash (kvmsg));
+		kvmsg_destroy (&kvmsg);
+		return;
+	}
+	if (clonesrv->active) {
+		kvmsg_set_sequence (kvmsg, ++memcache->sequence);
+		s_stamp_expiry (kvmsg);
+		s_publish (base, kvmsg);
+		memcache_persist (memcache, kvmsg);
+		memcache_remember (memcache, kvmsg);
+		memcache_store (memcache, &kvmsg);
+	}
+	else {
+		//Passive If we already got message from active, drop it, else hold on pending list
+		if (s_was_pending (memcache, kvmsg))
+			kvmsg_destroy (&kvmsg);
+		else
+			pending_add (memcache->pending, &kvmsg);
 	}
-	return FALSE;
 }
 
+//  A batch from clone_mset is split into its updates, which are then
+//  applied one by one, so they take consecutive sequence numbers and
+//  are published to subscribers as single updates. Returns the number
+//  of updates:
+static uint
+	s_collect_batch (base_t *base, kvmsg_t *kvmsg)
+{
+	uint count = 0;
+	kvmsg_t *update;
+	while ((update = kvmsg_batch_next (kvmsg)) != NULL) {
+		s_collect_single (base, update);
+		count++;
+	}
+	kvmsg_destroy (&kvmsg);
+	return count;
+}
+
+//  The collector drains every update already queued on its socket in
+//  one wakeup, up to batch_max, waiting at most batch_delay msecs for a
+//  batch to fill. A client batch is always applied whole. Each memcache
+//  then persists its share of the batch with a single LevelDB write:
 static int
 	s_collector (zloop_t *loop, zmq_pollitem_t *poller, void *args)
 {
-	char* errptr ;
-	memcache_t *memcache = NULL;
-	leveldb_writeoptions_t *write_options;
+	uint cacheid;
+	uint batched = 0;
+	uint received = 0;
 	base_t *base = (base_t *) args;
 	clonesrv_t *clonesrv = (clonesrv_t *)base->clonesrv;
-	kvmsg_t *kvmsg = kvmsg_recv (poller->socket);
-	if (kvmsg) {
-		char *cacheidstr = kvmsg_get_prop (kvmsg, "cacheidstr");
-		if (strneq (cacheidstr, "")) {
-			memcache = base_getcache (base, cacheidstr);
-		}
-		if (clonesrv->active) {
-			int64_t ttl;
-			char *key;
-			char *body;
-			int size;
-			char SNumber[14];
-
-			kvmsg_set_sequence (kvmsg, ++memcache->sequence);
-			sscanf (kvmsg_get_prop (kvmsg, "ttl"), "%I64d", &ttl);
-			if (ttl)
-			{
-				kvmsg_set_prop (kvmsg, "ttl", "%I64d", zclock_time () + ttl * 1000);
-			}
-			kvmsg_send (kvmsg, base->publisher);
-
-			key= kvmsg_key(kvmsg) ;
-			size = kvmsg_size(kvmsg) ;
-			if (size) {
-				body= (char*) kvmsg_body(kvmsg) ;
-			}
-			else {
-				body = "";
-			}
-
-			kvmsg_store (&kvmsg, memcache->kvmap);
-
-			//////db Persistence
-			write_options = leveldb_writeoptions_create() ;
-			leveldb_put( memcache->db, write_options, key, strlen(key)+1 , body, strlen(body)+1, &errptr) ;
-			sprintf_s(SNumber, 14,"%I64d", (int64_t) memcache->sequence) ;
-			leveldb_put( memcache->db, write_options, "SEQUENCENUMBER", 15, SNumber, strlen(SNumber)+1, &errptr) ;
-			//////db Persistence
+	int64_t deadline = zclock_time () + base->batch_delay;
+
+	while (batched < base->batch_max) {
+		kvmsg_t *kvmsg;
+		if (received) {
+			zmq_pollitem_t items [] = { { poller->socket, 0, ZMQ_POLLIN, 0 } };
+			int64_t timeout = deadline - zclock_time ();
+			if (zmq_poll (items, 1, (long) (timeout > 0? timeout: 0) * ZMQ_POLL_MSEC) <= 0)
+				break;
 		}
+		kvmsg = kvmsg_recv (poller->socket);
+		if (!kvmsg)
+			break;
+		received++;
+		if (kvmsg_flags (kvmsg) & KVMSG_FLAG_BATCH)
+			batched += s_collect_batch (base, kvmsg);
 		else {
-			//Passive If we already got message from active, drop it, else hold on pending list
-			if (s_was_pending (memcache, kvmsg))
-				kvmsg_destroy (&kvmsg);
-			else
-				zlist_append (memcache->pending, kvmsg);
+			s_collect_single (base, kvmsg);
+			batched++;
 		}
 	}
+	s_publish_flush (base);
+	if (clonesrv->active)
+		for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++)
+			memcache_commit (base->memcaches [cacheid]);
 	return 0;
 }
 
-//  We purge ephemeral values using exactly the same code as in
-//  the previous clonesrv5 example.
-//  .skip
+//  .split ttl expiry
+//  Keys with a TTL wait on the timing wheel of their memcache, so each
+//  tick only looks at the keys that are due, never at the whole kvmap.
+//  Updating a key leaves its old expiry on the wheel; when that fires,
+//  the kvmap has a different expiry, or no key, and we skip it.
 //  If key-value pair has expired, delete it and publish the
 //  fact to listening clients.
-static int
-	s_flush_single (const char *key, void *data, void *args)
+static void
+	s_flush_single (char *key, int64_t expiry, void *args)
 {
-	int64_t ttl;
+	kvmsg_t *kvmsg;
 	memcache_t *memcache = (memcache_t *) args;
 	base_t *base = (base_t *) memcache->base;
-	kvmsg_t *kvmsg = (kvmsg_t *) data;
-	sscanf (kvmsg_get_prop (kvmsg, "ttl"), "%I64d", &ttl);
-	//clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "I: DUMP s_flush_single publishing ttlStr=%s", ttlStr);
-	if (ttl && (zclock_time () >= ttl) ) {
-		kvmsg_set_sequence (kvmsg, ++memcache->sequence);
-		//Pour ne pas mettre en pendinglist
-		kvmsg_set_prop (kvmsg, "ttld", "%d", 1);
-		kvmsg_del_body (kvmsg);
-		kvmsg_send     (kvmsg, base->publisher);
-		kvmsg_store (&kvmsg, memcache->kvmap);
-	}
-	return 0;
+	kventry_t *entry = kvmap_lookup (memcache->kvmap, key);
+	if (!entry || kventry_expiry (entry) != expiry)
+		return;
+	kvmsg = kvmsg_new (++memcache->sequence);
+	kvmsg_set_key  (kvmsg, key);
+	kvmsg_set_cachehash (kvmsg, memcache->cachehash);
+	kvmsg_set_body (kvmsg, (byte *) "", 0);
+	//  So that the passive does not look for it in its pending list
+	kvmsg_set_flags (kvmsg, kvmsg_flags (kvmsg) | KVMSG_FLAG_EXPIRED);
+	s_publish (base, kvmsg);
+	memcache_persist (memcache, kvmsg);
+	memcache_remember (memcache, kvmsg);
+	memcache_store (memcache, &kvmsg);
 }
 
+//  Every TTL_TICK the active expires what is due, at most TTL_BATCH keys
+//  a cache, and commits the deletes of each cache as one batch. The
+//  passive gets those deletes from the active:
 static int
 	s_flush_ttl (zloop_t *loop, zmq_pollitem_t *poller, void *args)
 {
 	uint cacheid;
+	int64_t now = zclock_time ();
 	base_t *base = (base_t *) args;
+	clonesrv_t *clonesrv = (clonesrv_t *) base->clonesrv;
+	if (!clonesrv->active)
+		return 0;
 	for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++)
 	{
 		memcache_t *memcache = base->memcaches [cacheid];
-		if (memcache->kvmap)
-			zhash_foreach (memcache->kvmap, s_flush_single, memcache);
+		if (memcache->kvmap
+		&&  ttlwheel_expire (memcache->ttls, now, TTL_BATCH, s_flush_single, memcache))
+			memcache_commit (memcache);
 	}
+	s_publish_flush (base);
 	return 0;
 }
 
-//  .until
-
 //  .split heartbeating
 //  We send a HUGZ message once a second to all subscribers so that they
 //  can detect if our server dies. They'll then switch over to the backup
@@ -516,14 +1882,62 @@ static int
 
 	kvmsg = kvmsg_new (memcache->sequence);
 	kvmsg_set_key  (kvmsg, "HUGZ");
-	kvmsg_set_prop (kvmsg, "cacheidstr", memcache->cacheidstr);
+	kvmsg_set_cachehash (kvmsg, memcache->cachehash);
 	kvmsg_set_body (kvmsg, (byte *) "", 0);
-	kvmsg_send     (kvmsg, base->publisher);
+	s_publish (base, kvmsg);
+	s_publish_flush (base);
 	kvmsg_destroy (&kvmsg);
 
 	return 0;
 }
 
+//  .split operator statistics
+//  Every statsInterval msecs we log how far LevelDB is behind each of
+//  our memcaches, and how many batches wait in the persister ring.
+//  When we pack updates, we also log how many updates went in each pack
+//  and how long its first update waited, as counts by powers of two:
+
+static char *
+	s_format_histogram (char *dest, int64_t *histogram)
+{
+	int bucket;
+	char *cursor = dest;
+	for (bucket = 0; bucket < PACK_HISTOGRAM; bucket++)
+		cursor += sprintf (cursor, bucket? ",%I64d": "%I64d", histogram [bucket]);
+	return dest;
+}
+
+static int
+	s_log_stats (zloop_t *loop, zmq_pollitem_t *poller, void *args)
+{
+	uint cacheid;
+	base_t *base = (base_t *) args;
+
+	clone_log(LOG_LEVEL_INFO, LOG_TYPE_PERSIST, "I: stats base=%s persist_ring_depth=%u persist_stalls=%I64d",
+		base->baseidstr, persister_depth (base->persister), persister_stalls (base->persister));
+	if (base->conflater)
+		clone_log(LOG_LEVEL_INFO, LOG_TYPE_NETWORK, "I: stats base=%s conflated_keys=%Iu conflations=%I64d",
+			base->baseidstr, zhash_size (base->conflated), base->conflations);
+	if (base->pack_max) {
+		char updates [PACK_HISTOGRAM * 24];
+		char usecs [PACK_HISTOGRAM * 24];
+		clone_log(LOG_LEVEL_INFO, LOG_TYPE_NETWORK, "I: stats base=%s pack_updates_log2=%s pack_usecs_log2=%s",
+			base->baseidstr, s_format_histogram (updates, base->pack_updates), s_format_histogram (usecs, base->pack_usecs));
+	}
+	for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++) {
+		memcache_t *memcache = base->memcaches [cacheid];
+		clone_log(LOG_LEVEL_INFO, LOG_TYPE_PERSIST, "I: stats base=%s cache=%s durability=%d sequence=%I64d persist_lag=%I64d keys=%Iu memory=%Iu memory_limit=%Iu evictions=%I64d pending=%Iu pending_dropped=%I64d subscribers=%d unpublished=%I64d ring=%u ring_bytes=%Iu catchups=%I64d catchup_snapshots=%I64d",
+			base->baseidstr, memcache->cacheidstr, memcache->durability, memcache->sequence,
+			memcache->db? memcache->sequence - memcache->persisted: 0,
+			memcache->kvmap? kvmap_size (memcache->kvmap): 0, memcache_memory (memcache), memcache->memory_limit,
+			memcache->evictions,
+			pending_size (memcache->pending), pending_dropped (memcache->pending),
+			memcache->subscribers, memcache->unpublished,
+			memcache->ring_count, memcache->ring_bytes, memcache->catchups, memcache->catchup_snapshots);
+	}
+	return 0;
+}
+
 //  .split handling state changes
 //  When we switch from passive to active, we apply our pending list so that
 //  our kvmap is up-to-date. When we switch to passive, we wipe our kvmap
@@ -532,14 +1946,8 @@ static int
 static int
 	s_new_active (zloop_t *loop, zmq_pollitem_t *unused, void *args)
 {
-	//////db Persistence
-	char* SN;
-	char* errptr ;
-	size_t vallenth ;
-	leveldb_readoptions_t *read_options ;
 	int baseid;
 	int cacheid;
-	//////db Persistence
 
 	zmq_pollitem_t poller;// = { 0, 0, 0 };
 	clonesrv_t *clonesrv = (clonesrv_t *) args;
@@ -557,69 +1965,27 @@ static int
 		zloop_poller_end (bstar_zloop (clonesrv->bstar), &poller);
 
 		//seulement au premier dmarage en tant que active
+		base_recover (base, loop);
+		//  Our sequences from now on are not those of the last active
+		base->epoch = zclock_time ();
 
 		for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++)
 		{
 			memcache_t *memcache = base->memcaches [cacheid];
-			if(memcache->sequence==0){
-				read_options = leveldb_readoptions_create() ;
-				vallenth=0 ;
-				//Sequence Number from database
-				SN=leveldb_get( memcache->db, read_options, "SEQUENCENUMBER", 15, &vallenth, &errptr) ;
-
-				//Hashmap Recovery
-				if(SN){
-					leveldb_iterator_t *iterator ;
-					leveldb_writeoptions_t *write_options;
-					// continue from this sequence number
-
-					sscanf (SN, "%I64d", &memcache->sequence);
-					//Fill Hashmap
-					iterator=leveldb_create_iterator( memcache->db, read_options);
-					for (leveldb_iter_seek_to_first(iterator); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
-						kvmsg_t *kvmsg ;
-						size_t sizeKey, sizevalue;
-						char *key;
-						char *value;
-						key = (char *)leveldb_iter_key( iterator, &sizeKey);
-						value = (char *)leveldb_iter_value( iterator, &sizevalue);	
-						if(strneq (key, "SEQUENCENUMBER")){
-							kvmsg = kvmsg_new (0);
-							kvmsg_set_key  (kvmsg, key);
-							kvmsg_set_uuid (kvmsg);
-							kvmsg_fmt_body (kvmsg, "%s", value);
-							kvmsg_store (&kvmsg, memcache->kvmap);
-						}
-					}
-				}
-			}
-
-			//  Apply pending list to own hash table
-			while (zlist_size (memcache->pending)) {
-				char *key;
-				char *body;
-				int size;
-				char SNumber[14];
-				leveldb_writeoptions_t *write_options;
-				kvmsg_t *kvmsg = (kvmsg_t *) zlist_pop (memcache->pending);
+			kvmsg_t *kvmsg;
+			memcache->takeover = memcache->sequence;
+			//  Apply pending list to own hash table, as one group commit
+			while ((kvmsg = pending_pop (memcache->pending)) != NULL) {
 				kvmsg_set_sequence (kvmsg, ++memcache->sequence);
-				kvmsg_send (kvmsg, base->publisher);
-				key= kvmsg_key(kvmsg) ;
-				size = kvmsg_size(kvmsg) ;
-				if (size) {
-					body= (char*) kvmsg_body(kvmsg) ;
-				}
-				else {
-					body = "";
-				}
-				kvmsg_store (&kvmsg, memcache->kvmap);
-				write_options = leveldb_writeoptions_create() ;
-				leveldb_put( memcache->db, write_options, key, strlen(key)+1 , body, strlen(body)+1, &errptr);
-				sprintf_s(SNumber , 14,"%I64d", (int64_t) memcache->sequence) ;
-				leveldb_put( memcache->db, write_options, "SEQUENCENUMBER", 15, SNumber, strlen(SNumber)+1, &errptr);
+				s_stamp_expiry (kvmsg);
+				s_publish (base, kvmsg);
+				memcache_persist (memcache, kvmsg);
+				memcache_remember (memcache, kvmsg);
+				memcache_store (memcache, &kvmsg);
 			}
+			memcache_commit (memcache);
 		}
-		zloop_timer (bstar_zloop (clonesrv->bstar), 1000, 0, s_flush_ttl, base);
+		s_publish_flush (base);
 	}
 	return 0;
 }
@@ -638,13 +2004,16 @@ static int
 	clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "ClusterName %s (%s) s_new_passive", clonesrv->ClusterName, clonesrv->ServerType);
 	for (baseid = 0; baseid < clonesrv->nbr_bases; baseid++) {
 		base_t *base = clonesrv->bases[baseid];
-		// ?? zloop_timer_end (bstar_zloop (clonesrv->bstar), clonesrv);
+		s_recovery_wait (base, loop, TRUE);
+		base_snapshots_cancel (base);
+		persister_flush (base->persister);
 		for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++)
 		{
 			memcache_t *memcache = base->memcaches [cacheid];
-			zhash_destroy (&memcache->kvmap);
+			memcache_clear (memcache);
 			//// destroy database
-			leveldb_destroy_db( memcache->dbOptions, memcache->dbPath, &errptr);
+			if (memcache->db)
+				leveldb_destroy_db( memcache->dbOptions, memcache->dbPath, &errptr);
 		}
 
 		//  Start subscribing to updates
@@ -660,106 +2029,109 @@ static int
 //  When we get an update, we create a new kvmap if necessary, and then
 //  add our update to our kvmap. We're always passive in this case:
 
+//  Apply one update from the active; its memcache commits it later
+static void
+	s_subscribe_single (base_t *base, kvmsg_t *kvmsg)
+{
+	int cacheid;
+	if (streq (kvmsg_key (kvmsg), "HUGZ")) {
+		kvmsg_destroy (&kvmsg);
+		return;
+	}
+	cacheid = base_findcacheid (base, kvmsg_cachehash (kvmsg));
+	if (cacheid < 0) {
+		clone_log(LOG_LEVEL_WARNING, LOG_TYPE_CLONE, "W: s_subscriber %s unknown cache %08X, update dropped", base->baseidstr, kvmsg_cachehash (kvmsg));
+		kvmsg_destroy (&kvmsg);
+		return;
+	}
+	if (!s_was_pending (base->memcaches [cacheid], kvmsg)) {
+		//  If active update came before client update, flip it
+		//  around, store active update (with sequence) on pending
+		//  list and use to clear client update when it comes later
+		kvmsg_t *held = kvmsg_dup (kvmsg);
+		pending_add (base->memcaches [cacheid]->pending, &held);
+	}
+	//  If update is more recent than our kvmap, apply it
+	if (kvmsg_sequence (kvmsg) > base->memcaches [cacheid]->sequence) {
+		base->memcaches [cacheid]->sequence = kvmsg_sequence (kvmsg);
+		memcache_persist (base->memcaches [cacheid], kvmsg);
+		memcache_remember (base->memcaches [cacheid], kvmsg);
+		memcache_store (base->memcaches [cacheid], &kvmsg);
+	}
+	else {
+		clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber %s :received update out of sequence destroy it", base->baseidstr)  ;
+		kvmsg_destroy (&kvmsg);
+	}
+}
+
 static int
 	s_subscriber (zloop_t *loop, zmq_pollitem_t *poller, void *args)
 {
 	int cacheid;
-	char* errptr;
-	char *key;
-	char *value;
-	int size;
 	void *snapshot;
-	char SNumber[14];
 	base_t *base = (base_t *) args;
 	clonesrv_t *clonesrv = (clonesrv_t *) base->clonesrv;
 	kvmsg_t *kvmsg;
-	leveldb_writeoptions_t *write_options;
-	leveldb_readoptions_t *read_options;
-	write_options = leveldb_writeoptions_create();
 
-	//  Get state snapshot if necessary
+	//  Get state snapshot if necessary. Its records are committed every
+	//  batch_max, but a cache only takes the sequence of the snapshot
+	//  once all of its records are in: until then, a commit must not
+	//  tell eviction that the records still to come are written
 	if (base->memcaches [0]->kvmap == NULL) {
+		int64_t sequence = 0;
+		Bool loading = FALSE;
 		snapshot = zsocket_new (base->ctx, ZMQ_DEALER);
 		zsocket_connect (snapshot, "tcp://localhost:%d", base->peer);
 		clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber %s : asking for snapshot tcp://localhost:%d", base->baseidstr, base->peer);
-		zstr_send (snapshot, "GETSNAPSHOT");
+		zstr_send (snapshot, KVMSG_GETSNAPSHOT_COMPACT);
 		while (TRUE) {
 			kvmsg_t *kvmsg = kvmsg_recv (snapshot);
 			if (!kvmsg)
 				break;          //  Interrupted
 			if (streq (kvmsg_key (kvmsg), "BEGINMEMCACHE")) {
-				char *cacheidstr = kvmsg_get_prop (kvmsg, "cacheidstr");
-				cacheid = base_getcacheid (base, cacheidstr);
+				if (loading)
+					base->memcaches [cacheid]->sequence = sequence;
+				cacheid = base_findcacheid (base, kvmsg_cachehash (kvmsg));
 				if (base->memcaches [cacheid]->kvmap == NULL) {
-					base->memcaches [cacheid]->kvmap = zhash_new ();
+					base->memcaches [cacheid]->kvmap = kvmap_new (0);
 				}
+				sequence = kvmsg_sequence (kvmsg);
+				loading = TRUE;
 				clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber %s : Received BEGINMEMCACHE from: tcp://localhost:%d cacheid %s", base->baseidstr, base->peer, base->memcaches [cacheid]->cacheidstr);
 				kvmsg_destroy (&kvmsg);
 			}  else if (streq (kvmsg_key (kvmsg), "ENDSNAPSHOT")) {
 				base->memcaches [cacheid]->sequence = kvmsg_sequence (kvmsg);
 				clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber %s : Received ENDSNAPSHOT from: tcp://localhost:%d cacheid %s", base->baseidstr, base->peer, base->memcaches [cacheid]->cacheidstr);
-				//////db Persistence db Persistence db Persistence
-				sprintf_s(SNumber , 14,"%I64d", (int64_t)base->memcaches [cacheid]->sequence) ;
-				leveldb_put( base->memcaches [cacheid]->db, write_options, "SEQUENCENUMBER", 15, SNumber, strlen(SNumber)+1, &errptr) ;
-				//////db Persistence db Persistence db Persistence
+				for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++)
+					memcache_commit (base->memcaches [cacheid]);
 				kvmsg_destroy (&kvmsg);
 				clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber : Received ENDSNAPSHOT");
 				break;          //  Done
 			} else {
-				key= kvmsg_key(kvmsg) ;
-				size = kvmsg_size(kvmsg) ;
-				if (size) {
-					value= (char*) kvmsg_body(kvmsg) ;
-				}
-				else {
-					value = "";
-				}
 				clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber %s : Received DATA from: tcp://localhost:%d cacheid %s", base->baseidstr, base->peer, base->memcaches [cacheid]->cacheidstr);
-				leveldb_put( base->memcaches [cacheid]->db, write_options, key, strlen(key)+1 , value, strlen(value)+1, &errptr) ;
-				kvmsg_store (&kvmsg, base->memcaches [cacheid]->kvmap);
+				memcache_persist (base->memcaches [cacheid], kvmsg);
+				memcache_store (base->memcaches [cacheid], &kvmsg);
+				if (base->memcaches [cacheid]->batched >= base->batch_max)
+					memcache_commit (base->memcaches [cacheid]);
 			}
 		}
 		zsocket_destroy (base->ctx, snapshot);
 	}
 	//  Find and remove update off pending list
-	kvmsg = kvmsg_recv (poller->socket);
+	kvmsg = base->topics? kvmsg_recv_topic (poller->socket): kvmsg_recv (poller->socket);
 	if (!kvmsg)
 		return 0;
 
-	if (streq (kvmsg_key (kvmsg), "HUGZ")) {
+	//  A pack holds many updates, applied in order, then committed once
+	if (kvmsg_flags (kvmsg) & KVMSG_FLAG_BATCH) {
+		kvmsg_t *update;
+		while ((update = kvmsg_batch_next (kvmsg)) != NULL)
+			s_subscribe_single (base, update);
 		kvmsg_destroy (&kvmsg);
-	} else {
-		char *cacheidstr = kvmsg_get_prop (kvmsg, "cacheidstr");
-		cacheid = base_getcacheid (base, cacheidstr);
-		if (!s_was_pending (base->memcaches [cacheid], kvmsg)) {
-			//  If active update came before client update, flip it
-			//  around, store active update (with sequence) on pending
-			//  list and use to clear client update when it comes later
-			zlist_append (base->memcaches [cacheid]->pending, kvmsg_dup (kvmsg));
-		}
-		//  If update is more recent than our kvmap, apply it
-		if (kvmsg_sequence (kvmsg) > base->memcaches [cacheid]->sequence) {
-			base->memcaches [cacheid]->sequence = kvmsg_sequence (kvmsg);
-			key= kvmsg_key(kvmsg) ;
-			size = kvmsg_size(kvmsg) ;
-			if (size) {
-				value= (char*) kvmsg_body(kvmsg) ;
-			}
-			else {
-				value = "";
-			}
-			//////db Persistence
-			leveldb_put( base->memcaches [cacheid]->db, write_options, key, strlen(key)+1 , value, strlen(value)+1, &errptr) ;
-			sprintf_s(SNumber, 14 ,"%I64d", (int64_t) base->memcaches [cacheid]->sequence) ;
-			leveldb_put( base->memcaches [cacheid]->db, write_options, "SEQUENCENUMBER", 15, SNumber, strlen(SNumber)+1, &errptr) ;
-			//////db Persistence
-
-			kvmsg_store (&kvmsg, base->memcaches [cacheid]->kvmap);
-		}
-		else {
-			clone_log(LOG_LEVEL_INFO, LOG_TYPE_CLONE, "s_subscriber %s :received update out of sequence destroy it", base->baseidstr)  ;
-			kvmsg_destroy (&kvmsg);
-		}
 	}
+	else
+		s_subscribe_single (base, kvmsg);
+	for (cacheid = 0; cacheid < base->nbr_memcaches; cacheid++)
+		memcache_commit (base->memcaches [cacheid]);
 	return 0;
 }
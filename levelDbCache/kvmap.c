@@ -0,0 +1,1064 @@
+/*  =====================================================================
+*  kvmap - compact key-value map class
+
+-------------------------------------------------------------------------
+Copyright (c) 1991-2013 Andre Charles Legendre <andre.legendre@kalimasystems.org>
+Copyright other contributors as noted in the AUTHORS file.
+
+This file is part of LevelDbCache, the shared in memory cache for levelDb Key Value store.
+
+This is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or (at
+your option) any later version.
+
+This software is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this program. If not, see
+<http://www.gnu.org/licenses/>.
+*  ===================================================================== */
+
+#include "stdafx.h"
+#include "kvmap.h"
+
+//  Entries are carved out of slab pages. Entry sizes are rounded up to
+//  KVMAP_GRAIN, and each rounded size is a slab class with its own free
+//  list. Entries larger than the biggest class are allocated on their own.
+#define KVMAP_PAGE_SIZE     65536
+#define KVMAP_GRAIN         16
+#define KVMAP_CLASSES       128     //  Up to 2048 bytes
+#define KVMAP_MIN_SLOTS     16
+
+//  An entry is its header followed by the key and the value, each
+//  null-terminated, in one block:
+struct _kventry_t {
+	int64_t sequence;
+	int64_t expiry;             //  Absolute msecs, 0 if none
+	uint size;                  //  Value size, without null byte
+	unsigned short key_size;    //  Key size, without null byte
+	byte slab;                  //  Slab class, 0 if allocated on its own
+	byte flags;
+	char data [8];
+};
+
+#define KVENTRY_HEADER      offsetof (kventry_t, data)
+
+//  The index is an open addressing table in the Swiss table style. Each
+//  slot has a control byte, kept apart from the entry pointers: the top
+//  bit is set when the slot is empty or deleted, else the low 7 bits
+//  hold 7 bits of the key hash. Slots are probed a group of 16 at a time,
+//  comparing 16 control bytes in one SSE2 instruction, so most lookups
+//  read one cache line of control bytes and touch only the entry they
+//  want.
+#define KVMAP_GROUP         16
+#define KVCTRL_EMPTY        0x80
+#define KVCTRL_DELETED      0xFE
+#define KVCTRL_FULL(c)      (((c) & 0x80) == 0)
+#define KVMAP_NONE          ((size_t) -1)
+
+//  When the index grows we don't rehash it all at once, which would
+//  stall the reactor on a big cache. The old index stays beside the new
+//  one, and each kvmap_set moves KVMAP_MIGRATE slots across. A grow that
+//  finds the old index not yet migrated finishes it first, in one go;
+//  the new index is sized so that this does not happen, see s_grow:
+#define KVMAP_MIGRATE       64
+
+#if defined (_M_X64) || defined (__SSE2__) || (defined (_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define KVMAP_SSE2
+#   include <emmintrin.h>
+#endif
+
+typedef struct {
+	byte *ctrl;                 //  Control bytes, limit of them
+	kventry_t **slots;          //  Entry of each slot
+	size_t limit;               //  Number of slots, a power of two
+} kvindex_t;
+
+//  Structure of our class
+struct _kvmap_t {
+	kvindex_t index;            //  Index we insert into
+	size_t used;                //  Slots of index not empty
+	kvindex_t old;              //  Index being migrated, if any
+	size_t migrated;            //  Slots of old index migrated so far
+	size_t size;                //  Number of live entries
+	size_t bytes;               //  Bytes held by live entries
+	byte **pages;               //  Slab pages
+	size_t nbr_pages;
+	size_t max_pages;
+	byte *page_free;            //  Unused part of the last page
+	size_t page_left;
+	kventry_t *free [KVMAP_CLASSES + 1];
+	rcu_t *rcu;                 //  Readers on other threads, if any
+	volatile int64_t version;   //  Odd while we change the map, if rcu
+};
+
+//  .split hashing and allocation
+//  We hash keys with 64-bit FNV-1a, folded so that the low bits, which
+//  pick the group, depend on the whole key. The top 7 bits go into the
+//  control byte:
+
+static uint64_t
+	s_hash (char *key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	while (*key) {
+		hash ^= (byte) *key++;
+		hash *= 1099511628211ULL;
+	}
+	return hash ^ (hash >> 32);
+}
+
+#define KVHASH_CTRL(h)      ((byte) ((h) >> 57))
+
+static size_t
+	s_entry_need (size_t key_size, size_t size)
+{
+	return KVENTRY_HEADER + key_size + 1 + size + 1;
+}
+
+static size_t
+	s_entry_bytes (kventry_t *entry)
+{
+	if (entry->slab)
+		return entry->slab * KVMAP_GRAIN;
+	return s_entry_need (entry->key_size, entry->size);
+}
+
+static kventry_t *
+	s_entry_alloc (kvmap_t *self, size_t need)
+{
+	kventry_t *entry;
+	size_t slab = (need + KVMAP_GRAIN - 1) / KVMAP_GRAIN;
+	if (slab > KVMAP_CLASSES) {
+		entry = (kventry_t *) malloc (need);
+		entry->slab = 0;
+		self->bytes += need;
+		return entry;
+	}
+	if (self->free [slab]) {
+		entry = self->free [slab];
+		self->free [slab] = *(kventry_t **) entry;
+	}
+	else {
+		if (self->page_left < slab * KVMAP_GRAIN) {
+			//  Give what is left of the page to a smaller class
+			size_t left = self->page_left / KVMAP_GRAIN;
+			if (left) {
+				*(kventry_t **) self->page_free = self->free [left];
+				self->free [left] = (kventry_t *) self->page_free;
+			}
+			if (self->nbr_pages == self->max_pages) {
+				self->max_pages = self->max_pages? self->max_pages * 2: 16;
+				self->pages = (byte **) realloc (self->pages, self->max_pages * sizeof (byte *));
+			}
+			self->page_free = (byte *) malloc (KVMAP_PAGE_SIZE);
+			self->pages [self->nbr_pages++] = self->page_free;
+			self->page_left = KVMAP_PAGE_SIZE;
+		}
+		entry = (kventry_t *) self->page_free;
+		self->page_free += slab * KVMAP_GRAIN;
+		self->page_left -= slab * KVMAP_GRAIN;
+	}
+	entry->slab = (byte) slab;
+	self->bytes += slab * KVMAP_GRAIN;
+	return entry;
+}
+
+//  Free a block that readers on other threads may still be in. Slab
+//  blocks are not freed, and are only reused for the same slab class.
+static void
+	s_release (kvmap_t *self, void *block)
+{
+	if (self->rcu)
+		rcu_retire (self->rcu, block, free);
+	else
+		free (block);
+}
+
+static void
+	s_entry_free (kvmap_t *self, kventry_t *entry)
+{
+	self->bytes -= s_entry_bytes (entry);
+	if (entry->slab) {
+		*(kventry_t **) entry = self->free [entry->slab];
+		self->free [entry->slab] = entry;
+	}
+	else
+		s_release (self, entry);
+}
+
+//  .split index
+//  Group probing returns a bit mask with one bit per slot of the group:
+
+static uint
+	s_group_match (byte *ctrl, byte value)
+{
+#if defined (KVMAP_SSE2)
+	__m128i group = _mm_loadu_si128 ((__m128i *) ctrl);
+	return (uint) _mm_movemask_epi8 (_mm_cmpeq_epi8 (group, _mm_set1_epi8 ((char) value)));
+#else
+	uint mask = 0;
+	int bit;
+	for (bit = 0; bit < KVMAP_GROUP; bit++)
+		if (ctrl [bit] == value)
+			mask |= 1 << bit;
+	return mask;
+#endif
+}
+
+//  Slots that are empty or deleted have their top bit set
+static uint
+	s_group_free (byte *ctrl)
+{
+#if defined (KVMAP_SSE2)
+	return (uint) _mm_movemask_epi8 (_mm_loadu_si128 ((__m128i *) ctrl));
+#else
+	uint mask = 0;
+	int bit;
+	for (bit = 0; bit < KVMAP_GROUP; bit++)
+		if (!KVCTRL_FULL (ctrl [bit]))
+			mask |= 1 << bit;
+	return mask;
+#endif
+}
+
+static int
+	s_lowest_bit (uint mask)
+{
+#if defined (_MSC_VER)
+	unsigned long bit;
+	_BitScanForward (&bit, mask);
+	return (int) bit;
+#else
+	return __builtin_ctz (mask);
+#endif
+}
+
+static void
+	s_index_new (kvindex_t *index, size_t limit)
+{
+	index->limit = limit;
+	index->ctrl = (byte *) malloc (limit);
+	memset (index->ctrl, KVCTRL_EMPTY, limit);
+	index->slots = (kventry_t **) malloc (limit * sizeof (kventry_t *));
+}
+
+static void
+	s_index_destroy (kvindex_t *index)
+{
+	free (index->ctrl);
+	free (index->slots);
+	memset (index, 0, sizeof (kvindex_t));
+}
+
+//  Groups are probed in triangular order, which visits every group of a
+//  power of two table. A probe stops at the first group holding an empty
+//  slot. Returns the slot holding key, or KVMAP_NONE:
+
+static size_t
+	s_index_find (kvindex_t *index, char *key, uint64_t hash)
+{
+	size_t mask = index->limit / KVMAP_GROUP - 1;
+	size_t group = (size_t) hash & mask;
+	size_t step = 0;
+	byte ctrl = KVHASH_CTRL (hash);
+	if (index->limit == 0)
+		return KVMAP_NONE;
+	while (TRUE) {
+		byte *group_ctrl = index->ctrl + group * KVMAP_GROUP;
+		uint match = s_group_match (group_ctrl, ctrl);
+		while (match) {
+			size_t slot = group * KVMAP_GROUP + s_lowest_bit (match);
+			if (streq (index->slots [slot]->data, key))
+				return slot;
+			match &= match - 1;
+		}
+		if (s_group_match (group_ctrl, KVCTRL_EMPTY))
+			return KVMAP_NONE;
+		group = (group + ++step) & mask;
+	}
+}
+
+//  Put entry, whose key is not in the new index, in the first free slot
+//  of its probe. Returns that slot:
+
+static size_t
+	s_index_insert (kvmap_t *self, kventry_t *entry, uint64_t hash)
+{
+	kvindex_t *index = &self->index;
+	size_t mask = index->limit / KVMAP_GROUP - 1;
+	size_t group = (size_t) hash & mask;
+	size_t step = 0;
+	uint free_mask;
+	size_t slot;
+	while ((free_mask = s_group_free (index->ctrl + group * KVMAP_GROUP)) == 0)
+		group = (group + ++step) & mask;
+	slot = group * KVMAP_GROUP + s_lowest_bit (free_mask);
+	if (index->ctrl [slot] == KVCTRL_EMPTY)
+		self->used++;
+	index->ctrl [slot] = KVHASH_CTRL (hash);
+	index->slots [slot] = entry;
+	return slot;
+}
+
+//  A deleted slot can go back to empty if its group still has an empty
+//  slot, as no probe ever went past that group. Returns 1 if it did:
+
+static int
+	s_index_remove (kvindex_t *index, size_t slot)
+{
+	byte *group_ctrl = index->ctrl + (slot & ~(size_t) (KVMAP_GROUP - 1));
+	if (s_group_match (group_ctrl, KVCTRL_EMPTY)) {
+		index->ctrl [slot] = KVCTRL_EMPTY;
+		return 1;
+	}
+	index->ctrl [slot] = KVCTRL_DELETED;
+	return 0;
+}
+
+//  Move up to steps slots of the old index into the new one
+static void
+	s_migrate (kvmap_t *self, size_t steps)
+{
+	while (self->old.limit && steps--) {
+		size_t slot = self->migrated++;
+		if (slot == self->old.limit) {
+			s_release (self, self->old.ctrl);
+			s_release (self, self->old.slots);
+			memset (&self->old, 0, sizeof (kvindex_t));
+			self->migrated = 0;
+			break;
+		}
+		if (KVCTRL_FULL (self->old.ctrl [slot])) {
+			kventry_t *entry = self->old.slots [slot];
+			s_index_insert (self, entry, s_hash (entry->data));
+			//  Left as deleted, so old probes still go past it
+			self->old.ctrl [slot] = KVCTRL_DELETED;
+		}
+	}
+}
+
+//  Start a new index, doubling it unless most used slots are deleted.
+//  The new index is sized so that the old one is migrated before it
+//  fills up in turn: migrating a limit of L slots takes L / KVMAP_MIGRATE
+//  sets, which add as many keys at most. A doubled index starts at 7/16
+//  full, one that is not doubled at 1/2 full at most, and neither gets
+//  to 7/8 full in that many sets. So the s_migrate below does no work,
+//  unless KVMAP_MIGRATE is lowered a lot; it is there for safety.
+
+static void
+	s_grow (kvmap_t *self)
+{
+	size_t limit = self->index.limit;
+	if (self->size * 2 + 2 > limit)
+		limit *= 2;
+	s_migrate (self, (size_t) -1);
+	self->old = self->index;
+	self->migrated = 0;
+	s_index_new (&self->index, limit);
+	self->used = 0;
+}
+
+//  With an rcu, every change makes the version odd while it runs
+static void
+	s_write_begin (kvmap_t *self)
+{
+	if (self->rcu)
+		InterlockedIncrement64 (&self->version);
+}
+
+static void
+	s_write_end (kvmap_t *self)
+{
+	if (self->rcu)
+		InterlockedIncrement64 (&self->version);
+}
+
+//  .split constructor and destructor
+
+kvmap_t *
+	kvmap_new (size_t size_hint)
+{
+	kvmap_t *self = (kvmap_t *) zmalloc (sizeof (kvmap_t));
+	size_t limit = KVMAP_MIN_SLOTS;
+	while (limit * 7 / 8 < size_hint)
+		limit <<= 1;
+	s_index_new (&self->index, limit);
+	return self;
+}
+
+//  Slab entries go with their pages, others one by one
+static void
+	s_free_entries (kvindex_t *index)
+{
+	size_t slot;
+	for (slot = 0; slot < index->limit; slot++)
+		if (KVCTRL_FULL (index->ctrl [slot]) && index->slots [slot]->slab == 0)
+			free (index->slots [slot]);
+}
+
+void
+	kvmap_destroy (kvmap_t **self_p)
+{
+	assert (self_p);
+	if (*self_p) {
+		kvmap_t *self = *self_p;
+		size_t index;
+		s_free_entries (&self->index);
+		s_free_entries (&self->old);
+		s_index_destroy (&self->index);
+		s_index_destroy (&self->old);
+		for (index = 0; index < self->nbr_pages; index++)
+			free (self->pages [index]);
+		free (self->pages);
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+//  .split set, lookup and delete
+//  An entry that still fits its slab class is updated in place, else we
+//  move it to a new block. An entry still in the old index moves to the
+//  new one:
+
+kventry_t *
+	kvmap_set (kvmap_t *self, char *key, byte *value, size_t size, int64_t sequence, int64_t expiry)
+{
+	uint64_t hash;
+	size_t key_size;
+	size_t need;
+	size_t slot;
+	kventry_t *entry = NULL;
+
+	assert (self);
+	assert (key);
+	key_size = strlen (key);
+	assert (key_size < 65535);
+	need = s_entry_need (key_size, size);
+	s_write_begin (self);
+	if ((self->used + 1) * 8 > self->index.limit * 7)
+		s_grow (self);
+	s_migrate (self, KVMAP_MIGRATE);
+
+	hash = s_hash (key);
+	slot = s_index_find (&self->index, key, hash);
+	if (slot != KVMAP_NONE)
+		entry = self->index.slots [slot];
+	else {
+		size_t old_slot = s_index_find (&self->old, key, hash);
+		if (old_slot != KVMAP_NONE) {
+			entry = self->old.slots [old_slot];
+			self->old.ctrl [old_slot] = KVCTRL_DELETED;
+			slot = s_index_insert (self, entry, hash);
+		}
+	}
+	if (entry && entry->slab != (need + KVMAP_GRAIN - 1) / KVMAP_GRAIN) {
+		s_entry_free (self, entry);
+		entry = NULL;
+	}
+	if (!entry) {
+		entry = s_entry_alloc (self, need);
+		entry->key_size = (unsigned short) key_size;
+		memcpy (entry->data, key, key_size + 1);
+		if (slot == KVMAP_NONE) {
+			s_index_insert (self, entry, hash);
+			self->size++;
+		}
+		else
+			self->index.slots [slot] = entry;
+	}
+	entry->sequence = sequence;
+	entry->expiry = expiry;
+	entry->flags = 0;
+	entry->size = (uint) size;
+	if (size)
+		memcpy (entry->data + key_size + 1, value, size);
+	entry->data [key_size + 1 + size] = 0;
+	s_write_end (self);
+	return entry;
+}
+
+kventry_t *
+	kvmap_lookup (kvmap_t *self, char *key)
+{
+	uint64_t hash;
+	size_t slot;
+	assert (self);
+	assert (key);
+	hash = s_hash (key);
+	slot = s_index_find (&self->index, key, hash);
+	if (slot != KVMAP_NONE)
+		return self->index.slots [slot];
+	slot = s_index_find (&self->old, key, hash);
+	return slot != KVMAP_NONE? self->old.slots [slot]: NULL;
+}
+
+int
+	kvmap_delete (kvmap_t *self, char *key)
+{
+	uint64_t hash;
+	size_t slot;
+	assert (self);
+	assert (key);
+	hash = s_hash (key);
+	slot = s_index_find (&self->index, key, hash);
+	if (slot != KVMAP_NONE) {
+		s_write_begin (self);
+		s_entry_free (self, self->index.slots [slot]);
+		self->used -= s_index_remove (&self->index, slot);
+	}
+	else {
+		slot = s_index_find (&self->old, key, hash);
+		if (slot == KVMAP_NONE)
+			return -1;
+		s_write_begin (self);
+		s_entry_free (self, self->old.slots [slot]);
+		self->old.ctrl [slot] = KVCTRL_DELETED;
+	}
+	self->size--;
+	s_write_end (self);
+	return 0;
+}
+
+kventry_t *
+	kvmap_store (kvmap_t *self, kvmsg_t **kvmsg_p)
+{
+	kventry_t *entry = NULL;
+	assert (kvmsg_p);
+	if (*kvmsg_p) {
+		kvmsg_t *kvmsg = *kvmsg_p;
+		if (kvmsg_size (kvmsg)) {
+			entry = kvmap_set (self, kvmsg_key (kvmsg), kvmsg_body (kvmsg), kvmsg_size (kvmsg),
+				kvmsg_sequence (kvmsg), kvmsg_expiry (kvmsg));
+		}
+		else
+			kvmap_delete (self, kvmsg_key (kvmsg));
+		kvmsg_destroy (kvmsg_p);
+	}
+	return entry;
+}
+
+//  .split lock-free reads
+//  A reader on another thread may run into a change at any point, and
+//  read a mix of before and after. So it checks the version before it
+//  trusts a pointer it read, and retries when the version moved, which
+//  makes what it returns all there at one time. Memory it reads was
+//  never freed under it: slab blocks stay, and are only reused for the
+//  same slab class, so a size read from a block fits the block, while
+//  other blocks are retired to the rcu:
+
+static int64_t
+	s_read_begin (kvmap_t *self)
+{
+	int64_t version;
+	while ((version = self->version) & 1)
+		YieldProcessor ();
+	_ReadWriteBarrier ();
+	return version;
+}
+
+//  Return TRUE if no change ran since s_read_begin returned version
+static Bool
+	s_read_valid (kvmap_t *self, int64_t version)
+{
+	_ReadWriteBarrier ();
+	return self->version == version;
+}
+
+//  Like s_index_find, on a copy of an index taken at version. A probe
+//  that races a change may find no empty slot, so it stops after one
+//  round. Returns NULL if key is not there, or if the version moved:
+
+static kventry_t *
+	s_index_read (kvmap_t *self, kvindex_t *index, char *key, size_t key_size, uint64_t hash, int64_t version)
+{
+	size_t mask = index->limit / KVMAP_GROUP - 1;
+	size_t group = (size_t) hash & mask;
+	size_t step = 0;
+	byte ctrl = KVHASH_CTRL (hash);
+	if (index->limit == 0)
+		return NULL;
+	while (step <= mask) {
+		byte *group_ctrl = index->ctrl + group * KVMAP_GROUP;
+		uint match = s_group_match (group_ctrl, ctrl);
+		while (match) {
+			kventry_t *entry = index->slots [group * KVMAP_GROUP + s_lowest_bit (match)];
+			if (!s_read_valid (self, version))
+				return NULL;
+			if (entry->key_size == key_size && memcmp (entry->data, key, key_size) == 0)
+				return entry;
+			match &= match - 1;
+		}
+		if (s_group_match (group_ctrl, KVCTRL_EMPTY))
+			return NULL;
+		group = (group + ++step) & mask;
+	}
+	return NULL;
+}
+
+void
+	kvmap_set_rcu (kvmap_t *self, rcu_t *rcu)
+{
+	assert (self);
+	self->rcu = rcu;
+}
+
+//  Copy value of key and a null byte into *buffer_p at offset, growing
+//  the buffer to *limit_p bytes as needed. Returns TRUE and sets *size
+//  if key is there, else FALSE:
+
+static Bool
+	s_read_value (kvmap_t *self, char *key, uint64_t hash, byte **buffer_p, size_t *limit_p, size_t offset, size_t *size)
+{
+	size_t key_size = strlen (key);
+	while (TRUE) {
+		kvindex_t index;
+		kvindex_t old;
+		kventry_t *entry;
+		size_t entry_size = 0;
+		int64_t version = s_read_begin (self);
+		index = self->index;
+		old = self->old;
+		if (!s_read_valid (self, version))
+			continue;
+		entry = s_index_read (self, &index, key, key_size, hash, version);
+		if (!entry)
+			entry = s_index_read (self, &old, key, key_size, hash, version);
+		if (entry) {
+			entry_size = entry->size;
+			if (!s_read_valid (self, version))
+				continue;
+			if (offset + entry_size + 1 > *limit_p) {
+				*limit_p = max (*limit_p * 2, offset + entry_size + 1);
+				*buffer_p = (byte *) realloc (*buffer_p, *limit_p);
+			}
+			memcpy (*buffer_p + offset, entry->data + key_size + 1, entry_size);
+			(*buffer_p) [offset + entry_size] = 0;
+		}
+		if (s_read_valid (self, version)) {
+			*size = entry_size;
+			return entry != NULL;
+		}
+	}
+}
+
+//  Start loading the first group of control bytes hash probes. Reading
+//  the index as it changes does no harm, a prefetch never faults.
+static void
+	s_prefetch (kvmap_t *self, uint64_t hash)
+{
+#if defined (KVMAP_SSE2)
+	size_t mask = self->index.limit / KVMAP_GROUP - 1;
+	_mm_prefetch ((char *) self->index.ctrl + ((size_t) hash & mask) * KVMAP_GROUP, _MM_HINT_T0);
+#endif
+}
+
+byte *
+	kvmap_read (kvmap_t *self, char *key, size_t *size)
+{
+	byte *value = NULL;
+	size_t limit = 0;
+	assert (self);
+	assert (key);
+	assert (size);
+	if (s_read_value (self, key, s_hash (key), &value, &limit, 0, size))
+		return value;
+	free (value);
+	return NULL;
+}
+
+//  The keys are all hashed and their control bytes prefetched before we
+//  look up the first one, so the cache misses of the batch overlap. The
+//  values go into one buffer, which we only grow by doubling:
+
+byte *
+	kvmap_read_many (kvmap_t *self, char **keys, size_t count, byte **values, size_t *sizes)
+{
+	uint64_t *hashes;
+	size_t *offsets;
+	byte *buffer = NULL;
+	size_t limit = 0;
+	size_t offset = 0;
+	size_t index;
+	assert (self);
+	assert (keys || !count);
+	if (count == 0)
+		return NULL;
+	hashes = (uint64_t *) malloc (count * (sizeof (uint64_t) + sizeof (size_t)));
+	offsets = (size_t *) (hashes + count);
+	for (index = 0; index < count; index++) {
+		hashes [index] = s_hash (keys [index]);
+		s_prefetch (self, hashes [index]);
+	}
+	for (index = 0; index < count; index++) {
+		offsets [index] = offset;
+		if (s_read_value (self, keys [index], hashes [index], &buffer, &limit, offset, &sizes [index]))
+			offset += sizes [index] + 1;
+		else
+			offsets [index] = KVMAP_NONE;
+	}
+	//  Buffer is where it will stay now
+	for (index = 0; index < count; index++)
+		values [index] = offsets [index] == KVMAP_NONE? NULL: buffer + offsets [index];
+	free (hashes);
+	return buffer;
+}
+
+//  .split iteration
+
+size_t
+	kvmap_size (kvmap_t *self)
+{
+	assert (self);
+	return self->size;
+}
+
+size_t
+	kvmap_memory (kvmap_t *self)
+{
+	assert (self);
+	return self->bytes + (self->index.limit + self->old.limit) * (sizeof (kventry_t *) + 1);
+}
+
+//  Entries are visited in the new index, then in the old one. Deleting
+//  does not migrate, so each entry is visited once:
+
+static int
+	s_index_foreach (kvindex_t *index, kvmap_foreach_fn *callback, void *args)
+{
+	size_t slot;
+	int rc = 0;
+	for (slot = 0; slot < index->limit && rc == 0; slot++)
+		if (KVCTRL_FULL (index->ctrl [slot]))
+			rc = callback (index->slots [slot], args);
+	return rc;
+}
+
+int
+	kvmap_foreach (kvmap_t *self, kvmap_foreach_fn *callback, void *args)
+{
+	int rc;
+	assert (self);
+	rc = s_index_foreach (&self->index, callback, args);
+	if (rc == 0)
+		rc = s_index_foreach (&self->old, callback, args);
+	return rc;
+}
+
+//  Cursor positions run through the new index, then through the old
+//  one. Entries migrated between calls may be seen twice or not at all,
+//  which is fine for a CLOCK hand:
+
+kventry_t *
+	kvmap_next (kvmap_t *self, size_t *cursor)
+{
+	assert (self);
+	while (*cursor < self->index.limit + self->old.limit) {
+		size_t slot = (*cursor)++;
+		kvindex_t *index = &self->index;
+		if (slot >= index->limit) {
+			slot -= index->limit;
+			index = &self->old;
+		}
+		if (KVCTRL_FULL (index->ctrl [slot]))
+			return index->slots [slot];
+	}
+	*cursor = 0;
+	return NULL;
+}
+
+//  .split entry accessors
+
+char *
+	kventry_key (kventry_t *entry)
+{
+	assert (entry);
+	return entry->data;
+}
+
+byte *
+	kventry_value (kventry_t *entry)
+{
+	assert (entry);
+	return (byte *) entry->data + entry->key_size + 1;
+}
+
+size_t
+	kventry_size (kventry_t *entry)
+{
+	assert (entry);
+	return entry->size;
+}
+
+int64_t
+	kventry_sequence (kventry_t *entry)
+{
+	assert (entry);
+	return entry->sequence;
+}
+
+int64_t
+	kventry_expiry (kventry_t *entry)
+{
+	assert (entry);
+	return entry->expiry;
+}
+
+byte
+	kventry_flags (kventry_t *entry)
+{
+	assert (entry);
+	return entry->flags;
+}
+
+void
+	kventry_set_flags (kventry_t *entry, byte flags)
+{
+	assert (entry);
+	entry->flags = flags;
+}
+
+kvmsg_t *
+	kventry_kvmsg (kventry_t *entry)
+{
+	kvmsg_t *kvmsg;
+	assert (entry);
+	kvmsg = kvmsg_new (entry->sequence);
+	kvmsg_set_key  (kvmsg, entry->data);
+	kvmsg_set_body (kvmsg, kventry_value (entry), entry->size);
+	kvmsg_set_expiry (kvmsg, entry->expiry);
+	return kvmsg;
+}
+
+//  .split test method
+//  The selftest checks the map against overwrites, deletes and growth,
+//  and reports what an entry costs. Then it reads a map shared through
+//  an rcu, holding a read section while the map changes:
+
+static int
+	s_test_count (kventry_t *entry, void *args)
+{
+	(*(int *) args)++;
+	return 0;
+}
+
+int
+	kvmap_test (int verbose)
+{
+	kvmap_t *kvmap;
+	kventry_t *entry;
+	kvmsg_t *kvmsg;
+	rcu_t *rcu;
+	uint token;
+	byte *value;
+	byte big [4000];
+	char *keys [3];
+	byte *values [3];
+	size_t sizes [3];
+	char key [32];
+	size_t cursor = 0;
+	size_t retired;
+	size_t size;
+	int count = 0;
+	int index;
+
+	printf (" * kvmap: ");
+	kvmap = kvmap_new (0);
+
+	entry = kvmap_set (kvmap, "key", (byte *) "body", 4, 1, 0);
+	assert (entry);
+	assert (kvmap_lookup (kvmap, "key") == entry);
+	assert (streq ((char *) kventry_value (entry), "body"));
+	assert (kventry_size (entry) == 4);
+	assert (kventry_sequence (entry) == 1);
+
+	//  Overwrite in place, then with a bigger value
+	entry = kvmap_set (kvmap, "key", (byte *) "BODY", 4, 2, 0);
+	assert (kvmap_lookup (kvmap, "key") == entry);
+	assert (streq ((char *) kventry_value (entry), "BODY"));
+	entry = kvmap_set (kvmap, "key", (byte *) "a much longer body than before", 30, 3, 0);
+	assert (kventry_size (kvmap_lookup (kvmap, "key")) == 30);
+	assert (kvmap_size (kvmap) == 1);
+
+	//  Through kvmsg, with an expiry
+	kvmsg = kvmsg_new (4);
+	kvmsg_set_key  (kvmsg, "ttlkey");
+	kvmsg_set_body (kvmsg, (byte *) "value", 5);
+	kvmsg_set_expiry (kvmsg, 12345);
+	entry = kvmap_store (kvmap, &kvmsg);
+	assert (kvmsg == NULL);
+	assert (kventry_expiry (entry) == 12345);
+	kvmsg = kventry_kvmsg (entry);
+	assert (streq (kvmsg_key (kvmsg), "ttlkey"));
+	assert (kvmsg_size (kvmsg) == 5);
+	assert (kvmsg_expiry (kvmsg) == 12345);
+	kvmsg_del_body (kvmsg);
+	kvmap_store (kvmap, &kvmsg);
+	assert (kvmap_lookup (kvmap, "ttlkey") == NULL);
+
+	//  Growth, deletes and iteration
+	for (index = 0; index < 100000; index++) {
+		sprintf (key, "key-%d", index);
+		kvmap_set (kvmap, key, (byte *) key, strlen (key), index, 0);
+	}
+	assert (kvmap_size (kvmap) == 100001);
+	for (index = 0; index < 100000; index += 2) {
+		sprintf (key, "key-%d", index);
+		assert (kvmap_delete (kvmap, key) == 0);
+	}
+	assert (kvmap_delete (kvmap, "key-0") == -1);
+	for (index = 0; index < 100000; index++) {
+		sprintf (key, "key-%d", index);
+		entry = kvmap_lookup (kvmap, key);
+		assert ((entry != NULL) == (index % 2 == 1));
+		if (entry)
+			assert (streq ((char *) kventry_value (entry), key));
+	}
+	while (kvmap_next (kvmap, &cursor))
+		count++;
+	assert (count == 50001);
+
+	//  Updates and deletes while the index is being migrated
+	for (index = 100000; kvmap->old.limit == 0; index++) {
+		sprintf (key, "key-%d", index);
+		kvmap_set (kvmap, key, (byte *) key, strlen (key), index, 0);
+	}
+	entry = kvmap_set (kvmap, "key-1", (byte *) "a value that needs a bigger slab class", 38, 1, 0);
+	assert (kvmap_lookup (kvmap, "key-1") == entry);
+	assert (kvmap_delete (kvmap, "key-3") == 0);
+	assert (kvmap_lookup (kvmap, "key-3") == NULL);
+	assert (kvmap_lookup (kvmap, "key-5") != NULL);
+	count = 0;
+	kvmap_foreach (kvmap, s_test_count, &count);
+	assert ((size_t) count == kvmap_size (kvmap));
+	if (verbose)
+		printf ("%Iu keys, %Iu bytes, %Iu bytes/key ", kvmap_size (kvmap), kvmap_memory (kvmap),
+			kvmap_memory (kvmap) / kvmap_size (kvmap));
+	kvmap_destroy (&kvmap);
+
+	//  Lock-free reads; what changes free waits for the reader
+	rcu = rcu_new ();
+	kvmap = kvmap_new (0);
+	kvmap_set_rcu (kvmap, rcu);
+	token = rcu_read_lock (rcu);
+	for (index = 0; index < 1000; index++) {
+		sprintf (key, "key-%d", index);
+		kvmap_set (kvmap, key, (byte *) key, strlen (key), index, 0);
+	}
+	value = kvmap_read (kvmap, "key-7", &size);
+	assert (size == 5);
+	assert (streq ((char *) value, "key-7"));
+	free (value);
+	keys [0] = "key-1";
+	keys [1] = "nokey";
+	keys [2] = "key-999";
+	value = kvmap_read_many (kvmap, keys, 3, values, sizes);
+	assert (values [0] && streq ((char *) values [0], "key-1") && sizes [0] == 5);
+	assert (values [1] == NULL && sizes [1] == 0);
+	assert (values [2] && streq ((char *) values [2], "key-999") && sizes [2] == 7);
+	free (value);
+	assert (kvmap_read (kvmap, "nokey", &size) == NULL);
+	assert (size == 0);
+	memset (big, 'x', sizeof (big));
+	kvmap_set (kvmap, "big", big, sizeof (big), 1, 0);
+	kvmap_set (kvmap, "big", big, 3000, 2, 0);
+	value = kvmap_read (kvmap, "big", &size);
+	assert (size == 3000);
+	assert (value [2999] == 'x' && value [3000] == 0);
+	free (value);
+	assert (kvmap_delete (kvmap, "key-7") == 0);
+	assert (kvmap_read (kvmap, "key-7", &size) == NULL);
+	//  Old indexes and the first big value
+	retired = rcu_retired (rcu);
+	assert (retired > 1);
+	rcu_reclaim (rcu);
+	rcu_reclaim (rcu);
+	assert (rcu_retired (rcu) == retired);
+	rcu_read_unlock (rcu, token);
+	rcu_reclaim (rcu);
+	assert (rcu_retired (rcu) == 0);
+	kvmap_destroy (&kvmap);
+	rcu_destroy (&rcu);
+	printf ("OK\n");
+	return 0;
+}
+
+//  .split benchmark
+//  Compares kvmap with the zhash it replaced: inserts nbr_keys keys, then
+//  looks each one up. The worst time for 1000 inserts shows that a
+//  growing kvmap does not stall. Meant to run from 1M to 100M keys:
+
+static void
+	s_bench_key (char *key, size_t index)
+{
+	sprintf (key, "bench-%I64u", (uint64_t) index * 2654435761u % 4294967291u);
+}
+
+int
+	kvmap_bench (size_t nbr_keys)
+{
+	kvmap_t *kvmap = kvmap_new (0);
+	zhash_t *zhash = zhash_new ();
+	char key [32];
+	size_t index;
+	size_t found;
+	int64_t start, batch, worst;
+	int64_t kvmap_insert, kvmap_lookup_time, zhash_insert_time, zhash_lookup_time;
+	int64_t kvmap_worst, zhash_worst;
+
+	printf (" * kvmap bench: %Iu keys\n", nbr_keys);
+	worst = 0;
+	start = batch = zclock_time ();
+	for (index = 0; index < nbr_keys; index++) {
+		s_bench_key (key, index);
+		kvmap_set (kvmap, key, (byte *) key, strlen (key), index, 0);
+		if (index % 1000 == 999) {
+			worst = max (worst, zclock_time () - batch);
+			batch = zclock_time ();
+		}
+	}
+	kvmap_insert = zclock_time () - start;
+	kvmap_worst = worst;
+	found = 0;
+	start = zclock_time ();
+	for (index = 0; index < nbr_keys; index++) {
+		s_bench_key (key, index);
+		if (kvmap_lookup (kvmap, key))
+			found++;
+	}
+	kvmap_lookup_time = zclock_time () - start;
+	assert (found == nbr_keys);
+	printf ("   kvmap: insert %I64d msecs, lookup %I64d msecs, worst %I64d msecs per 1000 inserts, %Iu bytes\n",
+		kvmap_insert, kvmap_lookup_time, kvmap_worst, kvmap_memory (kvmap));
+	kvmap_destroy (&kvmap);
+
+	worst = 0;
+	start = batch = zclock_time ();
+	for (index = 0; index < nbr_keys; index++) {
+		s_bench_key (key, index);
+		zhash_insert (zhash, key, (void *) "value");
+		if (index % 1000 == 999) {
+			worst = max (worst, zclock_time () - batch);
+			batch = zclock_time ();
+		}
+	}
+	zhash_insert_time = zclock_time () - start;
+	zhash_worst = worst;
+	found = 0;
+	start = zclock_time ();
+	for (index = 0; index < nbr_keys; index++) {
+		s_bench_key (key, index);
+		if (zhash_lookup (zhash, key))
+			found++;
+	}
+	zhash_lookup_time = zclock_time () - start;
+	assert (found == nbr_keys);
+	printf ("   zhash: insert %I64d msecs, lookup %I64d msecs, worst %I64d msecs per 1000 inserts\n",
+		zhash_insert_time, zhash_lookup_time, zhash_worst);
+	zhash_destroy (&zhash);
+	return 0;
+}
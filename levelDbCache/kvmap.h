@@ -0,0 +1,128 @@
+/*  =====================================================================
+*  kvmap - compact key-value map class
+
+-------------------------------------------------------------------------
+Copyright (c) 1991-2013 Andre Charles Legendre <andre.legendre@kalimasystems.org>
+Copyright other contributors as noted in the AUTHORS file.
+
+This file is part of LevelDbCache, the shared in memory cache for levelDb Key Value store.
+
+This is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or (at
+your option) any later version.
+
+This software is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this program. If not, see
+<http://www.gnu.org/licenses/>.
+*  ===================================================================== */
+
+#ifndef __KVMAP_H_INCLUDED__
+#define __KVMAP_H_INCLUDED__
+
+#include "kvmsg.h"
+#include "rcu.h"
+
+//  Entry flags
+#define KVENTRY_USED        1   //  Reference bit, for cache eviction
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structures
+typedef struct _kvmap_t kvmap_t;
+typedef struct _kventry_t kventry_t;
+
+//  Callback for kvmap_foreach, return non-zero to stop
+typedef int (kvmap_foreach_fn) (kventry_t *entry, void *args);
+
+//  Create a new kvmap, size_hint is the number of keys expected, if known
+_EXPORTS_API kvmap_t *
+    kvmap_new (size_t size_hint);
+//  Destroy a kvmap and all its entries
+_EXPORTS_API void
+    kvmap_destroy (kvmap_t **self_p);
+
+//  Set value for key, replacing any previous value. The value is copied
+//  and always followed by a null byte. Returns the stored entry.
+_EXPORTS_API kventry_t *
+    kvmap_set (kvmap_t *self, char *key, byte *value, size_t size, int64_t sequence, int64_t expiry);
+//  Return entry for key, if any, else NULL
+_EXPORTS_API kventry_t *
+    kvmap_lookup (kvmap_t *self, char *key);
+//  Delete key, returns 0 if it was there, else -1
+_EXPORTS_API int
+    kvmap_delete (kvmap_t *self, char *key);
+//  Store kvmsg into kvmap, deleting the key if the body is empty, and
+//  destroy the kvmsg. Expiry is taken from the kvmsg header.
+_EXPORTS_API kventry_t *
+    kvmap_store (kvmap_t *self, kvmsg_t **kvmsg_p);
+
+//  Let other threads read the kvmap with kvmap_read, while this thread
+//  changes it. What the kvmap frees from now on is retired to rcu.
+_EXPORTS_API void
+    kvmap_set_rcu (kvmap_t *self, rcu_t *rcu);
+//  Lookup key from any thread, inside a read section of the rcu of the
+//  kvmap. Returns a copy of the value, followed by a null byte, that the
+//  caller must free, and sets *size; or NULL if the key is not there.
+_EXPORTS_API byte *
+    kvmap_read (kvmap_t *self, char *key, size_t *size);
+//  Lookup count keys like kvmap_read, in one pass. Sets values [n] and
+//  sizes [n] for each key; values point into one buffer that is returned,
+//  and that the caller must free. Keys that are not there get a NULL
+//  value, and size 0. Each value is one that was there at one time.
+_EXPORTS_API byte *
+    kvmap_read_many (kvmap_t *self, char **keys, size_t count, byte **values, size_t *sizes);
+
+//  Return number of keys in kvmap
+_EXPORTS_API size_t
+    kvmap_size (kvmap_t *self);
+//  Return bytes held by live entries and by the index
+_EXPORTS_API size_t
+    kvmap_memory (kvmap_t *self);
+//  Call callback for each entry; the callback may delete that entry,
+//  but must not set any key
+_EXPORTS_API int
+    kvmap_foreach (kvmap_t *self, kvmap_foreach_fn *callback, void *args);
+//  Return next entry from position *cursor, and move *cursor past it.
+//  Returns NULL and rewinds *cursor when it reaches the end of the map.
+_EXPORTS_API kventry_t *
+    kvmap_next (kvmap_t *self, size_t *cursor);
+
+//  Entry accessors
+_EXPORTS_API char *
+    kventry_key (kventry_t *entry);
+_EXPORTS_API byte *
+    kventry_value (kventry_t *entry);
+_EXPORTS_API size_t
+    kventry_size (kventry_t *entry);
+_EXPORTS_API int64_t
+    kventry_sequence (kventry_t *entry);
+_EXPORTS_API int64_t
+    kventry_expiry (kventry_t *entry);
+_EXPORTS_API byte
+    kventry_flags (kventry_t *entry);
+_EXPORTS_API void
+    kventry_set_flags (kventry_t *entry, byte flags);
+//  Build a new kvmsg from entry, to send it on the wire
+_EXPORTS_API kvmsg_t *
+    kventry_kvmsg (kventry_t *entry);
+
+//  Runs self test of class
+_EXPORTS_API int
+    kvmap_test (int verbose);
+//  Runs microbenchmark of class against zhash
+_EXPORTS_API int
+    kvmap_bench (size_t nbr_keys);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
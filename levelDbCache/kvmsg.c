@@ -31,21 +31,52 @@ License along with this program. If not, see
 //#include <uuid/uuid.h>
 #include "zlist.h"
 
-//  Keys are short strings
-#define KVMSG_KEY_MAX   255
-
-//  Message is formatted on wire as 4 frames:
+//  Message is formatted on wire as 6 frames:
 //  frame 0: key (0MQ string)
 //  frame 1: sequence (8 bytes, network order)
 //  frame 2: uuid (blob, 16 bytes)
 //  frame 3: properties (0MQ string)
 //  frame 4: body (blob)
+//  frame 5: header (blob, 16 bytes, see below)
+//  The header comes last, so that the first five frames are laid out
+//  as they always were. Peers that predate it send and read just those
+//  five, with the cache, ttl and ttl expiry as properties; see
+//  kvmsg_send_legacy.
 #define FRAME_KEY       0
 #define FRAME_SEQ       1
 #define FRAME_UUID      2
 #define FRAME_PROPS     3
 #define FRAME_BODY      4
-#define KVMSG_FRAMES    5
+#define FRAME_HEADER    5
+#define KVMSG_FRAMES    6
+
+//  A legacy ttl is in seconds from a client, and an absolute time in
+//  msecs from a server; no time to live comes near this:
+#define KVMSG_LEGACY_TTL_MAX    100000000000
+
+//  The header carries the fields every update needs, so the hot path
+//  never formats or parses text:
+//  byte 0: magic, byte 1: flags, bytes 2-5: cache hash,
+//  bytes 6-13: expiry in msecs, bytes 14-15: zero; all in network order.
+//  It is small enough for 0MQ to keep inside the message, off the heap.
+#define KVMSG_HEADER_SIZE   16
+#define KVMSG_HEADER_MAGIC  0xCA
+
+//  A compact kvmsg carries all of the above in a single frame, so it
+//  costs one 0MQ message instead of six. Integers are varints:
+//  byte: magic, varint: key size, key, varint: sequence,
+//  byte: uuid size (0 or 16), uuid, byte: flags, 4 bytes: cache hash,
+//  varint: expiry, varint: properties size, properties, then the body
+//  up to the end of the frame. The receiver keeps that frame as body
+//  frame, and skips body_offset bytes to reach the body.
+#define KVMSG_COMPACT_MAGIC 0xC2
+//  Bigger bodies are sent as frames, which never copies them
+#define KVMSG_COMPACT_MAX   8192
+
+//  A pack carries many compact kvmsgs in one frame, so that a publisher
+//  pays the per-message cost of its socket once for all of them:
+//  byte: magic, then for each kvmsg, varint: size, compact kvmsg.
+#define KVMSG_PACK_MAGIC    0xC3
 
 //  Structure of our class
 struct _kvmsg {
@@ -55,14 +86,159 @@ struct _kvmsg {
 	zmq_msg_t frame [KVMSG_FRAMES];
 	//  Key, copied into safe C string
 	char key [KVMSG_KEY_MAX + 1];
-	//  List of properties, as name=value strings
+	//  Header fields, decoded on recv and encoded on send
+	byte flags;
+	uint cachehash;
+	int64_t expiry;
+	Bool header_dirty;
+	//  List of properties, as name=value strings, NULL until first used
 	zlist_t *props;
 	size_t props_size;
+	Bool props_dirty;
+	//  Body frame is a compact frame, body starts at this offset
+	size_t body_offset;
+	//  TRUE if message was received compact
+	Bool compact;
+	//  Position of kvmsg_batch_next in a batch body, and its update nbr
+	size_t batch_cursor;
+	uint batch_index;
+	//  TRUE if body is a pack of compact kvmsgs
+	Bool packed;
 };
 
+//  .split network order helpers
+//  These helpers put and get integers in network order:
+
+static void
+	s_put_uint32 (byte *dest, uint value)
+{
+	dest [0] = (byte) ((value >> 24) & 255);
+	dest [1] = (byte) ((value >> 16) & 255);
+	dest [2] = (byte) ((value >> 8)  & 255);
+	dest [3] = (byte) ((value)       & 255);
+}
+
+static uint
+	s_get_uint32 (byte *source)
+{
+	return ((uint) source [0] << 24)
+		+ ((uint) source [1] << 16)
+		+ ((uint) source [2] << 8)
+		+  (uint) source [3];
+}
+
+static void
+	s_put_uint64 (byte *dest, uint64_t value)
+{
+	int index;
+	for (index = 7; index >= 0; index--) {
+		dest [index] = (byte) (value & 255);
+		value >>= 8;
+	}
+}
+
+static uint64_t
+	s_get_uint64 (byte *source)
+{
+	return ((uint64_t) s_get_uint32 (source) << 32)
+		+ (uint64_t) s_get_uint32 (source + 4);
+}
+
+//  Varints hold 7 bits per byte, low bits first, high bit set on all
+//  but the last byte:
+
+static size_t
+	s_varint_size (uint64_t value)
+{
+	size_t size = 1;
+	while (value >= 128) {
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+static byte *
+	s_put_varint (byte *dest, uint64_t value)
+{
+	while (value >= 128) {
+		*dest++ = (byte) (value | 128);
+		value >>= 7;
+	}
+	*dest++ = (byte) value;
+	return dest;
+}
+
+//  Returns NULL if the varint runs past end
+static byte *
+	s_get_varint (byte *source, byte *end, uint64_t *value)
+{
+	int shift = 0;
+	*value = 0;
+	while (source < end && shift < 64) {
+		byte next = *source++;
+		*value |= (uint64_t) (next & 127) << shift;
+		if (!(next & 128))
+			return source;
+		shift += 7;
+	}
+	return NULL;
+}
+
+//  Replace frame with a copy of data
+static void
+	s_set_frame (kvmsg_t *kvmsg, int frame_nbr, byte *data, size_t size)
+{
+	zmq_msg_t *msg = &kvmsg->frame [frame_nbr];
+	if (kvmsg->present [frame_nbr])
+		zmq_msg_close (msg);
+	zmq_msg_init_size (msg, size);
+	memcpy (zmq_msg_data (msg), data, size);
+	kvmsg->present [frame_nbr] = 1;
+}
+
+//  .split header encoding
+//  These two helpers serialize the header fields to and from a message
+//  frame. A header we don't recognize decodes as all zero:
+
+static void
+	s_encode_header (kvmsg_t *kvmsg)
+{
+	byte *header;
+	zmq_msg_t *msg = &kvmsg->frame [FRAME_HEADER];
+	if (kvmsg->present [FRAME_HEADER])
+		zmq_msg_close (msg);
+
+	zmq_msg_init_size (msg, KVMSG_HEADER_SIZE);
+	header = (byte *) zmq_msg_data (msg);
+	header [0] = KVMSG_HEADER_MAGIC;
+	header [1] = kvmsg->flags;
+	s_put_uint32 (header + 2, kvmsg->cachehash);
+	s_put_uint64 (header + 6, (uint64_t) kvmsg->expiry);
+	header [14] = 0;
+	header [15] = 0;
+	kvmsg->present [FRAME_HEADER] = 1;
+	kvmsg->header_dirty = FALSE;
+}
+
+static void
+	s_decode_header (kvmsg_t *kvmsg)
+{
+	zmq_msg_t *msg = &kvmsg->frame [FRAME_HEADER];
+	byte *header = (byte *) zmq_msg_data (msg);
+
+	if (zmq_msg_size (msg) == KVMSG_HEADER_SIZE
+	&&  header [0] == KVMSG_HEADER_MAGIC) {
+		kvmsg->flags = header [1];
+		kvmsg->cachehash = s_get_uint32 (header + 2);
+		kvmsg->expiry = (int64_t) s_get_uint64 (header + 6);
+	}
+}
+
 //  .split property encoding
 //  These two helpers serialize a list of properties to and from a
-//  message frame:
+//  message frame. Properties are optional: they are only decoded when
+//  first asked for, and only encoded again when they changed:
 
 static void
 	s_encode_props (kvmsg_t *kvmsg)
@@ -78,12 +254,14 @@ static void
 	prop = (char* ) zlist_first (kvmsg->props);
 	dest = (char *) zmq_msg_data (msg);
 	while (prop) {
-		strcpy (dest, prop);
-		dest += strlen (prop);
+		size_t len = strlen (prop);
+		memcpy (dest, prop, len);
+		dest += len;
 		*dest++ = '\n';
 		prop = (char *) zlist_next (kvmsg->props);
 	}
 	kvmsg->present [FRAME_PROPS] = 1;
+	kvmsg->props_dirty = FALSE;
 }
 
 static void
@@ -94,23 +272,183 @@ static void
 	char *eoln;
 
 	zmq_msg_t *msg = &kvmsg->frame [FRAME_PROPS];
+	kvmsg->props = zlist_new ();
 	kvmsg->props_size = 0;
-	while (zlist_size (kvmsg->props))
-		free (zlist_pop (kvmsg->props));
+	if (!kvmsg->present [FRAME_PROPS])
+		return;
 
+	//  Copy each line out, the frame stays as received
 	remainder = zmq_msg_size (msg);
 	prop = (char *) zmq_msg_data (msg);
 	eoln = (char *) memchr (prop, '\n', remainder);
 	while (eoln) {
-		*eoln = 0;
-		zlist_append (kvmsg->props, strdup (prop));
-		kvmsg->props_size += strlen (prop) + 1;
-		remainder -= strlen (prop) + 1;
+		size_t len = eoln - prop;
+		char *copy = (char *) malloc (len + 1);
+		memcpy (copy, prop, len);
+		copy [len] = 0;
+		zlist_append (kvmsg->props, copy);
+		kvmsg->props_size += len + 1;
+		remainder -= len + 1;
 		prop = eoln + 1;
 		eoln = (char *) memchr (prop, '\n', remainder);
 	}
 }
 
+//  A message of five frames is from a peer that predates the header.
+//  We take the header fields out of its properties, so that the rest
+//  of the message reads as any other, and don't send them on twice:
+
+static void
+	s_decode_legacy (kvmsg_t *kvmsg)
+{
+	zlist_t *props;
+	char *prop;
+	int64_t ttl;
+
+	s_decode_props (kvmsg);
+	props = kvmsg->props;
+	kvmsg->props = zlist_new ();
+	kvmsg->props_size = 0;
+	while ((prop = (char *) zlist_pop (props)) != NULL) {
+		if (strncmp (prop, "cacheidstr=", 11) == 0) {
+			if (prop [11])
+				kvmsg->cachehash = kvmsg_hash_cacheid (prop + 11);
+		}
+		else if (strncmp (prop, "ttl=", 4) == 0) {
+			ttl = 0;
+			sscanf (prop + 4, "%I64d", &ttl);
+			if (ttl > KVMSG_LEGACY_TTL_MAX)
+				kvmsg->expiry = ttl;
+			else if (ttl > 0) {
+				kvmsg->expiry = ttl * 1000;
+				kvmsg->flags |= KVMSG_FLAG_TTL;
+			}
+		}
+		else if (strncmp (prop, "ttld=", 5) == 0) {
+			if (atoi (prop + 5))
+				kvmsg->flags |= KVMSG_FLAG_EXPIRED;
+		}
+		else {
+			zlist_append (kvmsg->props, prop);
+			kvmsg->props_size += strlen (prop) + 1;
+			continue;
+		}
+		free (prop);
+	}
+	zlist_destroy (&props);
+	kvmsg->props_dirty = TRUE;
+	if (zmq_msg_size (&kvmsg->frame [FRAME_BODY]) == 0)
+		kvmsg->flags |= KVMSG_FLAG_DELETED;
+	kvmsg->header_dirty = TRUE;
+}
+
+//  .split compact decoding
+//  A compact kvmsg arrives as the first frame. We keep it as body frame,
+//  and copy the small fields into frames of their own; 0MQ holds these
+//  inside the message, so there is no heap allocation for them. Returns
+//  -1 if the frame is not a valid compact kvmsg:
+
+static int
+	s_decode_compact (kvmsg_t *kvmsg)
+{
+	uint64_t size;
+	uint64_t value;
+	byte *data;
+	byte *source;
+	byte *end;
+	zmq_msg_t *wire = &kvmsg->frame [FRAME_BODY];
+
+	zmq_msg_init (wire);
+	zmq_msg_move (wire, &kvmsg->frame [FRAME_KEY]);
+	zmq_msg_close (&kvmsg->frame [FRAME_KEY]);
+	kvmsg->present [FRAME_KEY] = 0;
+	kvmsg->present [FRAME_BODY] = 1;
+	data = (byte *) zmq_msg_data (wire);
+	end = data + zmq_msg_size (wire);
+	if (data == end || *data != KVMSG_COMPACT_MAGIC)
+		return -1;
+
+	source = s_get_varint (data + 1, end, &size);
+	if (!source || size > KVMSG_KEY_MAX || size > (uint64_t) (end - source))
+		return -1;
+	s_set_frame (kvmsg, FRAME_KEY, source, (size_t) size);
+	memcpy (kvmsg->key, source, (size_t) size);
+	kvmsg->key [size] = 0;
+	source += size;
+
+	source = s_get_varint (source, end, &value);
+	if (!source || source == end)
+		return -1;
+	kvmsg_set_sequence (kvmsg, (int64_t) value);
+
+	//  A uuid is either absent or 16 bytes, as kvmsg_uuid expects
+	size = *source++;
+	if ((size != 0 && size != 16) || size > (uint64_t) (end - source))
+		return -1;
+	if (size)
+		s_set_frame (kvmsg, FRAME_UUID, source, (size_t) size);
+	source += size;
+
+	if (end - source < 5)
+		return -1;
+	kvmsg->flags = source [0];
+	kvmsg->cachehash = s_get_uint32 (source + 1);
+	source = s_get_varint (source + 5, end, &value);
+	if (!source)
+		return -1;
+	kvmsg->expiry = (int64_t) value;
+	kvmsg->header_dirty = TRUE;
+
+	source = s_get_varint (source, end, &size);
+	if (!source || size > (uint64_t) (end - source))
+		return -1;
+	if (size)
+		s_set_frame (kvmsg, FRAME_PROPS, source, (size_t) size);
+	source += size;
+
+	kvmsg->body_offset = source - data;
+	kvmsg->compact = TRUE;
+	return 0;
+}
+
+//  A pack arrives as the first frame too. We keep it as body frame and
+//  read the kvmsgs in it with kvmsg_batch_next. Returns -1 if the frame
+//  is not a pack:
+
+static int
+	s_decode_pack (kvmsg_t *kvmsg)
+{
+	zmq_msg_t *wire = &kvmsg->frame [FRAME_KEY];
+	if (zmq_msg_size (wire) == 0
+	||  *(byte *) zmq_msg_data (wire) != KVMSG_PACK_MAGIC)
+		return -1;
+
+	zmq_msg_init (&kvmsg->frame [FRAME_BODY]);
+	zmq_msg_move (&kvmsg->frame [FRAME_BODY], wire);
+	zmq_msg_close (wire);
+	kvmsg->present [FRAME_KEY] = 0;
+	kvmsg->present [FRAME_BODY] = 1;
+	kvmsg->body_offset = 1;
+	kvmsg->flags = KVMSG_FLAG_BATCH;
+	kvmsg->packed = TRUE;
+	kvmsg->compact = TRUE;
+	return 0;
+}
+
+//  A compact kvmsg sent on as frames needs a body frame of its own
+static void
+	s_detach_body (kvmsg_t *kvmsg)
+{
+	zmq_msg_t body;
+	size_t size = kvmsg_size (kvmsg);
+
+	zmq_msg_init_size (&body, size);
+	memcpy (zmq_msg_data (&body), kvmsg_body (kvmsg), size);
+	zmq_msg_move (&kvmsg->frame [FRAME_BODY], &body);
+	zmq_msg_close (&body);
+	kvmsg->body_offset = 0;
+}
+
 //  .split constructor and destructor
 //  Here are the constructor and destructor for the class:
 
@@ -121,7 +459,6 @@ kvmsg_t *
 	kvmsg_t	*kvmsg;
 
 	kvmsg = (kvmsg_t *) zmalloc (sizeof (kvmsg_t));
-	kvmsg->props = zlist_new ();
 	kvmsg_set_sequence (kvmsg, sequence);
 	return kvmsg;
 }
@@ -139,10 +476,12 @@ void
 			if (kvmsg->present [frame_nbr])
 				zmq_msg_close (&kvmsg->frame [frame_nbr]);
 
-		//  Destroy property list
-		while (zlist_size (kvmsg->props))
-			free (zlist_pop (kvmsg->props));
-		zlist_destroy (&kvmsg->props);
+		//  Destroy property list, if it was ever decoded
+		if (kvmsg->props) {
+			while (zlist_size (kvmsg->props))
+				free (zlist_pop (kvmsg->props));
+			zlist_destroy (&kvmsg->props);
+		}
 
 		//  Free object itself
 		free (kvmsg);
@@ -186,6 +525,17 @@ kvmsg_t *
 			kvmsg_destroy (&kvmsg);
 			break;
 		}
+		//  A single frame is a pack or a compact kvmsg
+		if (frame_nbr == 0 && !zsockopt_rcvmore (socket)) {
+			if (s_decode_pack (kvmsg) && s_decode_compact (kvmsg))
+				kvmsg_destroy (&kvmsg);
+			return kvmsg;
+		}
+		//  Five frames are a legacy kvmsg, with no header
+		if (frame_nbr == FRAME_BODY && !zsockopt_rcvmore (socket)) {
+			s_decode_legacy (kvmsg);
+			return kvmsg;
+		}
 		//  Verify multipart framing
 		rcvmore = (frame_nbr < KVMSG_FRAMES - 1)? 1: 0;
 		if (zsockopt_rcvmore (socket) != rcvmore) {
@@ -195,11 +545,54 @@ kvmsg_t *
 	}
 	//  .until
 	if (kvmsg)
-		s_decode_props (kvmsg);
+		s_decode_header (kvmsg);
 	return kvmsg;
 }
 
 
+//  ---------------------------------------------------------------------
+//  Reads key-value message that follows a topic frame. Subscribers that
+//  filter by topic get every message with one, see kvmsg_send_topic.
+
+kvmsg_t *
+	kvmsg_recv_topic (void *socket)
+{
+	zmq_msg_t topic;
+	int rcvmore;
+
+	assert (socket);
+	zmq_msg_init (&topic);
+	if (zmq_recvmsg (socket, &topic, 0) == -1) {
+		zmq_msg_close (&topic);
+		return NULL;
+	}
+	rcvmore = zsockopt_rcvmore (socket);
+	zmq_msg_close (&topic);
+	return rcvmore? kvmsg_recv (socket): NULL;
+}
+
+//  ---------------------------------------------------------------------
+//  Send topic frame "<cacheid>/<key>" ahead of a message, so that a PUB
+//  socket only sends it to the subscribers of that cache. Key may be
+//  NULL, for a pack that holds several keys of the cache.
+
+void
+	kvmsg_send_topic (void *socket, char *cacheidstr, char *key)
+{
+	zmq_msg_t topic;
+	size_t cacheid_size = strlen (cacheidstr);
+	size_t key_size = key? strlen (key): 0;
+
+	assert (socket);
+	zmq_msg_init_size (&topic, cacheid_size + 1 + key_size);
+	memcpy (zmq_msg_data (&topic), cacheidstr, cacheid_size);
+	((byte *) zmq_msg_data (&topic)) [cacheid_size] = '/';
+	if (key_size)
+		memcpy ((byte *) zmq_msg_data (&topic) + cacheid_size + 1, key, key_size);
+	zmq_sendmsg (socket, &topic, ZMQ_SNDMORE);
+	zmq_msg_close (&topic);
+}
+
 //  ---------------------------------------------------------------------
 //  Send key-value message to socket; any empty frames are sent as such.
 
@@ -210,7 +603,12 @@ void
 	assert (kvmsg);
 	assert (socket);
 
-	s_encode_props (kvmsg);
+	if (kvmsg->header_dirty || !kvmsg->present [FRAME_HEADER])
+		s_encode_header (kvmsg);
+	if (kvmsg->props_dirty)
+		s_encode_props (kvmsg);
+	if (kvmsg->body_offset)
+		s_detach_body (kvmsg);
 	//  The rest of the method is unchanged from kvsimple
 	//  .skip
 	for (frame_nbr = 0; frame_nbr < KVMSG_FRAMES; frame_nbr++) {
@@ -225,6 +623,178 @@ void
 }
 //  .until
 
+//  ---------------------------------------------------------------------
+//  Send key-value message to socket as the five frames peers read before
+//  the header. Its fields go ahead of the other properties, as they did:
+//  the cache by name, a ttl in seconds or an expiry in msecs, and ttld.
+
+void
+	kvmsg_send_legacy (kvmsg_t *kvmsg, void *socket, char *cacheidstr)
+{
+	int frame_nbr;
+	zmq_msg_t props;
+	char fields [64];
+	size_t fields_size;
+	size_t cacheid_size;
+	size_t props_size;
+	byte *dest;
+	assert (kvmsg);
+	assert (socket);
+
+	if (kvmsg->props_dirty)
+		s_encode_props (kvmsg);
+	if (kvmsg->body_offset)
+		s_detach_body (kvmsg);
+	fields_size = sprintf (fields, "ttl=%I64d\nttld=%d\n",
+		(kvmsg->flags & KVMSG_FLAG_TTL)? kvmsg->expiry / 1000: kvmsg->expiry,
+		(kvmsg->flags & KVMSG_FLAG_EXPIRED)? 1: 0);
+	cacheid_size = cacheidstr? strlen (cacheidstr): 0;
+	props_size = kvmsg->present [FRAME_PROPS]? zmq_msg_size (&kvmsg->frame [FRAME_PROPS]): 0;
+	zmq_msg_init_size (&props, 11 + cacheid_size + 1 + fields_size + props_size);
+	dest = (byte *) zmq_msg_data (&props);
+	memcpy (dest, "cacheidstr=", 11);
+	if (cacheid_size)
+		memcpy (dest + 11, cacheidstr, cacheid_size);
+	dest += 11 + cacheid_size;
+	*dest++ = '\n';
+	memcpy (dest, fields, fields_size);
+	if (props_size)
+		memcpy (dest + fields_size, zmq_msg_data (&kvmsg->frame [FRAME_PROPS]), props_size);
+
+	for (frame_nbr = 0; frame_nbr < FRAME_HEADER; frame_nbr++) {
+		zmq_msg_t copy;
+		zmq_msg_init (&copy);
+		if (frame_nbr == FRAME_PROPS)
+			zmq_msg_move (&copy, &props);
+		else if (kvmsg->present [frame_nbr])
+			zmq_msg_copy (&copy, &kvmsg->frame [frame_nbr]);
+		zmq_sendmsg (socket, &copy,
+			(frame_nbr < FRAME_HEADER - 1)? ZMQ_SNDMORE: 0);
+		zmq_msg_close (&copy);
+	}
+	zmq_msg_close (&props);
+}
+
+//  These two helpers size and write the compact encoding of a kvmsg:
+
+static size_t
+	s_compact_size (kvmsg_t *kvmsg)
+{
+	char *key;
+	size_t key_size;
+	size_t props_size;
+
+	if (kvmsg->props_dirty)
+		s_encode_props (kvmsg);
+	key = kvmsg_key (kvmsg);
+	key_size = key? strlen (key): 0;
+	props_size = kvmsg->present [FRAME_PROPS]? zmq_msg_size (&kvmsg->frame [FRAME_PROPS]): 0;
+	return 1 + s_varint_size (key_size) + key_size
+		+ s_varint_size ((uint64_t) kvmsg_sequence (kvmsg))
+		+ 1 + (kvmsg_uuid (kvmsg)? 16: 0)
+		+ 5 + s_varint_size ((uint64_t) kvmsg->expiry)
+		+ s_varint_size (props_size) + props_size
+		+ kvmsg_size (kvmsg);
+}
+
+static byte *
+	s_encode_compact (kvmsg_t *kvmsg, byte *dest)
+{
+	char *key = kvmsg_key (kvmsg);
+	size_t key_size = key? strlen (key): 0;
+	byte *uuid = kvmsg_uuid (kvmsg);
+	size_t props_size = kvmsg->present [FRAME_PROPS]? zmq_msg_size (&kvmsg->frame [FRAME_PROPS]): 0;
+	int64_t sequence = kvmsg_sequence (kvmsg);
+
+	*dest++ = KVMSG_COMPACT_MAGIC;
+	dest = s_put_varint (dest, key_size);
+	memcpy (dest, key, key_size);
+	dest += key_size;
+	dest = s_put_varint (dest, (uint64_t) sequence);
+	*dest++ = uuid? 16: 0;
+	if (uuid) {
+		memcpy (dest, uuid, 16);
+		dest += 16;
+	}
+	*dest++ = kvmsg->flags;
+	s_put_uint32 (dest, kvmsg->cachehash);
+	dest = s_put_varint (dest + 4, (uint64_t) kvmsg->expiry);
+	dest = s_put_varint (dest, props_size);
+	if (props_size) {
+		memcpy (dest, zmq_msg_data (&kvmsg->frame [FRAME_PROPS]), props_size);
+		dest += props_size;
+	}
+	memcpy (dest, kvmsg_body (kvmsg), kvmsg_size (kvmsg));
+	return dest + kvmsg_size (kvmsg);
+}
+
+//  ---------------------------------------------------------------------
+//  Send key-value message to socket as a single compact frame. Only
+//  peers that asked for compact kvmsgs can read it. Messages with a
+//  body over KVMSG_COMPACT_MAX are sent as frames, which every peer reads.
+
+void
+	kvmsg_send_compact (kvmsg_t *kvmsg, void *socket)
+{
+	zmq_msg_t msg;
+	assert (kvmsg);
+	assert (socket);
+
+	if (kvmsg_size (kvmsg) > KVMSG_COMPACT_MAX) {
+		kvmsg_send (kvmsg, socket);
+		return;
+	}
+	zmq_msg_init_size (&msg, s_compact_size (kvmsg));
+	s_encode_compact (kvmsg, (byte *) zmq_msg_data (&msg));
+	zmq_sendmsg (socket, &msg, 0);
+	zmq_msg_close (&msg);
+}
+
+//  ---------------------------------------------------------------------
+//  Return bytes kvmsg adds to a pack at most, or zero if it is too big
+//  to go in a pack, and has to be sent on its own.
+
+size_t
+	kvmsg_pack_size (kvmsg_t *kvmsg)
+{
+	size_t size;
+	assert (kvmsg);
+	if (kvmsg_size (kvmsg) > KVMSG_COMPACT_MAX)
+		return 0;
+	size = s_compact_size (kvmsg);
+	return 1 + s_varint_size (size) + size;
+}
+
+//  ---------------------------------------------------------------------
+//  Append kvmsg to pack, which holds size bytes and has room for
+//  kvmsg_pack_size more. Returns new size of pack.
+
+size_t
+	kvmsg_pack (kvmsg_t *kvmsg, byte *pack, size_t size)
+{
+	byte *dest;
+	size_t compact_size;
+	assert (kvmsg);
+	assert (pack);
+
+	if (size == 0)
+		pack [size++] = KVMSG_PACK_MAGIC;
+	compact_size = s_compact_size (kvmsg);
+	dest = s_put_varint (pack + size, compact_size);
+	dest = s_encode_compact (kvmsg, dest);
+	return dest - pack;
+}
+
+//  ---------------------------------------------------------------------
+//  Return TRUE if message was received as a single compact frame
+
+Bool
+	kvmsg_compact (kvmsg_t *kvmsg)
+{
+	assert (kvmsg);
+	return kvmsg->compact;
+}
+
 //  .split dup method
 //  The dup method duplicates a kvmsg instance, returns the new instance:
 
@@ -238,17 +808,29 @@ kvmsg_t *
 		if (kvmsg->present [frame_nbr]) {
 			zmq_msg_t *src = &kvmsg->frame [frame_nbr];
 			zmq_msg_t *dst = &dup->frame [frame_nbr];
+			if (dup->present [frame_nbr])
+				zmq_msg_close (dst);
 			zmq_msg_init_size (dst, zmq_msg_size (src));
 			memcpy (zmq_msg_data (dst),
 				zmq_msg_data (src), zmq_msg_size (src));
 			dup->present [frame_nbr] = 1;
 		}
 	}
-	dup->props_size = zlist_size (kvmsg->props);
-	prop = (char *) zlist_first (kvmsg->props);
-	while (prop) {
-		zlist_append (dup->props, strdup (prop));
-		prop = (char *) zlist_next (kvmsg->props);
+	dup->body_offset = kvmsg->body_offset;
+	dup->compact = kvmsg->compact;
+	dup->flags = kvmsg->flags;
+	dup->cachehash = kvmsg->cachehash;
+	dup->expiry = kvmsg->expiry;
+	dup->header_dirty = kvmsg->header_dirty;
+	if (kvmsg->props) {
+		dup->props = zlist_new ();
+		dup->props_size = kvmsg->props_size;
+		dup->props_dirty = kvmsg->props_dirty;
+		prop = (char *) zlist_first (kvmsg->props);
+		while (prop) {
+			zlist_append (dup->props, strdup (prop));
+			prop = (char *) zlist_next (kvmsg->props);
+		}
 	}
 	return dup;
 }
@@ -377,7 +959,7 @@ byte *
 {
 	assert (kvmsg);
 	if (kvmsg->present [FRAME_BODY])
-		return (byte *) zmq_msg_data (&kvmsg->frame [FRAME_BODY]);
+		return (byte *) zmq_msg_data (&kvmsg->frame [FRAME_BODY]) + kvmsg->body_offset;
 	else
 		return NULL;
 }
@@ -396,8 +978,36 @@ void
 	if (kvmsg->present [FRAME_BODY])
 		zmq_msg_close (msg);
 	kvmsg->present [FRAME_BODY] = 1;
+	kvmsg->body_offset = 0;
 	zmq_msg_init_size (msg, size);
 	memcpy (zmq_msg_data (msg), body, size);
+	if (size)
+		kvmsg_set_flags (kvmsg, kvmsg->flags & ~KVMSG_FLAG_DELETED);
+	else
+		kvmsg_set_flags (kvmsg, kvmsg->flags | KVMSG_FLAG_DELETED);
+}
+
+//  ---------------------------------------------------------------------
+//  Set message body to a buffer the message takes over, without copying
+//  it. free_fn is called with body and hint when the last copy of the
+//  message sent with it is done with the body.
+
+void
+	kvmsg_set_body_owned (kvmsg_t *kvmsg, byte *body, size_t size, zmq_free_fn *free_fn, void *hint)
+{
+	zmq_msg_t *msg;
+
+	assert (kvmsg);
+	msg = &kvmsg->frame [FRAME_BODY];
+	if (kvmsg->present [FRAME_BODY])
+		zmq_msg_close (msg);
+	kvmsg->present [FRAME_BODY] = 1;
+	kvmsg->body_offset = 0;
+	zmq_msg_init_data (msg, body, size, free_fn, hint);
+	if (size)
+		kvmsg_set_flags (kvmsg, kvmsg->flags & ~KVMSG_FLAG_DELETED);
+	else
+		kvmsg_set_flags (kvmsg, kvmsg->flags | KVMSG_FLAG_DELETED);
 }
 
 //  ---------------------------------------------------------------------
@@ -413,8 +1023,10 @@ void
 	if (kvmsg->present [FRAME_BODY])
 		zmq_msg_close (msg);
 	kvmsg->present [FRAME_BODY] = 0;
+	kvmsg->body_offset = 0;
 	zmq_msg_init_size (msg, 0);
 	memcpy (zmq_msg_data (msg), (byte *) "", 0);
+	kvmsg_set_flags (kvmsg, kvmsg->flags | KVMSG_FLAG_DELETED);
 }
 
 //  ---------------------------------------------------------------------
@@ -447,7 +1059,7 @@ size_t
 {
 	assert (kvmsg);
 	if (kvmsg->present [FRAME_BODY])
-		return zmq_msg_size (&kvmsg->frame [FRAME_BODY]);
+		return zmq_msg_size (&kvmsg->frame [FRAME_BODY]) - kvmsg->body_offset;
 	else
 		return 0;
 }
@@ -470,30 +1082,262 @@ byte *
 	}
 }
 
-//  Sets the UUID to a random generated value
+//  An update id must be unique across every client, and the passive
+//  server looks it up for each update it gets. So it is 8 bytes of node
+//  id, drawn once per process, then 8 bytes of a counter of the process,
+//  both in network order:
+
+static volatile int64_t s_uuid_node;
+static volatile int64_t s_uuid_counter;
+
+static uint64_t
+	s_uuid_mix (uint64_t value)
+{
+	value += 0x9E3779B97F4A7C15ULL;
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+	return value ^ (value >> 31);
+}
+
+static int64_t
+	s_uuid_node_id (void)
+{
+	if (!s_uuid_node) {
+		LARGE_INTEGER ticks;
+		uint64_t node;
+		QueryPerformanceCounter (&ticks);
+		node = s_uuid_mix ((uint64_t) GetCurrentProcessId ());
+		node = s_uuid_mix (node ^ (uint64_t) zclock_time ());
+		node = s_uuid_mix (node ^ (uint64_t) ticks.QuadPart);
+		node = s_uuid_mix (node ^ (uint64_t) (size_t) &ticks);
+		//  Threads racing here all keep the first node id set
+		InterlockedCompareExchange64 (&s_uuid_node, (int64_t) (node | 1), 0);
+	}
+	return s_uuid_node;
+}
+
+//  Sets the UUID to a newly generated value
 void
 	kvmsg_set_uuid (kvmsg_t *kvmsg)
 {
-	zmq_msg_t *msg;     
-	int randm_uuid_high, randm_uuid_ligh;     // pour remplacer le uuid et uuid-generte() on va gnrer un chiffre alatoire avec la fonction randof(100000000) un nombre de neuf chiffre
-	char uniqueid[16] ; // Cet atribut fait appelle  la librairie <uuid.h> qui ne peut pas tre compil sous windows 
-					 // La fonction uuid_generate (uuid) va gnrere un ID unique en alatoire en 16 octets pour le passer au paramtre uuid
+	zmq_msg_t *msg;
+	byte *uuid;
 
 	assert (kvmsg);
 	msg = &kvmsg->frame [FRAME_UUID];
+	if (kvmsg->present [FRAME_UUID])
+		zmq_msg_close (msg);
+	zmq_msg_init_size (msg, 16);
+	uuid = (byte *) zmq_msg_data (msg);
+	s_put_uint64 (uuid, (uint64_t) s_uuid_node_id ());
+	s_put_uint64 (uuid + 8, (uint64_t) InterlockedIncrement64 (&s_uuid_counter));
+	kvmsg->present [FRAME_UUID] = 1;
+}
+
+//  .split header methods
+//  These methods get/set the typed header fields of the message:
+
+//  Return cache hash of message, zero if none
+uint
+	kvmsg_cachehash (kvmsg_t *kvmsg)
+{
+	assert (kvmsg);
+	return kvmsg->cachehash;
+}
+
+//  Set cache hash of message, see kvmsg_hash_cacheid
+void
+	kvmsg_set_cachehash (kvmsg_t *kvmsg, uint cachehash)
+{
+	assert (kvmsg);
+	kvmsg->cachehash = cachehash;
+	kvmsg->header_dirty = TRUE;
+}
+
+//  Caches are named by strings in the configuration, and by a 32-bit
+//  FNV-1a hash of that name on the wire. Never returns zero, which
+//  means no cache:
+uint
+	kvmsg_hash_cacheid (char *cacheidstr)
+{
+	uint hash = 2166136261u;
+	assert (cacheidstr);
+	while (*cacheidstr) {
+		hash ^= (byte) *cacheidstr++;
+		hash *= 16777619u;
+	}
+	return hash? hash: 1;
+}
 
-	//uuid_generate (uuid);
-	randm_uuid_high= randof(10000000) ;
-	randm_uuid_ligh= randof(10000000) ; 
-	sprintf(uniqueid, "%i%i", randm_uuid_high, randm_uuid_ligh) ;  // converion de randm_uuid en char
+//  Return expiry of message in msecs, zero if none. If KVMSG_FLAG_TTL
+//  is set this is a time to live, not yet an absolute time.
+int64_t
+	kvmsg_expiry (kvmsg_t *kvmsg)
+{
+	assert (kvmsg);
+	return kvmsg->expiry;
+}
 
+//  Set absolute expiry of message in msecs, zero for none
+void
+	kvmsg_set_expiry (kvmsg_t *kvmsg, int64_t expiry)
+{
+	assert (kvmsg);
+	kvmsg->expiry = expiry;
+	kvmsg->flags &= ~KVMSG_FLAG_TTL;
+	kvmsg->header_dirty = TRUE;
+}
+
+//  Set time to live of message in msecs, zero for none. The server
+//  turns it into an absolute expiry when the update reaches it.
+void
+	kvmsg_set_ttl (kvmsg_t *kvmsg, int64_t ttl)
+{
+	assert (kvmsg);
+	kvmsg->expiry = ttl;
+	if (ttl)
+		kvmsg->flags |= KVMSG_FLAG_TTL;
+	else
+		kvmsg->flags &= ~KVMSG_FLAG_TTL;
+	kvmsg->header_dirty = TRUE;
+}
+
+//  Return flags of message
+byte
+	kvmsg_flags (kvmsg_t *kvmsg)
+{
+	assert (kvmsg);
+	return kvmsg->flags;
+}
+
+//  Set flags of message
+void
+	kvmsg_set_flags (kvmsg_t *kvmsg, byte flags)
+{
+	assert (kvmsg);
+	kvmsg->flags = flags;
+	kvmsg->header_dirty = TRUE;
+}
+
+//  .split batch methods
+//  A batch carries many updates of one cache in one message, so a bulk
+//  writer pays the per-message cost once. Its body is, for each update:
+//  varint: key size, key, varint: value size, value. The updates share
+//  the cache hash, flags and expiry of the batch. Each gets its own
+//  uuid: that of the batch holds the first of a range of counter values
+//  reserved for the batch, and update n takes the n'th value.
+
+//  Set body to a batch of count updates; an empty value deletes its key
+void
+	kvmsg_set_batch (kvmsg_t *kvmsg, char **keys, byte **values, size_t *sizes, size_t count)
+{
+	size_t index;
+	size_t size = 0;
+	byte *dest;
+	byte *uuid;
+	zmq_msg_t *msg;
+
+	assert (kvmsg);
+	assert (keys || !count);
+	for (index = 0; index < count; index++) {
+		size_t key_size = strlen (keys [index]);
+		size += s_varint_size (key_size) + key_size
+			+ s_varint_size (sizes [index]) + sizes [index];
+	}
+	msg = &kvmsg->frame [FRAME_BODY];
+	if (kvmsg->present [FRAME_BODY])
+		zmq_msg_close (msg);
+	zmq_msg_init_size (msg, size);
+	kvmsg->present [FRAME_BODY] = 1;
+	kvmsg->body_offset = 0;
+	dest = (byte *) zmq_msg_data (msg);
+	for (index = 0; index < count; index++) {
+		size_t key_size = strlen (keys [index]);
+		dest = s_put_varint (dest, key_size);
+		memcpy (dest, keys [index], key_size);
+		dest = s_put_varint (dest + key_size, sizes [index]);
+		if (sizes [index])
+			memcpy (dest, values [index], sizes [index]);
+		dest += sizes [index];
+	}
+	kvmsg_set_flags (kvmsg, (kvmsg->flags | KVMSG_FLAG_BATCH) & ~KVMSG_FLAG_DELETED);
+	kvmsg->batch_cursor = 0;
+	kvmsg->batch_index = 0;
+
+	msg = &kvmsg->frame [FRAME_UUID];
 	if (kvmsg->present [FRAME_UUID])
 		zmq_msg_close (msg);
-	zmq_msg_init_size (msg, sizeof (uniqueid));
-	memcpy (zmq_msg_data (msg), uniqueid, sizeof (uniqueid));
+	zmq_msg_init_size (msg, 16);
+	uuid = (byte *) zmq_msg_data (msg);
+	s_put_uint64 (uuid, (uint64_t) s_uuid_node_id ());
+	s_put_uint64 (uuid + 8, (uint64_t) InterlockedExchangeAdd64 (&s_uuid_counter, (int64_t) count) + 1);
 	kvmsg->present [FRAME_UUID] = 1;
 }
 
+//  Return next update of a batch or of a pack as a new kvmsg, or NULL at
+//  the end of it, or if the rest of it is not valid
+kvmsg_t *
+	kvmsg_batch_next (kvmsg_t *kvmsg)
+{
+	uint64_t key_size;
+	uint64_t size;
+	byte *body;
+	byte *source;
+	byte *end;
+	byte *uuid;
+	char key [KVMSG_KEY_MAX + 1];
+	kvmsg_t *update;
+
+	assert (kvmsg);
+	if (!(kvmsg->flags & KVMSG_FLAG_BATCH) || !kvmsg->present [FRAME_BODY])
+		return NULL;
+	body = kvmsg_body (kvmsg);
+	source = body + kvmsg->batch_cursor;
+	end = body + kvmsg_size (kvmsg);
+	if (source >= end)
+		return NULL;
+	if (kvmsg->packed) {
+		//  Each kvmsg of a pack is complete, and decoded as received
+		source = s_get_varint (source, end, &size);
+		if (!source || size > (uint64_t) (end - source))
+			return NULL;
+		update = kvmsg_new (0);
+		s_set_frame (update, FRAME_KEY, source, (size_t) size);
+		if (s_decode_compact (update)) {
+			kvmsg_destroy (&update);
+			return NULL;
+		}
+		kvmsg->batch_cursor = (source + size) - body;
+		kvmsg->batch_index++;
+		return update;
+	}
+	source = s_get_varint (source, end, &key_size);
+	if (!source || key_size > KVMSG_KEY_MAX || key_size > (uint64_t) (end - source))
+		return NULL;
+	memcpy (key, source, (size_t) key_size);
+	key [key_size] = 0;
+	source = s_get_varint (source + key_size, end, &size);
+	if (!source || size > (uint64_t) (end - source))
+		return NULL;
+
+	update = kvmsg_new (kvmsg_sequence (kvmsg));
+	kvmsg_set_key  (update, key);
+	kvmsg_set_cachehash (update, kvmsg->cachehash);
+	update->expiry = kvmsg->expiry;
+	kvmsg_set_flags (update, kvmsg->flags & ~KVMSG_FLAG_BATCH);
+	kvmsg_set_body (update, source, (size_t) size);
+	uuid = kvmsg_uuid (kvmsg);
+	if (uuid) {
+		byte update_uuid [16];
+		memcpy (update_uuid, uuid, 8);
+		s_put_uint64 (update_uuid + 8, s_get_uint64 (uuid + 8) + kvmsg->batch_index);
+		s_set_frame (update, FRAME_UUID, update_uuid, 16);
+	}
+	kvmsg->batch_cursor = (source + size) - body;
+	kvmsg->batch_index++;
+	return update;
+}
+
 //  .split property methods
 //  These methods get/set a specified message property:
 
@@ -505,6 +1349,8 @@ char *
 	size_t namelen;
 
 	assert (strchr (name, '=') == NULL);
+	if (!kvmsg->props)
+		s_decode_props (kvmsg);
 	prop = (char *) zlist_first (kvmsg->props);
 	namelen = strlen (name);
 	while (prop) {
@@ -539,6 +1385,8 @@ void
 	vsprintf_s( value, len, format, args );
 	va_end (args);
 	
+	if (!kvmsg->props)
+		s_decode_props (kvmsg);
 	//  Allocate name=value string
 	prop = (char *) malloc (strlen (name) + strlen (value) + 2);
 
@@ -558,6 +1406,7 @@ void
 	strcat (prop, value);
 	zlist_append (kvmsg->props, prop);
 	kvmsg->props_size += strlen (prop) + 1;
+	kvmsg->props_dirty = TRUE;
 	free(value);
 }
 
@@ -611,6 +1460,9 @@ void
 		zclock_log("[key:%s]", kvmsg_key (kvmsg));
 		//  .until
 		zclock_log("[size:%zd] ", size);
+		zclock_log("[flags:%02X cache:%08X expiry:%I64d]", kvmsg->flags, kvmsg->cachehash, kvmsg->expiry);
+		if (!kvmsg->props)
+			s_decode_props (kvmsg);
 		if (zlist_size (kvmsg->props)) {
 			zclock_log("[");
 			prop = (char *) zlist_first (kvmsg->props);
@@ -630,9 +1482,19 @@ void
 }
 //  .until
 
+//  Free function for owned bodies in the selftest
+static int s_test_freed;
+
+static void
+	s_test_free (void *data, void *hint)
+{
+	free (data);
+	s_test_freed++;
+}
+
 //  .split test method
 //  The selftest method is the same as in kvsimple with added support
-//  for the uuid and property features of kvmsg:
+//  for the uuid, header, and property features of kvmsg:
 
 int
 	kvmsg_test (int verbose)
@@ -695,12 +1557,346 @@ int
 	assert (streq (kvmsg_key (kvmsg), "key"));
 	assert (streq (kvmsg_get_prop (kvmsg, "prop2"), "value2"));
 	kvmsg_destroy (&kvmsg);
+
+	//  Test send and receive of header fields, and of a copy of a
+	//  received message that still has its properties undecoded
+	kvmsg = kvmsg_new (3);
+	kvmsg_set_key  (kvmsg, "key");
+	kvmsg_set_cachehash (kvmsg, kvmsg_hash_cacheid ("cache"));
+	kvmsg_set_ttl  (kvmsg, 5000);
+	kvmsg_set_prop (kvmsg, "prop1", "value1");
+	kvmsg_set_body (kvmsg, (byte *) "", 0);
+	assert (kvmsg_flags (kvmsg) == (KVMSG_FLAG_TTL | KVMSG_FLAG_DELETED));
+	kvmsg_send (kvmsg, output);
+	kvmsg_destroy (&kvmsg);
+
+	kvmsg = kvmsg_recv (input);
+	assert (kvmsg_cachehash (kvmsg) == kvmsg_hash_cacheid ("cache"));
+	assert (kvmsg_cachehash (kvmsg) != kvmsg_hash_cacheid ("cache2"));
+	assert (kvmsg_expiry (kvmsg) == 5000);
+	assert (kvmsg_flags (kvmsg) & KVMSG_FLAG_DELETED);
+	kvmsg_set_expiry (kvmsg, (int64_t) 1 << 40);
+	assert (!(kvmsg_flags (kvmsg) & KVMSG_FLAG_TTL));
+	{
+		kvmsg_t *copy = kvmsg_dup (kvmsg);
+		kvmsg_send (copy, output);
+		kvmsg_destroy (&copy);
+	}
+	kvmsg_destroy (&kvmsg);
+
+	kvmsg = kvmsg_recv (input);
+	assert (kvmsg_sequence (kvmsg) == 3);
+	assert (kvmsg_expiry (kvmsg) == (int64_t) 1 << 40);
+	assert (kvmsg_flags (kvmsg) == KVMSG_FLAG_DELETED);
+	assert (streq (kvmsg_get_prop (kvmsg, "prop1"), "value1"));
+	assert (streq (kvmsg_get_prop (kvmsg, "prop2"), ""));
+	kvmsg_destroy (&kvmsg);
+
+	//  Test receive of baseline messages, of five frames with the header
+	//  fields as properties, as peers that predate the header send them:
+	//  a set from a client, with a ttl in seconds, then an expiry from a
+	//  server, with an absolute ttl in msecs. Then send the first back in
+	//  legacy frames, which must read the same
+	{
+		char *props [] = {
+			"cacheidstr=cache\nttl=5\nprop1=value1\n",
+			"cacheidstr=cache\nttl=1700000000000\nttld=1\n" };
+		char *bodies [] = { "body", "" };
+		byte sequence [8] = { 0, 0, 0, 0, 0, 0, 0, 4 };
+		byte uuid [16] = { 0 };
+		int msg_nbr;
+		for (msg_nbr = 0; msg_nbr < 2; msg_nbr++) {
+			zmq_send (output, "key", 3, ZMQ_SNDMORE);
+			zmq_send (output, sequence, 8, ZMQ_SNDMORE);
+			zmq_send (output, uuid, 16, ZMQ_SNDMORE);
+			zmq_send (output, props [msg_nbr], strlen (props [msg_nbr]), ZMQ_SNDMORE);
+			zmq_send (output, bodies [msg_nbr], strlen (bodies [msg_nbr]), 0);
+		}
+	}
+	kvmsg = kvmsg_recv (input);
+	assert (kvmsg);
+	assert (!kvmsg_compact (kvmsg));
+	assert (streq (kvmsg_key (kvmsg), "key"));
+	assert (kvmsg_sequence (kvmsg) == 4);
+	assert (kvmsg_cachehash (kvmsg) == kvmsg_hash_cacheid ("cache"));
+	assert (kvmsg_expiry (kvmsg) == 5000);
+	assert (kvmsg_flags (kvmsg) == KVMSG_FLAG_TTL);
+	assert (streq (kvmsg_get_prop (kvmsg, "prop1"), "value1"));
+	assert (streq (kvmsg_get_prop (kvmsg, "cacheidstr"), ""));
+	assert (kvmsg_size (kvmsg) == 4);
+	assert (memcmp (kvmsg_body (kvmsg), "body", 4) == 0);
+	kvmsg_send_legacy (kvmsg, output, "cache");
+	kvmsg_destroy (&kvmsg);
+
+	kvmsg = kvmsg_recv (input);
+	assert (kvmsg);
+	assert (streq (kvmsg_key (kvmsg), "key"));
+	assert (kvmsg_cachehash (kvmsg) == kvmsg_hash_cacheid ("cache"));
+	assert (kvmsg_expiry (kvmsg) == (int64_t) 1700000000 * 1000);
+	assert (kvmsg_flags (kvmsg) == (KVMSG_FLAG_EXPIRED | KVMSG_FLAG_DELETED));
+	assert (kvmsg_size (kvmsg) == 0);
+	kvmsg_destroy (&kvmsg);
+
+	kvmsg = kvmsg_recv (input);
+	assert (kvmsg);
+	assert (kvmsg_sequence (kvmsg) == 4);
+	assert (kvmsg_cachehash (kvmsg) == kvmsg_hash_cacheid ("cache"));
+	assert (kvmsg_expiry (kvmsg) == 5000);
+	assert (kvmsg_flags (kvmsg) == KVMSG_FLAG_TTL);
+	assert (streq (kvmsg_get_prop (kvmsg, "prop1"), "value1"));
+	assert (streq (kvmsg_get_prop (kvmsg, "ttl"), ""));
+	assert (memcmp (kvmsg_body (kvmsg), "body", 4) == 0);
+	kvmsg_destroy (&kvmsg);
+
+	//  Test send and receive of compact message, and sending it on in
+	//  both encodings
+	kvmsg = kvmsg_new (300);
+	kvmsg_set_key  (kvmsg, "key");
+	kvmsg_set_uuid (kvmsg);
+	kvmsg_set_cachehash (kvmsg, kvmsg_hash_cacheid ("cache"));
+	kvmsg_set_expiry (kvmsg, 200000);
+	kvmsg_set_prop (kvmsg, "prop1", "value1");
+	kvmsg_set_body (kvmsg, (byte *) "body", 4);
+	kvmsg_send_compact (kvmsg, output);
+	kvmsg_destroy (&kvmsg);
+
+	kvmsg = kvmsg_recv (input);
+	assert (kvmsg_compact (kvmsg));
+	assert (streq (kvmsg_key (kvmsg), "key"));
+	assert (kvmsg_sequence (kvmsg) == 300);
+	assert (kvmsg_uuid (kvmsg));
+	assert (kvmsg_cachehash (kvmsg) == kvmsg_hash_cacheid ("cache"));
+	assert (kvmsg_expiry (kvmsg) == 200000);
+	assert (kvmsg_flags (kvmsg) == 0);
+	assert (streq (kvmsg_get_prop (kvmsg, "prop1"), "value1"));
+	assert (kvmsg_size (kvmsg) == 4);
+	assert (memcmp (kvmsg_body (kvmsg), "body", 4) == 0);
+	kvmsg_send_compact (kvmsg, output);
+	kvmsg_send (kvmsg, output);
+	kvmsg_destroy (&kvmsg);
+	kvmsg = kvmsg_recv (input);
+	assert (kvmsg_compact (kvmsg));
+	assert (memcmp (kvmsg_body (kvmsg), "body", 4) == 0);
+	kvmsg_destroy (&kvmsg);
+	kvmsg = kvmsg_recv (input);
+	assert (!kvmsg_compact (kvmsg));
+	assert (kvmsg_sequence (kvmsg) == 300);
+	assert (kvmsg_expiry (kvmsg) == 200000);
+	assert (kvmsg_size (kvmsg) == 4);
+	assert (memcmp (kvmsg_body (kvmsg), "body", 4) == 0);
+	kvmsg_destroy (&kvmsg);
+
+	//  Test owned body, sent without copying it, and as frames even
+	//  when compact was asked for, since it is large
+	{
+		byte *buffer = (byte *) malloc (KVMSG_COMPACT_MAX + 1);
+		memset (buffer, 'x', KVMSG_COMPACT_MAX + 1);
+		kvmsg = kvmsg_new (301);
+		kvmsg_set_key  (kvmsg, "key");
+		kvmsg_set_body_owned (kvmsg, buffer, KVMSG_COMPACT_MAX + 1, s_test_free, NULL);
+		assert (kvmsg_body (kvmsg) == buffer);
+		kvmsg_send_compact (kvmsg, output);
+		kvmsg_destroy (&kvmsg);
+		kvmsg = kvmsg_recv (input);
+		assert (!kvmsg_compact (kvmsg));
+		assert (kvmsg_size (kvmsg) == KVMSG_COMPACT_MAX + 1);
+		assert (kvmsg_body (kvmsg) [KVMSG_COMPACT_MAX] == 'x');
+		kvmsg_destroy (&kvmsg);
+	}
+
+	//  Test binary body, with nulls, keeps its exact size in both
+	//  encodings
+	kvmsg = kvmsg_new (302);
+	kvmsg_set_key  (kvmsg, "key");
+	kvmsg_set_body (kvmsg, (byte *) "\0b\0d\0", 5);
+	kvmsg_send_compact (kvmsg, output);
+	kvmsg_send (kvmsg, output);
+	kvmsg_destroy (&kvmsg);
+	kvmsg = kvmsg_recv (input);
+	assert (kvmsg_compact (kvmsg));
+	assert (kvmsg_size (kvmsg) == 5);
+	assert (memcmp (kvmsg_body (kvmsg), "\0b\0d\0", 5) == 0);
+	kvmsg_destroy (&kvmsg);
+	kvmsg = kvmsg_recv (input);
+	assert (!kvmsg_compact (kvmsg));
+	assert (kvmsg_size (kvmsg) == 5);
+	assert (memcmp (kvmsg_body (kvmsg), "\0b\0d\0", 5) == 0);
+	kvmsg_destroy (&kvmsg);
+
+	//  Test batch, split back into its updates on the other side, each
+	//  with its own uuid
+	{
+		char *keys [] = { "key1", "key2", "key3" };
+		byte *values [] = { (byte *) "value1", (byte *) "", (byte *) "\0b\0" };
+		size_t sizes [] = { 6, 0, 3 };
+		byte uuid [16];
+		int copy_nbr;
+		kvmsg = kvmsg_new (0);
+		kvmsg_set_key  (kvmsg, "MSET");
+		kvmsg_set_cachehash (kvmsg, kvmsg_hash_cacheid ("cache"));
+		kvmsg_set_ttl (kvmsg, 5000);
+		kvmsg_set_batch (kvmsg, keys, values, sizes, 3);
+		memcpy (uuid, kvmsg_uuid (kvmsg), 16);
+		kvmsg_send_compact (kvmsg, output);
+		kvmsg_send (kvmsg, output);
+		kvmsg_destroy (&kvmsg);
+		for (copy_nbr = 0; copy_nbr < 2; copy_nbr++) {
+			kvmsg_t *update;
+			int update_nbr = 0;
+			kvmsg = kvmsg_recv (input);
+			assert (kvmsg_flags (kvmsg) & KVMSG_FLAG_BATCH);
+			while ((update = kvmsg_batch_next (kvmsg)) != NULL) {
+				assert (streq (kvmsg_key (update), keys [update_nbr]));
+				assert (kvmsg_size (update) == sizes [update_nbr]);
+				assert (memcmp (kvmsg_body (update), values [update_nbr], sizes [update_nbr]) == 0);
+				assert (kvmsg_cachehash (update) == kvmsg_hash_cacheid ("cache"));
+				assert (kvmsg_expiry (update) == 5000);
+				assert (kvmsg_flags (update) & KVMSG_FLAG_TTL);
+				assert (!(kvmsg_flags (update) & KVMSG_FLAG_BATCH));
+				assert (!(kvmsg_flags (update) & KVMSG_FLAG_DELETED) == (sizes [update_nbr] != 0));
+				assert (memcmp (kvmsg_uuid (update), uuid, 8) == 0);
+				assert (s_get_uint64 (kvmsg_uuid (update) + 8) == s_get_uint64 (uuid + 8) + update_nbr);
+				kvmsg_destroy (&update);
+				update_nbr++;
+			}
+			assert (update_nbr == 3);
+			kvmsg_destroy (&kvmsg);
+		}
+		//  The range is reserved, so the next uuid is past it
+		kvmsg = kvmsg_new (0);
+		kvmsg_set_uuid (kvmsg);
+		assert (s_get_uint64 (kvmsg_uuid (kvmsg) + 8) == s_get_uint64 (uuid + 8) + 3);
+		kvmsg_destroy (&kvmsg);
+	}
+
+	//  Test pack of kvmsgs sent as one frame, read back one by one
+	{
+		byte pack [256];
+		size_t size = 0;
+		int64_t sequence;
+		kvmsg_t *update;
+		for (sequence = 1; sequence <= 3; sequence++) {
+			kvmsg = kvmsg_new (sequence);
+			kvmsg_set_key  (kvmsg, "key");
+			kvmsg_set_uuid (kvmsg);
+			kvmsg_set_cachehash (kvmsg, kvmsg_hash_cacheid ("cache"));
+			kvmsg_set_expiry (kvmsg, 1000 * sequence);
+			kvmsg_set_body (kvmsg, (byte *) "body", (size_t) sequence);
+			assert (size + kvmsg_pack_size (kvmsg) <= sizeof (pack));
+			size = kvmsg_pack (kvmsg, pack, size);
+			kvmsg_destroy (&kvmsg);
+		}
+		zmq_send (output, pack, size, 0);
+		kvmsg = kvmsg_recv (input);
+		assert (kvmsg_flags (kvmsg) & KVMSG_FLAG_BATCH);
+		for (sequence = 1; sequence <= 3; sequence++) {
+			update = kvmsg_batch_next (kvmsg);
+			assert (update);
+			assert (streq (kvmsg_key (update), "key"));
+			assert (kvmsg_sequence (update) == sequence);
+			assert (kvmsg_uuid (update));
+			assert (kvmsg_cachehash (update) == kvmsg_hash_cacheid ("cache"));
+			assert (kvmsg_expiry (update) == 1000 * sequence);
+			assert (kvmsg_size (update) == (size_t) sequence);
+			assert (memcmp (kvmsg_body (update), "body", (size_t) sequence) == 0);
+			kvmsg_destroy (&update);
+		}
+		assert (kvmsg_batch_next (kvmsg) == NULL);
+		kvmsg_destroy (&kvmsg);
+	}
+
+	//  Test message behind a topic, in both encodings
+	kvmsg = kvmsg_new (303);
+	kvmsg_set_key  (kvmsg, "key");
+	kvmsg_set_body (kvmsg, (byte *) "body", 4);
+	kvmsg_send_topic (output, "cache", kvmsg_key (kvmsg));
+	kvmsg_send (kvmsg, output);
+	kvmsg_send_topic (output, "cache", NULL);
+	kvmsg_send_compact (kvmsg, output);
+	kvmsg_destroy (&kvmsg);
+	kvmsg = kvmsg_recv_topic (input);
+	assert (!kvmsg_compact (kvmsg));
+	assert (kvmsg_sequence (kvmsg) == 303);
+	assert (streq (kvmsg_key (kvmsg), "key"));
+	kvmsg_destroy (&kvmsg);
+	kvmsg = kvmsg_recv_topic (input);
+	assert (kvmsg_compact (kvmsg));
+	assert (memcmp (kvmsg_body (kvmsg), "body", 4) == 0);
+	kvmsg_destroy (&kvmsg);
+
+	//  A single frame that is not a compact kvmsg is rejected
+	zstr_send (output, "bogus");
+	kvmsg = kvmsg_recv (input);
+	assert (kvmsg == NULL);
+	{
+		//  So is a compact kvmsg whose uuid is not 16 bytes
+		byte wire [] = { KVMSG_COMPACT_MAGIC, 1, 'k', 1, 3, 'u', 'i', 'd', 0, 0, 0, 0, 1, 0, 0 };
+		zmq_send (output, wire, sizeof (wire), 0);
+		kvmsg = kvmsg_recv (input);
+		assert (kvmsg == NULL);
+	}
 	//  .skip
 	//  Shutdown and destroy all objects
 	zhash_destroy (&kvmap);
 	zctx_destroy (&ctx);
+	//  0MQ releases the owned body once it is done sending it
+	assert (s_test_freed == 1);
 
 	printf ("OK\n");
 	return 0;
 }
 //  .until
+
+//  .split benchmark
+//  Compares the two wire encodings: sends nbr_msgs updates like those
+//  clients send through an inproc pipe, and reads each one back, so
+//  both encoding and decoding are timed:
+
+static int64_t
+	s_bench_wire (void *output, void *input, size_t nbr_msgs, Bool compact)
+{
+	size_t index;
+	byte body [64];
+	int64_t start = zclock_time ();
+
+	memset (body, 'x', sizeof (body));
+	for (index = 0; index < nbr_msgs; index++) {
+		kvmsg_t *kvmsg = kvmsg_new (index + 1);
+		kvmsg_fmt_key  (kvmsg, "bench-%Iu", index);
+		kvmsg_set_uuid (kvmsg);
+		kvmsg_set_cachehash (kvmsg, 1);
+		kvmsg_set_ttl  (kvmsg, 60000);
+		kvmsg_set_body (kvmsg, body, sizeof (body));
+		if (compact)
+			kvmsg_send_compact (kvmsg, output);
+		else
+			kvmsg_send (kvmsg, output);
+		kvmsg_destroy (&kvmsg);
+
+		kvmsg = kvmsg_recv (input);
+		assert (kvmsg && kvmsg_sequence (kvmsg) == (int64_t) index + 1);
+		assert (kvmsg_size (kvmsg) == sizeof (body));
+		kvmsg_destroy (&kvmsg);
+	}
+	return zclock_time () - start;
+}
+
+int
+	kvmsg_bench (size_t nbr_msgs)
+{
+	int64_t frames_time, compact_time;
+	zctx_t *ctx = zctx_new ();
+	void *output = zsocket_new (ctx, ZMQ_PAIR);
+	void *input = zsocket_new (ctx, ZMQ_PAIR);
+	int rc = zmq_bind (output, "inproc://kvmsg_bench");
+	assert (rc == 0);
+	rc = zmq_connect (input, "inproc://kvmsg_bench");
+	assert (rc == 0);
+
+	printf (" * kvmsg bench: %Iu messages\n", nbr_msgs);
+	frames_time = s_bench_wire (output, input, nbr_msgs, FALSE);
+	compact_time = s_bench_wire (output, input, nbr_msgs, TRUE);
+	printf ("   frames: %I64d msecs, compact: %I64d msecs\n", frames_time, compact_time);
+	zctx_destroy (&ctx);
+	return 0;
+}
@@ -31,6 +31,28 @@ License along with this program. If not, see
 
 #include "czmq.h"
 
+//  Keys are short strings
+#define KVMSG_KEY_MAX   255
+
+//  Header flags
+#define KVMSG_FLAG_DELETED  1   //  Update has no body, so deletes its key
+#define KVMSG_FLAG_EXPIRED  2   //  Delete was made by TTL expiry
+#define KVMSG_FLAG_TTL      4   //  Expiry is still a time to live
+#define KVMSG_FLAG_BATCH    8   //  Body holds many updates, see kvmsg_set_batch
+
+//  Snapshot request of peers that read compact kvmsgs. The answer is
+//  compact too, so they know the server reads compact kvmsgs as well.
+//  Older servers answer it as a GETSNAPSHOT, with frames.
+#define KVMSG_GETSNAPSHOT_COMPACT  "GETSNAPSHOT2"
+//  Request of clients that hold a cache up to some sequence, for the
+//  updates they missed: [GETSINCE][cacheid][sequence][epoch]. The epoch
+//  is the "epoch" property of the BEGINMEMCACHE or BEGINSINCE the client
+//  got its sequence from, as sequences are only comparable within one.
+//  The answer is compact, and is BEGINSINCE, the updates, then
+//  ENDSNAPSHOT; or the snapshot of the cache when the server no longer
+//  has them all, or cannot tell.
+#define KVMSG_GETSINCE  "GETSINCE"
+
 //  Opaque class structure
 typedef struct _kvmsg kvmsg_t;
 
@@ -51,9 +73,35 @@ _EXPORTS_API kvmsg_t *
 //  Reads key-value message from socket, returns new kvmsg instance.
 _EXPORTS_API kvmsg_t *
     kvmsg_recv (void *socket);
+//  Reads key-value message that follows a topic frame
+_EXPORTS_API kvmsg_t *
+    kvmsg_recv_topic (void *socket);
+//  Send topic frame "<cacheid>/<key>" ahead of a message, so subscribers
+//  can filter by cache; key may be NULL
+_EXPORTS_API void
+    kvmsg_send_topic (void *socket, char *cacheidstr, char *key);
 //  Send key-value message to socket; any empty frames are sent as such.
 _EXPORTS_API void
     kvmsg_send (kvmsg_t *kvmsg, void *socket);
+//  Send key-value message to socket as the five frames of peers that
+//  predate the header, naming its cache cacheidstr; kvmsg_recv reads it
+_EXPORTS_API void
+    kvmsg_send_legacy (kvmsg_t *kvmsg, void *socket, char *cacheidstr);
+//  Send key-value message to socket as a single compact frame. Only
+//  peers that asked for it can read it; kvmsg_recv reads both.
+_EXPORTS_API void
+    kvmsg_send_compact (kvmsg_t *kvmsg, void *socket);
+//  Return TRUE if message was received as a single compact frame
+_EXPORTS_API Bool
+    kvmsg_compact (kvmsg_t *kvmsg);
+//  Return bytes kvmsg adds to a pack at most, zero if it can't go in one
+_EXPORTS_API size_t
+    kvmsg_pack_size (kvmsg_t *kvmsg);
+//  Append kvmsg to a pack of size bytes, return new size. A pack is
+//  sent as a single frame, and read with kvmsg_recv, which returns it
+//  flagged KVMSG_FLAG_BATCH, and kvmsg_batch_next.
+_EXPORTS_API size_t
+    kvmsg_pack (kvmsg_t *kvmsg, byte *pack, size_t size);
 
 //  Return key from last read message, if any, else NULL
 _EXPORTS_API char *
@@ -86,6 +134,10 @@ _EXPORTS_API void
 //  Del message body
 _EXPORTS_API void
     kvmsg_set_body (kvmsg_t *kvmsg, byte *body, size_t size);
+//  Set message body to a buffer the message takes over, without a copy;
+//  free_fn (body, hint) is called once no copy of the message needs it
+_EXPORTS_API void
+    kvmsg_set_body_owned (kvmsg_t *kvmsg, byte *body, size_t size, zmq_free_fn *free_fn, void *hint);
 //  Set message key using printf format
 _EXPORTS_API void
     kvmsg_fmt_key (kvmsg_t *kvmsg, char *format, ...);
@@ -93,6 +145,40 @@ _EXPORTS_API void
 _EXPORTS_API void
     kvmsg_fmt_body (kvmsg_t *kvmsg, char *format, ...);
 
+//  Return cache hash from header, zero if none
+_EXPORTS_API uint
+    kvmsg_cachehash (kvmsg_t *kvmsg);
+//  Set cache hash in header
+_EXPORTS_API void
+    kvmsg_set_cachehash (kvmsg_t *kvmsg, uint cachehash);
+//  Return cache hash for a cache name, never zero
+_EXPORTS_API uint
+    kvmsg_hash_cacheid (char *cacheidstr);
+//  Return expiry from header in msecs, zero if none; a time to live
+//  if KVMSG_FLAG_TTL is set, else an absolute time
+_EXPORTS_API int64_t
+    kvmsg_expiry (kvmsg_t *kvmsg);
+//  Set absolute expiry in msecs, zero for none
+_EXPORTS_API void
+    kvmsg_set_expiry (kvmsg_t *kvmsg, int64_t expiry);
+//  Set time to live in msecs, zero for none
+_EXPORTS_API void
+    kvmsg_set_ttl (kvmsg_t *kvmsg, int64_t ttl);
+//  Return header flags
+_EXPORTS_API byte
+    kvmsg_flags (kvmsg_t *kvmsg);
+//  Set header flags
+_EXPORTS_API void
+    kvmsg_set_flags (kvmsg_t *kvmsg, byte flags);
+
+//  Set body to a batch of count updates, for the cache, flags and expiry
+//  of the message, and give the message a uuid for them
+_EXPORTS_API void
+    kvmsg_set_batch (kvmsg_t *kvmsg, char **keys, byte **values, size_t *sizes, size_t count);
+//  Return next update of a batch or pack as a new kvmsg, else NULL
+_EXPORTS_API kvmsg_t *
+    kvmsg_batch_next (kvmsg_t *kvmsg);
+
 //  Get message property, if set, else ""
 _EXPORTS_API char *
     kvmsg_get_prop (kvmsg_t *kvmsg, char *name);
@@ -113,6 +199,9 @@ _EXPORTS_API void
 //  Runs self test of class
 _EXPORTS_API int
     kvmsg_test (int verbose);
+//  Runs microbenchmark of class, frames against compact encoding
+_EXPORTS_API int
+    kvmsg_bench (size_t nbr_msgs);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,283 @@
+/*  =====================================================================
+*  pending - updates held by a passive server, indexed by uuid
+
+-------------------------------------------------------------------------
+Copyright (c) 1991-2013 Andre Charles Legendre <andre.legendre@kalimasystems.org>
+Copyright other contributors as noted in the AUTHORS file.
+
+This file is part of LevelDbCache, the shared in memory cache for levelDb Key Value store.
+
+This is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or (at
+your option) any later version.
+
+This software is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this program. If not, see
+<http://www.gnu.org/licenses/>.
+*  ===================================================================== */
+
+#include "stdafx.h"
+#include "pending.h"
+
+//  The passive server holds each update from a client until the same
+//  update comes from the active, and each update from the active until
+//  the client copy comes, if ever. Updates are kept in arrival order,
+//  for trimming and for replay when we go active, and indexed by uuid
+//  in a chained hash table, so matching one costs the same however many
+//  are held.
+#define PENDING_MIN_BUCKETS 256
+
+typedef struct _pitem_t pitem_t;
+struct _pitem_t {
+	pitem_t *prev;              //  Arrival order
+	pitem_t *next;
+	pitem_t *chain;             //  Next in hash bucket
+	kvmsg_t *kvmsg;
+	int64_t arrived;            //  Msecs
+	uint64_t hash;
+	Bool indexed;               //  FALSE if update has no uuid
+};
+
+//  Structure of our class
+struct _pending_t {
+	pitem_t **buckets;
+	size_t limit;               //  Number of buckets, a power of two
+	pitem_t *oldest;
+	pitem_t *newest;
+	size_t size;
+	size_t max_size;
+	int64_t max_age;
+	int64_t dropped;
+};
+
+//  Uuids are a node id and a counter; multiplying the counter by an odd
+//  constant spreads consecutive updates over every bucket
+static uint64_t
+	s_hash (byte *uuid)
+{
+	uint64_t node, counter;
+	memcpy (&node, uuid, 8);
+	memcpy (&counter, uuid + 8, 8);
+	return node ^ (counter * 0x9E3779B97F4A7C15ULL);
+}
+
+static void
+	s_rehash (pending_t *self, size_t limit)
+{
+	pitem_t *item;
+	free (self->buckets);
+	self->buckets = (pitem_t **) zmalloc (limit * sizeof (pitem_t *));
+	self->limit = limit;
+	for (item = self->oldest; item; item = item->next)
+		if (item->indexed) {
+			size_t bucket = (size_t) item->hash & (limit - 1);
+			item->chain = self->buckets [bucket];
+			self->buckets [bucket] = item;
+		}
+}
+
+//  Unlink item from the arrival list and from its bucket, and free it.
+//  Returns its update.
+
+static kvmsg_t *
+	s_unlink (pending_t *self, pitem_t *item)
+{
+	kvmsg_t *kvmsg = item->kvmsg;
+	if (item->indexed) {
+		pitem_t **link = &self->buckets [(size_t) item->hash & (self->limit - 1)];
+		while (*link != item)
+			link = &(*link)->chain;
+		*link = item->chain;
+	}
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		self->oldest = item->next;
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		self->newest = item->prev;
+	self->size--;
+	free (item);
+	return kvmsg;
+}
+
+//  Drop the oldest updates while over the limits
+static void
+	s_trim (pending_t *self, int64_t now)
+{
+	while (self->oldest
+	&& ((self->max_size && self->size > self->max_size)
+	||  (self->max_age && now - self->oldest->arrived > self->max_age))) {
+		kvmsg_t *kvmsg = s_unlink (self, self->oldest);
+		kvmsg_destroy (&kvmsg);
+		self->dropped++;
+	}
+}
+
+//  .split constructor and destructor
+
+pending_t *
+	pending_new (size_t max_size, int64_t max_age)
+{
+	pending_t *self = (pending_t *) zmalloc (sizeof (pending_t));
+	self->max_size = max_size;
+	self->max_age = max_age;
+	s_rehash (self, PENDING_MIN_BUCKETS);
+	return self;
+}
+
+void
+	pending_destroy (pending_t **self_p)
+{
+	assert (self_p);
+	if (*self_p) {
+		pending_t *self = *self_p;
+		while (self->oldest) {
+			kvmsg_t *kvmsg = s_unlink (self, self->oldest);
+			kvmsg_destroy (&kvmsg);
+		}
+		free (self->buckets);
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+//  .split add, remove and pop
+
+void
+	pending_add (pending_t *self, kvmsg_t **kvmsg_p)
+{
+	pitem_t *item;
+	byte *uuid;
+	assert (self);
+	assert (kvmsg_p && *kvmsg_p);
+	item = (pitem_t *) zmalloc (sizeof (pitem_t));
+	item->kvmsg = *kvmsg_p;
+	item->arrived = zclock_time ();
+	uuid = kvmsg_uuid (item->kvmsg);
+	if (uuid) {
+		size_t bucket;
+		if (self->size >= self->limit)
+			s_rehash (self, self->limit * 2);
+		item->hash = s_hash (uuid);
+		item->indexed = TRUE;
+		bucket = (size_t) item->hash & (self->limit - 1);
+		item->chain = self->buckets [bucket];
+		self->buckets [bucket] = item;
+	}
+	item->prev = self->newest;
+	if (self->newest)
+		self->newest->next = item;
+	else
+		self->oldest = item;
+	self->newest = item;
+	self->size++;
+	*kvmsg_p = NULL;
+	s_trim (self, item->arrived);
+}
+
+Bool
+	pending_remove (pending_t *self, byte *uuid)
+{
+	uint64_t hash;
+	pitem_t *item;
+	assert (self);
+	assert (uuid);
+	hash = s_hash (uuid);
+	item = self->buckets [(size_t) hash & (self->limit - 1)];
+	while (item) {
+		if (item->hash == hash && memcmp (kvmsg_uuid (item->kvmsg), uuid, 16) == 0) {
+			kvmsg_t *kvmsg = s_unlink (self, item);
+			kvmsg_destroy (&kvmsg);
+			return TRUE;
+		}
+		item = item->chain;
+	}
+	return FALSE;
+}
+
+kvmsg_t *
+	pending_pop (pending_t *self)
+{
+	assert (self);
+	if (!self->oldest)
+		return NULL;
+	return s_unlink (self, self->oldest);
+}
+
+size_t
+	pending_size (pending_t *self)
+{
+	assert (self);
+	return self->size;
+}
+
+int64_t
+	pending_dropped (pending_t *self)
+{
+	assert (self);
+	return self->dropped;
+}
+
+//  .split test method
+
+int
+	pending_test (int verbose)
+{
+	pending_t *pending;
+	kvmsg_t *kvmsg;
+	kvmsg_t *copy;
+	byte uuid [16];
+	int index;
+
+	printf (" * pending: ");
+	pending = pending_new (1000, 0);
+
+	//  Match in any order
+	for (index = 0; index < 1000; index++) {
+		kvmsg = kvmsg_new (index);
+		kvmsg_set_key  (kvmsg, "key");
+		kvmsg_set_uuid (kvmsg);
+		if (index == 500)
+			memcpy (uuid, kvmsg_uuid (kvmsg), 16);
+		pending_add (pending, &kvmsg);
+		assert (kvmsg == NULL);
+	}
+	assert (pending_size (pending) == 1000);
+	assert (pending_remove (pending, uuid));
+	assert (!pending_remove (pending, uuid));
+	assert (pending_size (pending) == 999);
+
+	//  Over the size limit the oldest go first
+	for (index = 0; index < 10; index++) {
+		kvmsg = kvmsg_new (0);
+		kvmsg_set_key (kvmsg, "more");
+		kvmsg_set_uuid (kvmsg);
+		pending_add (pending, &kvmsg);
+	}
+	assert (pending_size (pending) == 1000);
+	assert (pending_dropped (pending) == 9);
+	kvmsg = pending_pop (pending);
+	assert (kvmsg_sequence (kvmsg) == 9);
+
+	//  An update without uuid is held, never matched
+	copy = kvmsg_new (0);
+	kvmsg_set_key (copy, "nouuid");
+	pending_add (pending, &copy);
+	assert (!pending_remove (pending, kvmsg_uuid (kvmsg)));
+	kvmsg_destroy (&kvmsg);
+
+	while ((kvmsg = pending_pop (pending)) != NULL)
+		kvmsg_destroy (&kvmsg);
+	assert (pending_size (pending) == 0);
+	pending_destroy (&pending);
+	printf ("OK\n");
+	return 0;
+}
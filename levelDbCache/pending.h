@@ -0,0 +1,76 @@
+/*  =====================================================================
+*  pending - updates held by a passive server, indexed by uuid
+
+-------------------------------------------------------------------------
+Copyright (c) 1991-2013 Andre Charles Legendre <andre.legendre@kalimasystems.org>
+Copyright other contributors as noted in the AUTHORS file.
+
+This file is part of LevelDbCache, the shared in memory cache for levelDb Key Value store.
+
+This is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or (at
+your option) any later version.
+
+This software is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this program. If not, see
+<http://www.gnu.org/licenses/>.
+*  ===================================================================== */
+
+#ifndef __PENDING_H_INCLUDED__
+#define __PENDING_H_INCLUDED__
+
+#include "czmq.h"
+#include "kvmsg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _pending_t pending_t;
+
+//  Create a new pending set, holding at most max_size updates, for at
+//  most max_age msecs. Zero means no limit.
+pending_t *
+	pending_new (size_t max_size, int64_t max_age);
+
+//  Destroy a pending set, and the updates it holds
+void
+	pending_destroy (pending_t **self_p);
+
+//  Hold an update, the pending set owns it from now on. Updates over
+//  the size or age limits are dropped, oldest first.
+void
+	pending_add (pending_t *self, kvmsg_t **kvmsg_p);
+
+//  If an update with this uuid is held, destroy it and return TRUE
+Bool
+	pending_remove (pending_t *self, byte *uuid);
+
+//  Return oldest update held, or NULL; the caller owns it
+kvmsg_t *
+	pending_pop (pending_t *self);
+
+//  Return number of updates held
+size_t
+	pending_size (pending_t *self);
+
+//  Return number of updates dropped for size or age
+int64_t
+	pending_dropped (pending_t *self);
+
+//  Self test of this class
+int
+	pending_test (int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
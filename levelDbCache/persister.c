@@ -0,0 +1,255 @@
+/*  =====================================================================
+*  persister - write-behind LevelDB persistence thread
+
+-------------------------------------------------------------------------
+Copyright (c) 1991-2013 Andre Charles Legendre <andre.legendre@kalimasystems.org>
+Copyright other contributors as noted in the AUTHORS file.
+
+This file is part of LevelDbCache, the shared in memory cache for levelDb Key Value store.
+
+This is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or (at
+your option) any later version.
+
+This software is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this program. If not, see
+<http://www.gnu.org/licenses/>.
+*  ===================================================================== */
+
+#include "stdafx.h"
+#include "persister.h"
+#include "clone_log.h"
+
+//  One committed write batch waiting to be written
+typedef struct {
+	leveldb_t *db;
+	leveldb_writeoptions_t *options;
+	leveldb_writebatch_t *batch;
+	int64_t sequence;
+	volatile int64_t *persisted;
+} persist_job_t;
+
+//  Structure of our class
+//  The ring is single producer (the reactor), single consumer (our
+//  thread). Each side only ever writes its own index, so no lock is
+//  needed; the indexes are kept on separate cache lines.
+
+struct _persister_t {
+	zctx_t *ctx;                //  Context our thread runs in
+	void *pipe;                 //  Pipe through to persister thread
+	char name [256];            //  Name used in logs
+	persist_job_t *ring;        //  Ring of jobs
+	ulong mask;                 //  Ring size - 1
+	int64_t stalls;             //  Times producer found the ring full
+	char pad_head [64];
+	volatile long head;         //  Next slot to fill, producer only
+	char pad_tail [64];
+	volatile long tail;         //  Next slot to drain, consumer only
+	char pad_end [64];
+};
+
+static void persister_agent (void *args, zctx_t *ctx, void *pipe);
+
+//  .split constructor and destructor
+
+persister_t *
+	persister_new (zctx_t *ctx, char *name, uint ring_size)
+{
+	ulong size = 1;
+	persister_t *persister = (persister_t *) zmalloc (sizeof (persister_t));
+	while (size < ring_size)
+		size <<= 1;
+	persister->ctx = ctx;
+	persister->mask = size - 1;
+	persister->ring = (persist_job_t *) zmalloc (size * sizeof (persist_job_t));
+	strncpy (persister->name, name, sizeof (persister->name) - 1);
+	persister->pipe = zthread_fork (ctx, persister_agent, persister);
+	return persister;
+}
+
+void
+	persister_destroy (persister_t **persister_p)
+{
+	assert (persister_p);
+	if (*persister_p) {
+		persister_t *persister = *persister_p;
+		char *reply;
+		zstr_send (persister->pipe, "STOP");
+		reply = zstr_recv (persister->pipe);
+		free (reply);
+		free (persister->ring);
+		free (persister);
+		*persister_p = NULL;
+	}
+}
+
+//  .split producer side
+//  The reactor fills the next slot, then publishes it by moving head.
+//  If the ring is full we hand the batch back rather than wait for the
+//  thread. The thread blocks on its pipe once the ring is empty, so we
+//  wake it when we push onto a ring it has emptied; both sides move
+//  their index before they read the other's, so one of them always sees
+//  the new job:
+
+int
+	persister_push (persister_t *persister, leveldb_t *db, leveldb_writeoptions_t *options,
+	leveldb_writebatch_t *batch, int64_t sequence, volatile int64_t *persisted)
+{
+	persist_job_t *job;
+	long head;
+
+	assert (persister);
+	head = persister->head;
+	if ((ulong) (head - persister->tail) > persister->mask) {
+		if (persister->stalls++ == 0)
+			clone_log(LOG_LEVEL_WARNING, LOG_TYPE_PERSIST, "W: persister %s ring full, collector paused until LevelDB catches up", persister->name);
+		return -1;
+	}
+	job = &persister->ring [head & persister->mask];
+	job->db = db;
+	job->options = options;
+	job->batch = batch;
+	job->sequence = sequence;
+	job->persisted = persisted;
+	MemoryBarrier ();
+	persister->head = head + 1;
+	MemoryBarrier ();
+	if (persister->tail == head)
+		zstr_send (persister->pipe, "WAKE");
+	return 0;
+}
+
+uint
+	persister_depth (persister_t *persister)
+{
+	assert (persister);
+	return (uint) (persister->head - persister->tail);
+}
+
+uint
+	persister_size (persister_t *persister)
+{
+	assert (persister);
+	return (uint) persister->mask + 1;
+}
+
+int64_t
+	persister_stalls (persister_t *persister)
+{
+	assert (persister);
+	return persister->stalls;
+}
+
+void
+	persister_flush (persister_t *persister)
+{
+	char *reply;
+	assert (persister);
+	zstr_send (persister->pipe, "FLUSH");
+	reply = zstr_recv (persister->pipe);
+	free (reply);
+}
+
+//  .split record header
+//  These two helpers write and read the header we keep in front of
+//  every persisted value:
+
+static void
+	s_put_int64 (byte *dest, int64_t value)
+{
+	int shift;
+	for (shift = 56; shift >= 0; shift -= 8)
+		*dest++ = (byte) ((value >> shift) & 255);
+}
+
+static int64_t
+	s_get_int64 (byte *source)
+{
+	int index;
+	int64_t value = 0;
+	for (index = 0; index < 8; index++)
+		value = (value << 8) + source [index];
+	return value;
+}
+
+void
+	persister_record_encode (byte *record, int64_t sequence, int64_t expiry, byte flags)
+{
+	record [0] = PERSIST_RECORD_MAGIC;
+	record [1] = flags;
+	s_put_int64 (record + 2, sequence);
+	s_put_int64 (record + 10, expiry);
+}
+
+size_t
+	persister_record_decode (byte *record, size_t size, int64_t *sequence, int64_t *expiry, byte *flags)
+{
+	if (size < PERSIST_RECORD_HEADER || record [0] != PERSIST_RECORD_MAGIC) {
+		*sequence = 0;
+		*expiry = 0;
+		*flags = 0;
+		return 0;
+	}
+	*flags = record [1];
+	*sequence = s_get_int64 (record + 2);
+	*expiry = s_get_int64 (record + 10);
+	return PERSIST_RECORD_HEADER;
+}
+
+//  .split persister thread
+//  The thread writes every published job in order, then frees its slot.
+//  It only looks at its pipe when there is nothing left to write, and
+//  then waits on it for as long as it takes:
+
+static void
+	s_drain (persister_t *persister)
+{
+	long tail = persister->tail;
+	while (TRUE) {
+		char *errptr = NULL;
+		persist_job_t *job;
+		long head = persister->head;
+		MemoryBarrier ();
+		if (tail == head)
+			break;
+		job = &persister->ring [tail & persister->mask];
+		leveldb_write (job->db, job->options, job->batch, &errptr);
+		if (errptr) {
+			clone_log(LOG_LEVEL_ERROR, LOG_TYPE_PERSIST, "E: persister %s write up to sequence %I64d failed: %s", persister->name, job->sequence, errptr);
+			leveldb_free (errptr);
+		}
+		leveldb_writebatch_destroy (job->batch);
+		InterlockedExchange64 (job->persisted, job->sequence);
+		MemoryBarrier ();
+		persister->tail = ++tail;
+		MemoryBarrier ();
+	}
+}
+
+static void
+	persister_agent (void *args, zctx_t *ctx, void *pipe)
+{
+	persister_t *persister = (persister_t *) args;
+	while (TRUE) {
+		char *command;
+		s_drain (persister);
+		command = zstr_recv (pipe);
+		if (!command)
+			break;              //  Interrupted
+		s_drain (persister);
+		if (streq (command, "STOP")) {
+			zstr_send (pipe, "stopped");
+			free (command);
+			break;
+		}
+		else if (streq (command, "FLUSH"))
+			zstr_send (pipe, "flushed");
+		free (command);
+	}
+}
@@ -0,0 +1,98 @@
+/*  =====================================================================
+*  persister - write-behind LevelDB persistence thread
+
+-------------------------------------------------------------------------
+Copyright (c) 1991-2013 Andre Charles Legendre <andre.legendre@kalimasystems.org>
+Copyright other contributors as noted in the AUTHORS file.
+
+This file is part of LevelDbCache, the shared in memory cache for levelDb Key Value store.
+
+This is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or (at
+your option) any later version.
+
+This software is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this program. If not, see
+<http://www.gnu.org/licenses/>.
+*  ===================================================================== */
+
+#ifndef __PERSISTER_H_INCLUDED__
+#define __PERSISTER_H_INCLUDED__
+
+#include "czmq.h"
+#include "leveldb\c.h"
+
+//  Default number of write batches the ring can hold
+#define PERSISTER_RING_SIZE     4096
+
+//  Every persisted value starts with a fixed record header:
+//  byte 0:      magic
+//  byte 1:      flags
+//  bytes 2-9:   sequence (8 bytes, network order)
+//  bytes 10-17: absolute expiry in msecs, 0 if none (8 bytes, network order)
+#define PERSIST_RECORD_MAGIC    0xCB
+#define PERSIST_RECORD_HEADER   18
+#define PERSIST_FLAG_DELETED    1   //  Tombstone, the key was deleted
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _persister_t persister_t;
+
+//  Create a new persister and start its thread in the provided context.
+//  The ring size is rounded up to a power of two.
+persister_t *
+	persister_new (zctx_t *ctx, char *name, uint ring_size);
+
+//  Destroy a persister, after every queued batch has been written
+void
+	persister_destroy (persister_t **persister_p);
+
+//  Hand a write batch over to the persister thread; the persister owns
+//  the batch from now on. When it has been written, *persisted is set
+//  to sequence. Must only be called from one thread, the reactor.
+//  Returns -1 if the ring is full, in which case the caller keeps the
+//  batch, and should push it again once persister_depth has gone down.
+int
+	persister_push (persister_t *persister, leveldb_t *db, leveldb_writeoptions_t *options,
+	leveldb_writebatch_t *batch, int64_t sequence, volatile int64_t *persisted);
+
+//  Return number of batches waiting to be written
+uint
+	persister_depth (persister_t *persister);
+
+//  Return number of batches the ring can hold
+uint
+	persister_size (persister_t *persister);
+
+//  Return number of times the reactor found the ring full
+int64_t
+	persister_stalls (persister_t *persister);
+
+//  Wait until every batch pushed so far has been written
+void
+	persister_flush (persister_t *persister);
+
+//  Write a record header into the first PERSIST_RECORD_HEADER bytes
+//  of record
+void
+	persister_record_encode (byte *record, int64_t sequence, int64_t expiry, byte flags);
+
+//  Decode the header of a persisted value, returns the header size, which
+//  is zero for values written before record headers existed
+size_t
+	persister_record_decode (byte *record, size_t size, int64_t *sequence, int64_t *expiry, byte *flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
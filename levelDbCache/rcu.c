@@ -0,0 +1,228 @@
+/*  =====================================================================
+*  rcu - lock-free reads of structures that one thread changes
+
+-------------------------------------------------------------------------
+Copyright (c) 1991-2013 Andre Charles Legendre <andre.legendre@kalimasystems.org>
+Copyright other contributors as noted in the AUTHORS file.
+
+This file is part of LevelDbCache, the shared in memory cache for levelDb Key Value store.
+
+This is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or (at
+your option) any later version.
+
+This software is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this program. If not, see
+<http://www.gnu.org/licenses/>.
+*  ===================================================================== */
+
+#include "stdafx.h"
+#include "rcu.h"
+
+//  Readers count themselves in a slot picked by thread id, in the counter
+//  of the parity of the epoch they entered in. Slots are one cache line
+//  each, so readers on different threads share no line and scale with
+//  the cores. Threads that share a slot only share its counters.
+//
+//  Items are retired with the epoch of the writer. When no reader of
+//  the epoch before the current one is left, no reader can hold what
+//  was retired before the current epoch, so that is freed and the
+//  writer moves to the next epoch. New readers count in the parity of
+//  the new epoch, so the one the writer waits for only drains:
+#define RCU_SLOTS           64
+#define RCU_LINE            64
+
+typedef struct {
+	volatile long readers [2];  //  Readers inside, by epoch parity
+	byte pad [RCU_LINE - 2 * sizeof (long)];
+} rcuslot_t;
+
+typedef struct _rcuitem_t rcuitem_t;
+struct _rcuitem_t {
+	rcuitem_t *next;
+	void *item;
+	rcu_free_fn *free_fn;
+	int64_t epoch;              //  Epoch it was retired in
+};
+
+//  Structure of our class
+struct _rcu_t {
+	rcuslot_t slots [RCU_SLOTS];
+	volatile int64_t epoch;     //  Current epoch, only the writer moves it
+	rcuitem_t *retired;         //  Retired items, oldest first
+	rcuitem_t *retired_tail;
+	size_t nbr_retired;
+};
+
+//  .split constructor and destructor
+
+rcu_t *
+	rcu_new (void)
+{
+	rcu_t *self = (rcu_t *) zmalloc (sizeof (rcu_t));
+	return self;
+}
+
+static void
+	s_free_retired (rcu_t *self, int64_t epoch)
+{
+	while (self->retired && self->retired->epoch < epoch) {
+		rcuitem_t *retired = self->retired;
+		self->retired = retired->next;
+		(retired->free_fn) (retired->item);
+		free (retired);
+		self->nbr_retired--;
+	}
+	if (!self->retired)
+		self->retired_tail = NULL;
+}
+
+void
+	rcu_destroy (rcu_t **self_p)
+{
+	assert (self_p);
+	if (*self_p) {
+		rcu_t *self = *self_p;
+		s_free_retired (self, self->epoch + 1);
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+//  .split readers
+//  A reader that counts itself while the writer moves the epoch may be
+//  missed by the writer, so it checks the epoch again and retries. The
+//  interlocked increment orders that check, and the reads that follow,
+//  after the count:
+
+uint
+	rcu_read_lock (rcu_t *self)
+{
+	uint slot;
+	assert (self);
+	slot = (uint) (GetCurrentThreadId () >> 2) % RCU_SLOTS;
+	while (TRUE) {
+		int64_t epoch = self->epoch;
+		uint parity = (uint) epoch & 1;
+		InterlockedIncrement (&self->slots [slot].readers [parity]);
+		if (self->epoch == epoch)
+			return slot * 2 + parity;
+		InterlockedDecrement (&self->slots [slot].readers [parity]);
+	}
+}
+
+void
+	rcu_read_unlock (rcu_t *self, uint token)
+{
+	assert (self);
+	assert (token < RCU_SLOTS * 2);
+	InterlockedDecrement (&self->slots [token / 2].readers [token & 1]);
+}
+
+//  .split writer
+
+void
+	rcu_retire (rcu_t *self, void *item, rcu_free_fn *free_fn)
+{
+	rcuitem_t *retired;
+	assert (self);
+	assert (free_fn);
+	retired = (rcuitem_t *) zmalloc (sizeof (rcuitem_t));
+	retired->item = item;
+	retired->free_fn = free_fn;
+	retired->epoch = self->epoch;
+	if (self->retired_tail)
+		self->retired_tail->next = retired;
+	else
+		self->retired = retired;
+	self->retired_tail = retired;
+	self->nbr_retired++;
+}
+
+void
+	rcu_reclaim (rcu_t *self)
+{
+	uint slot;
+	uint parity;
+	assert (self);
+	if (!self->retired)
+		return;
+	//  Readers of the epoch before this one
+	parity = (uint) (self->epoch + 1) & 1;
+	for (slot = 0; slot < RCU_SLOTS; slot++)
+		if (self->slots [slot].readers [parity])
+			return;
+	s_free_retired (self, self->epoch);
+	if (self->retired)
+		InterlockedExchange64 (&self->epoch, self->epoch + 1);
+}
+
+size_t
+	rcu_retired (rcu_t *self)
+{
+	assert (self);
+	return self->nbr_retired;
+}
+
+//  .split test method
+//  The selftest plays the writer and a reader on one thread, checking
+//  that nothing is freed under a reader, and that a reader that stays
+//  does not keep the writer from freeing what came after it left:
+
+static void
+	s_test_free (void *item)
+{
+	(*(int *) item)++;
+}
+
+int
+	rcu_test (int verbose)
+{
+	rcu_t *rcu;
+	uint token;
+	int first = 0;
+	int second = 0;
+
+	printf (" * rcu: ");
+	rcu = rcu_new ();
+
+	//  Without readers, retired items go on the next reclaims
+	rcu_retire (rcu, &first, s_test_free);
+	assert (rcu_retired (rcu) == 1);
+	rcu_reclaim (rcu);
+	rcu_reclaim (rcu);
+	assert (first == 1);
+	assert (rcu_retired (rcu) == 0);
+
+	//  A reader holds what was retired while it was inside
+	token = rcu_read_lock (rcu);
+	rcu_retire (rcu, &first, s_test_free);
+	rcu_reclaim (rcu);
+	rcu_reclaim (rcu);
+	rcu_reclaim (rcu);
+	assert (first == 1);
+	rcu_read_unlock (rcu, token);
+	rcu_reclaim (rcu);
+	assert (first == 2);
+
+	//  A reader that enters later does not hold older items
+	rcu_retire (rcu, &second, s_test_free);
+	rcu_reclaim (rcu);
+	token = rcu_read_lock (rcu);
+	rcu_reclaim (rcu);
+	assert (second == 1);
+	rcu_read_unlock (rcu, token);
+
+	//  Destroy frees what is left
+	rcu_retire (rcu, &second, s_test_free);
+	rcu_destroy (&rcu);
+	assert (second == 2);
+	printf ("OK\n");
+	return 0;
+}
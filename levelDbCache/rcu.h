@@ -0,0 +1,80 @@
+/*  =====================================================================
+*  rcu - lock-free reads of structures that one thread changes
+
+-------------------------------------------------------------------------
+Copyright (c) 1991-2013 Andre Charles Legendre <andre.legendre@kalimasystems.org>
+Copyright other contributors as noted in the AUTHORS file.
+
+This file is part of LevelDbCache, the shared in memory cache for levelDb Key Value store.
+
+This is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or (at
+your option) any later version.
+
+This software is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this program. If not, see
+<http://www.gnu.org/licenses/>.
+*  ===================================================================== */
+
+
+#ifndef __RCU_H_INCLUDED__
+#define __RCU_H_INCLUDED__
+
+#include "czmq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _rcu_t rcu_t;
+
+//  Callback that frees an item once no reader can hold it
+typedef void (rcu_free_fn) (void *item);
+
+//  Create a new rcu, for one writer thread and any number of readers
+rcu_t *
+	rcu_new (void);
+
+//  Destroy an rcu, and free what it holds; no reader may be left
+void
+	rcu_destroy (rcu_t **self_p);
+
+//  Enter a read section, from any thread. Memory retired after this
+//  call is not freed before rcu_read_unlock. Returns a token for it.
+uint
+	rcu_read_lock (rcu_t *self);
+
+//  Leave the read section of token
+void
+	rcu_read_unlock (rcu_t *self, uint token);
+
+//  Writer: free item with free_fn once readers in a read section now
+//  have left it. The item must not be reachable by new readers.
+void
+	rcu_retire (rcu_t *self, void *item, rcu_free_fn *free_fn);
+
+//  Writer: free retired items that no reader can hold anymore. Never
+//  waits for readers, call it again later for the others.
+void
+	rcu_reclaim (rcu_t *self);
+
+//  Return number of items retired, not freed yet
+size_t
+	rcu_retired (rcu_t *self);
+
+//  Self test of this class
+int
+	rcu_test (int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,323 @@
+/*  =====================================================================
+*  ttlwheel - timing wheel of keys with a TTL
+
+-------------------------------------------------------------------------
+Copyright (c) 1991-2013 Andre Charles Legendre <andre.legendre@kalimasystems.org>
+Copyright other contributors as noted in the AUTHORS file.
+
+This file is part of LevelDbCache, the shared in memory cache for levelDb Key Value store.
+
+This is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or (at
+your option) any later version.
+
+This software is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this program. If not, see
+<http://www.gnu.org/licenses/>.
+*  ===================================================================== */
+
+#include "stdafx.h"
+#include "ttlwheel.h"
+
+//  The wheel is hierarchical: level 0 has one slot per tick, and each
+//  level above has slots TTLWHEEL_SLOTS times as wide. A key sits in the
+//  lowest level whose range reaches its tick. When level 0 wraps around,
+//  the next slot of level 1 is cascaded, its keys going down to the
+//  level that now fits them, and so on up. Each key is touched at most
+//  once per level, so the work is in the keys that expire, not in the
+//  keys that wait. With 10 msecs ticks the wheel spans about 497 days;
+//  keys due later are kept in the last slot reached and cascaded again.
+//  Each key is in the wheel once: items are doubly linked, and found by
+//  key in a hash, so that a new expiry moves the item and a remove frees
+//  it, and the wheel holds as many items as keys with a TTL.
+#define TTLWHEEL_LEVELS     4
+#define TTLWHEEL_BITS       8
+#define TTLWHEEL_SLOTS      (1 << TTLWHEEL_BITS)
+#define TTLWHEEL_MASK       (TTLWHEEL_SLOTS - 1)
+
+typedef struct _ttlitem_t ttlitem_t;
+struct _ttlitem_t {
+	ttlitem_t *next;
+	ttlitem_t *prev;
+	ttlitem_t **head;           //  List the item is in
+	int64_t expiry;             //  Absolute msecs
+	int64_t tick;               //  First tick at or after expiry
+	char key [1];
+};
+
+//  Structure of our class
+struct _ttlwheel_t {
+	int resolution;             //  Msecs per tick
+	int64_t tick;               //  Last tick processed
+	ttlitem_t *slots [TTLWHEEL_LEVELS][TTLWHEEL_SLOTS];
+	size_t waiting;             //  Keys in slots
+	ttlitem_t *due;             //  Keys due, not handed out yet
+	ttlitem_t *due_tail;
+	size_t nbr_due;
+	zhash_t *items;             //  Items by key
+};
+
+//  .split placing keys
+
+static void
+	s_push_due (ttlwheel_t *self, ttlitem_t *item)
+{
+	item->next = NULL;
+	item->prev = self->due_tail;
+	item->head = &self->due;
+	if (self->due_tail)
+		self->due_tail->next = item;
+	else
+		self->due = item;
+	self->due_tail = item;
+	self->nbr_due++;
+}
+
+//  Take item out of its list, wherever it is
+static void
+	s_unlink (ttlwheel_t *self, ttlitem_t *item)
+{
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		*item->head = item->next;
+	if (item->next)
+		item->next->prev = item->prev;
+	if (item->head == &self->due) {
+		if (self->due_tail == item)
+			self->due_tail = item->prev;
+		self->nbr_due--;
+	}
+	else
+		self->waiting--;
+}
+
+static void
+	s_place (ttlwheel_t *self, ttlitem_t *item)
+{
+	int64_t delta = item->tick - self->tick;
+	int64_t tick = item->tick;
+	int level;
+	size_t slot;
+	if (delta <= 0) {
+		s_push_due (self, item);
+		return;
+	}
+	for (level = 0; level < TTLWHEEL_LEVELS - 1; level++)
+		if (delta < (int64_t) 1 << (TTLWHEEL_BITS * (level + 1)))
+			break;
+	if (delta >= (int64_t) 1 << (TTLWHEEL_BITS * TTLWHEEL_LEVELS))
+		tick = self->tick + ((int64_t) 1 << (TTLWHEEL_BITS * TTLWHEEL_LEVELS)) - 1;
+	slot = (size_t) (tick >> (TTLWHEEL_BITS * level)) & TTLWHEEL_MASK;
+	item->head = &self->slots [level][slot];
+	item->prev = NULL;
+	item->next = *item->head;
+	if (item->next)
+		item->next->prev = item;
+	*item->head = item;
+	self->waiting++;
+}
+
+//  Hand the keys of the current slot of level down to lower levels.
+//  Returns TRUE unless that was slot 0, when the level above is due too:
+
+static Bool
+	s_cascade (ttlwheel_t *self, int level)
+{
+	size_t slot = (size_t) (self->tick >> (TTLWHEEL_BITS * level)) & TTLWHEEL_MASK;
+	ttlitem_t *item = self->slots [level][slot];
+	self->slots [level][slot] = NULL;
+	while (item) {
+		ttlitem_t *next = item->next;
+		self->waiting--;
+		s_place (self, item);
+		item = next;
+	}
+	return slot != 0;
+}
+
+//  Move one tick forwards
+static void
+	s_step (ttlwheel_t *self)
+{
+	int level;
+	self->tick++;
+	if ((self->tick & TTLWHEEL_MASK) == 0)
+		for (level = 1; level < TTLWHEEL_LEVELS; level++)
+			if (s_cascade (self, level))
+				break;
+	s_cascade (self, 0);
+}
+
+//  .split constructor and destructor
+
+ttlwheel_t *
+	ttlwheel_new (int resolution, int64_t now)
+{
+	ttlwheel_t *self = (ttlwheel_t *) zmalloc (sizeof (ttlwheel_t));
+	assert (resolution > 0);
+	self->resolution = resolution;
+	self->tick = now / resolution;
+	self->items = zhash_new ();
+	return self;
+}
+
+static void
+	s_free_items (ttlitem_t *item)
+{
+	while (item) {
+		ttlitem_t *next = item->next;
+		free (item);
+		item = next;
+	}
+}
+
+void
+	ttlwheel_destroy (ttlwheel_t **self_p)
+{
+	assert (self_p);
+	if (*self_p) {
+		ttlwheel_t *self = *self_p;
+		int level, slot;
+		for (level = 0; level < TTLWHEEL_LEVELS; level++)
+			for (slot = 0; slot < TTLWHEEL_SLOTS; slot++)
+				s_free_items (self->slots [level][slot]);
+		s_free_items (self->due);
+		zhash_destroy (&self->items);
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+//  .split add and expire
+
+void
+	ttlwheel_add (ttlwheel_t *self, char *key, int64_t expiry)
+{
+	ttlitem_t *item;
+	assert (self);
+	item = (ttlitem_t *) zhash_lookup (self->items, key);
+	if (item) {
+		if (item->expiry == expiry)
+			return;
+		s_unlink (self, item);
+	}
+	else {
+		size_t key_size = strlen (key);
+		item = (ttlitem_t *) malloc (sizeof (ttlitem_t) + key_size);
+		memcpy (item->key, key, key_size + 1);
+		zhash_insert (self->items, key, item);
+	}
+	item->expiry = expiry;
+	item->tick = (expiry + self->resolution - 1) / self->resolution;
+	s_place (self, item);
+}
+
+void
+	ttlwheel_remove (ttlwheel_t *self, char *key)
+{
+	ttlitem_t *item;
+	assert (self);
+	item = (ttlitem_t *) zhash_lookup (self->items, key);
+	if (item) {
+		s_unlink (self, item);
+		zhash_delete (self->items, key);
+		free (item);
+	}
+}
+
+size_t
+	ttlwheel_expire (ttlwheel_t *self, int64_t now, size_t max, ttlwheel_fn *callback, void *args)
+{
+	int64_t tick = now / self->resolution;
+	size_t expired = 0;
+	assert (self);
+	//  Nothing waiting, no need to walk the ticks in between
+	if (self->waiting == 0 && tick > self->tick)
+		self->tick = tick;
+	while (self->tick < tick && self->nbr_due < max)
+		s_step (self);
+	while (self->due && expired < max) {
+		ttlitem_t *item = self->due;
+		self->due = item->next;
+		if (self->due)
+			self->due->prev = NULL;
+		else
+			self->due_tail = NULL;
+		self->nbr_due--;
+		zhash_delete (self->items, item->key);
+		callback (item->key, item->expiry, args);
+		free (item);
+		expired++;
+	}
+	return expired;
+}
+
+size_t
+	ttlwheel_size (ttlwheel_t *self)
+{
+	assert (self);
+	return self->waiting + self->nbr_due;
+}
+
+//  .split test method
+
+static void
+	s_test_expired (char *key, int64_t expiry, void *args)
+{
+	int64_t now = *(int64_t *) args;
+	//  Not before expiry, nor later than one step of time and one tick
+	assert (expiry <= now);
+	assert (expiry > now - 997 - 10);
+}
+
+int
+	ttlwheel_test (int verbose)
+{
+	ttlwheel_t *wheel;
+	int64_t now = 1000000;
+	size_t expired = 0;
+	char key [32];
+	int index;
+
+	printf (" * ttlwheel: ");
+	wheel = ttlwheel_new (10, now);
+	for (index = 0; index < 10000; index++) {
+		sprintf (key, "key-%d", index);
+		//  From already due to about 3 days ahead, on every level
+		ttlwheel_add (wheel, key, now - 5 + (int64_t) index * index * 2654 % 259200000);
+	}
+	ttlwheel_add (wheel, "far", now + (int64_t) 600 * 24 * 3600 * 1000);
+	assert (ttlwheel_size (wheel) == 10001);
+
+	//  A key added again moves, a key removed goes
+	ttlwheel_add (wheel, "moved", now + 5000);
+	ttlwheel_add (wheel, "moved", now + 7000);
+	ttlwheel_add (wheel, "gone", now - 5);
+	ttlwheel_remove (wheel, "gone");
+	ttlwheel_remove (wheel, "moved");
+	ttlwheel_add (wheel, "moved", now + 9000);
+	assert (ttlwheel_size (wheel) == 10002);
+
+	//  Nothing is handed out before its expiry, in batches of 100
+	while (now < 1000000 + 259200000) {
+		size_t batch = ttlwheel_expire (wheel, now, 100, s_test_expired, &now);
+		assert (batch <= 100);
+		expired += batch;
+		if (batch < 100)
+			now += 997;
+	}
+	assert (expired == 10001);
+	assert (ttlwheel_size (wheel) == 1);
+	if (verbose)
+		printf ("%Iu expired ", expired);
+	ttlwheel_destroy (&wheel);
+	printf ("OK\n");
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*  =====================================================================
+*  ttlwheel - timing wheel of keys with a TTL
+
+-------------------------------------------------------------------------
+Copyright (c) 1991-2013 Andre Charles Legendre <andre.legendre@kalimasystems.org>
+Copyright other contributors as noted in the AUTHORS file.
+
+This file is part of LevelDbCache, the shared in memory cache for levelDb Key Value store.
+
+This is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 3 of the License, or (at
+your option) any later version.
+
+This software is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this program. If not, see
+<http://www.gnu.org/licenses/>.
+*  ===================================================================== */
+
+#ifndef __TTLWHEEL_H_INCLUDED__
+#define __TTLWHEEL_H_INCLUDED__
+
+#include "czmq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _ttlwheel_t ttlwheel_t;
+
+//  Callback for ttlwheel_expire, called once for each key that is due
+typedef void (ttlwheel_fn) (char *key, int64_t expiry, void *args);
+
+//  Create a new timing wheel, ticking every resolution msecs from now
+ttlwheel_t *
+	ttlwheel_new (int resolution, int64_t now);
+
+//  Destroy a timing wheel, and the keys it holds
+void
+	ttlwheel_destroy (ttlwheel_t **self_p);
+
+//  Add key, due at expiry msecs. The key is copied. Adding a key that is
+//  already there moves it to the new expiry.
+void
+	ttlwheel_add (ttlwheel_t *self, char *key, int64_t expiry);
+
+//  Remove key, if it is there
+void
+	ttlwheel_remove (ttlwheel_t *self, char *key);
+
+//  Move the wheel up to now and hand out at most max keys that are due,
+//  earliest tick first. Keys left over are handed out on the next call.
+//  Returns number of keys handed out.
+size_t
+	ttlwheel_expire (ttlwheel_t *self, int64_t now, size_t max, ttlwheel_fn *callback, void *args);
+
+//  Return number of keys in the wheel
+size_t
+	ttlwheel_size (ttlwheel_t *self);
+
+//  Self test of this class
+int
+	ttlwheel_test (int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif